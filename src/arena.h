@@ -0,0 +1,107 @@
+/*
+arena.h
+bump allocation for data that is freed all at once
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE (256 * 1024)           // bytes per block of small allocations
+#define ARENA_LARGE_SIZE (ARENA_BLOCK_SIZE / 4) // allocations above this get a block of their own
+#define ARENA_ALIGN sizeof(max_align_t)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    size_t size; // usable bytes
+    size_t used;
+    max_align_t data[];
+} ArenaBlock;
+
+/**
+ * Small allocations are carved from the newest block and never freed one by one; arena_free releases them all.
+ * Large ones get a block of their own behind it, so they can grow with realloc like a heap buffer.
+ */
+typedef struct Arena {
+    ArenaBlock *head;
+    void *last; // most recent allocation, which can grow in place
+} Arena;
+
+void arena_init(Arena *a) {
+    a->head = NULL;
+    a->last = NULL;
+}
+
+size_t arena_round(size_t size) { return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1); }
+
+ArenaBlock *arena_block(size_t size, size_t used, ArenaBlock *prev) {
+    ArenaBlock *b = malloc(sizeof(ArenaBlock) + size);
+    b->prev = prev;
+    b->size = size;
+    b->used = used;
+    return b;
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+    size = arena_round(size);
+    if (size > ARENA_LARGE_SIZE) {
+        // a full block, so small allocations never go into it
+        if (!a->head) {
+            a->head = arena_block(0, 0, NULL);
+        }
+        ArenaBlock *b = arena_block(size, size, a->head->prev);
+        a->head->prev = b;
+        return b->data;
+    }
+    if (!a->head || a->head->size - a->head->used < size) {
+        // the rest of the current block is given up
+        a->head = arena_block(ARENA_BLOCK_SIZE, 0, a->head);
+    }
+    void *p = (char *)a->head->data + a->head->used;
+    a->head->used += size;
+    a->last = p;
+    return p;
+}
+
+/**
+ * Resize an allocation like realloc; old_size is the size it was allocated or last grown with. Large allocations are
+ * reallocated, and the most recent small one grows in place while its block has room. Anything else is copied to a
+ * new allocation and the old space stays unused until the arena is freed.
+ */
+void *arena_grow(Arena *a, void *ptr, size_t old_size, size_t new_size) {
+    if (ptr && arena_round(old_size) > ARENA_LARGE_SIZE) {
+        ArenaBlock *old = (ArenaBlock *)((char *)ptr - offsetof(ArenaBlock, data));
+        ArenaBlock **link = &a->head->prev;
+        while (*link != old) {
+            link = &(*link)->prev;
+        }
+        size_t size = arena_round(new_size);
+        *link = realloc(old, sizeof(ArenaBlock) + size);
+        (*link)->size = size;
+        (*link)->used = size;
+        return (*link)->data;
+    }
+    if (ptr && ptr == a->last && arena_round(new_size) <= ARENA_LARGE_SIZE) {
+        size_t start = (char *)ptr - (char *)a->head->data;
+        if (new_size <= a->head->size - start) {
+            a->head->used = start + arena_round(new_size);
+            return ptr;
+        }
+    }
+    void *p = arena_alloc(a, new_size);
+    if (ptr) {
+        memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return p;
+}
+
+void arena_free(Arena *a) {
+    while (a->head) {
+        ArenaBlock *prev = a->head->prev;
+        free(a->head);
+        a->head = prev;
+    }
+    a->last = NULL;
+}
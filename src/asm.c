@@ -6,10 +6,14 @@
 typedef struct {
     bool compat;
     bool debug_tokens;
+    bool dump_src; // assemble in passes, dumping the program after the first
 } AssemblerOptions;
 
 int main(int argc, char **argv) {
     printf("[REGULAR_ad] assembler v2.0\n");
+    if (!isa_check_slots()) {
+        return 1;
+    }
     if (argc < 3) {
         printf("usage: asm <in> <out> --opts\n");
     }
@@ -19,6 +23,7 @@ int main(int argc, char **argv) {
     AssemblerOptions options = {
         .compat = false,
         .debug_tokens = false,
+        .dump_src = false,
     };
 
     for (int i = 3; i < argc; i++) {
@@ -31,6 +36,9 @@ int main(int argc, char **argv) {
             options.debug_tokens = true;
             printf("token dumping enabled\n");
         }
+        if (streq(flg, "--dump-src")) {
+            options.dump_src = true;
+        }
     }
 
     // open input file
@@ -50,50 +58,64 @@ int main(int argc, char **argv) {
     FileReadResult inf_read = util_read_file_contents(inf_fp);
     fclose(inf_fp);
 
+    // everything from lexing to compiling is allocated here and freed together
+    Arena arena;
+    arena_init(&arena);
+
     // run lexer on the input text
-    LexResult lex_result = lex(inf_read.content, inf_read.size);
+    LexResult lex_result = lex(&arena, inf_read.content, inf_read.size);
     if (options.debug_tokens) {
         printf("== TOKENS ==\n");
         for (int i = 0; i < lex_result.token_count; i++) {
-            Token tok = buf_get_Token(&lex_result.tokens, i);
+            Token tok = lex_token(&lex_result, i);
             // print token
-            printf("%4d TOK: %10s [%3d]\n", i, tok.cont, (int)tok.kind);
+            printf("%4d TOK: %10.*s [%3d] @%d:%d\n", i, tok.len, tok.str, (int)tok.kind, tok.line, tok.col);
         }
     }
     // parse the tokens into a program
     printf("== PARSE ==\n");
-    // parse program with utility instructions
-    SourceProgram source = parse(lex_result);
-    if (source.status != 0) { // unsuccessful program
-        printf("assembly pass 0 failed [%d]\n", source.status);
+    CompiledProgram compiled;
+    int status;
+    if (options.dump_src) {
+        // parse program with utility instructions
+        SourceProgram source = parse(&arena, lex_result);
+        status = source.status;
+        if (status == 0) {
+            // dump the pass 0 program
+            printf("== DUMP [src] ==\n");
+            dump_source_program(source);
+
+            // simplify program
+            SourceProgram final = simplify_pseudo_2pass(source);
+
+            compiled = compile_program(final);
+        }
+    } else {
+        status = assemble(&arena, lex_result, &compiled);
+    }
+    if (status != 0) { // unsuccessful program
+        printf("assembly pass 0 failed [%d]\n", status);
+        arena_free(&arena);
+        free(inf_read.content);
         return 2;
     }
 
-    // dump the pass 0 program
-    printf("== DUMP [src] ==\n");
-    dump_source_program(source);
-
-    // simplify program
-    SourceProgram final = simplify_pseudo_2pass(source);
-    free_source_program(source, false);
-
-    CompiledProgram compiled = compile_program(final);
-
     // dump the compiled program
     printf("== DUMP [cmp] ==\n");
     dump_compiled_program(compiled, true);
 
     // write out the program to binary
     printf("== WRITE ==\n");
-    write_compiled_program(ouf_fp, compiled);
+    if (!write_compiled_program(ouf_fp, &arena, compiled)) {
+        fprintf(stderr, "cannot write output file\n");
+        status = 1;
+    }
 
     // clean up
+    arena_free(&arena);
     free(inf_read.content);
-    free_compiled_program(compiled);
-    free_source_program(final, true);
-    free_lex_result(&lex_result);
 
     fclose(ouf_fp); // close output file
 
-    return 0;
+    return status;
 }
@@ -5,6 +5,7 @@ provides lexer and parser for the assembler
 
 #pragma once
 
+#include "ds.h"
 #include "instr.h"
 #include "lex.h"
 #include <stdint.h>
@@ -15,7 +16,8 @@ provides lexer and parser for the assembler
 /* #region Parser */
 
 typedef struct {
-    char *label;    // label name
+    const char *label; // label name, a slice of the source
+    int label_len;
     int add_offset; // add offset
 } RefValueSource;
 
@@ -50,6 +52,7 @@ typedef struct {
     BYTE *data;
     uint16_t data_size;
     int status;
+    Arena *arena; // holds the statements and data
 } SourceProgram;
 
 typedef struct {
@@ -60,7 +63,7 @@ typedef struct {
 } CompiledProgram;
 
 typedef struct {
-    char *name;
+    Token name;
     int offset;
 } LabelDef;
 
@@ -70,75 +73,76 @@ typedef enum { MACROARG_REG, MACROARG_VAL } MacroArgType;
 
 typedef struct {
     MacroArgType type; // REG, VAL
-    char *name;        // argument name
+    Token name;        // argument name
 } MacroArg;
 
 BUFFIE_OF(MacroArg)
 
+typedef enum {
+    MACRO_OPERAND_LIT,     // read when the macro was defined
+    MACRO_OPERAND_ARG_REG, // register named by a macro argument
+    MACRO_OPERAND_ARG_VAL, // value given by a macro argument, or read from the source if it is missing
+    MACRO_OPERAND_SOURCE,  // value read from the source where the macro is used
+} MacroOperandKind;
+
+typedef struct {
+    BYTE kind; // MacroOperandKind
+    BYTE arg;  // macro argument index for the ARG kinds
+} MacroOperand;
+
+/**
+ * A statement of a macro body, parsed when the macro is defined. Expanding it copies stmt and patches in the operands
+ * that depend on the arguments.
+ */
 typedef struct {
-    const char *mnem;
-    const char *a1, *a2, *a3;
-} RawStatement;
+    AStatement stmt;
+    MacroOperand operands[3];
+    BYTE sz; // bytes of the instruction
+} MacroStatement;
 
-BUFFIE_OF(RawStatement)
+BUFFIE_OF(MacroStatement)
 
 typedef struct {
-    char *name;
+    Token name;
     Buffie_MacroArg args;
-    Buffie_RawStatement statements;
+    Buffie_MacroStatement body;
 } MacroDef;
 
 BUFFIE_OF(MacroDef)
 
-typedef struct {
+typedef struct ParserState {
+    Arena *arena;           // everything the parser allocates, freed with the assembly
     LexResult *lexed;
     int token;              // token index
-    int cpos;               // char position of reading
     int offset;             // binary output position
     Buffie_LabelDef labels; // label buffer
     Buffie_MacroDef macros; // macro buffer
+    Hashtable label_index;  // label name to index in labels
+    Hashtable macro_index;  // macro name to index in macros
+    SourceProgram *src;     // program being parsed; its statements are kept unless emit is set
+    struct Emitter *emitter;
+    void (*emit)(struct ParserState *st, AStatement stmt); // takes each statement instead of src
 } ParserState;
 
-void source_program_init(SourceProgram *p) {
-    buf_alloc_AStatement(&p->statements, 128);
+void source_program_init(SourceProgram *p, Arena *arena) {
+    buf_alloc_in_AStatement(&p->statements, arena, 128);
     p->entry = 0;
     p->status = 0;
     p->data = NULL;
     p->data_size = 0;
-}
-
-void parser_state_cleanup(ParserState *st) {
-    // clean up labels
-    for (size_t i = 0; i < st->labels.ct; i++) {
-        LabelDef ld = buf_get_LabelDef(&st->labels, i);
-        free(ld.name);
-    }
-    buf_free_LabelDef(&st->labels);
-    // clean up macros
-    for (size_t i = 0; i < st->macros.ct; i++) {
-        MacroDef md = buf_get_MacroDef(&st->macros, i);
-        free(md.name);
-        for (size_t j = 0; j < md.args.ct; j++) {
-            MacroArg arg = buf_get_MacroArg(&md.args, j);
-            free(arg.name);
-        }
-        buf_free_MacroArg(&md.args);
-        buf_free_RawStatement(&md.statements);
-    }
-    buf_free_MacroDef(&st->macros);
+    p->arena = arena;
 }
 
 Token peek_token(ParserState *st) {
     if (st->token > st->lexed->token_count - 1) {
-        return (Token){.kind = UNKNOWN};
+        return (Token){.str = "", .len = 0, .kind = UNKNOWN};
     }
-    return buf_get_Token(&st->lexed->tokens, st->token);
+    return lex_token(st->lexed, st->token);
 }
 
 Token take_token(ParserState *st) {
     Token tok = peek_token(st);
     st->token++;
-    st->cpos += strlen(tok.cont);
     return tok;
 }
 
@@ -150,36 +154,44 @@ Token expect_token(ParserState *st, CharType type) {
         return take_token(st);
     } else {
         // expected token not found
-        printf("unexpected token#%d @%d: %s [%d]\n", st->token, st->cpos, next.cont, next.kind);
-        return (Token){.cont = NULL, .kind = UNKNOWN};
+        printf("unexpected token#%d @%d:%d: %.*s [%d]\n", st->token, next.line, next.col, next.len, next.str,
+               next.kind);
+        return (Token){.str = "", .len = 0, .kind = UNKNOWN};
     }
 }
 
-uint32_t parse_numeric(const char* num) { // interpret numeric constant
-    char pfx = num[0];
-    // create a new string without the prefix
-    int num_len = strlen(num) - 1;
-    char *num_str = malloc(num_len + 1);
-    strncpy(num_str, num + 1, num_len);
-    num_str[num_len] = '\0';
-    // convert base
+uint32_t parse_numeric(Token num) { // interpret numeric constant
+    char pfx = num.len > 0 ? num.str[0] : '\0';
+    // convert base, reading digits after the prefix up to the first one that does not belong
     uint32_t val = 0;
     switch (pfx) {
     case '$': {
         // interpret as base-16
-        val = (int)strtol(num_str, NULL, 16);
+        for (int i = 1; i < num.len; i++) {
+            char c = num.str[i];
+            if (c >= '0' && c <= '9') {
+                val = val * 16 + (c - '0');
+            } else if (c >= 'a' && c <= 'f') {
+                val = val * 16 + (c - 'a' + 10);
+            } else if (c >= 'A' && c <= 'F') {
+                val = val * 16 + (c - 'A' + 10);
+            } else {
+                break;
+            }
+        }
         break;
     }
     case '.': {
         // interpret as base-10
-        val = atoi(num_str);
+        for (int i = 1; i < num.len && num.str[i] >= '0' && num.str[i] <= '9'; i++) {
+            val = val * 10 + (num.str[i] - '0');
+        }
         break;
     }
     default:
         // invalid numeric
         printf("ERR: invalid numeric prefix %c", pfx);
     }
-    free(num_str); // free numstr
     return val;
 }
 
@@ -192,12 +204,12 @@ ValueSource read_value_arg(ParserState *st) {
         expect_token(st, MARK); // eat the mark
         Token label_ref_tok = expect_token(st, IDENTIFIER);
         vs.kind = VS_REF;
-        vs.ref = (RefValueSource){.label = label_ref_tok.cont, .add_offset = 0};
+        vs.ref = (RefValueSource){.label = label_ref_tok.str, .label_len = label_ref_tok.len, .add_offset = 0};
         Token pk_offset = peek_token(st);
         if (pk_offset.kind == OFFSET) {
             expect_token(st, OFFSET); // eat the offset token
             Token num_tok = expect_token(st, NUMERIC_CONSTANT);
-            uint32_t offset_val = parse_numeric(num_tok.cont);
+            uint32_t offset_val = parse_numeric(num_tok);
             vs.ref.add_offset = offset_val;
         }
         return vs;
@@ -205,43 +217,43 @@ ValueSource read_value_arg(ParserState *st) {
         // interpret numeric token
         Token num_tok = expect_token(st, NUMERIC_CONSTANT);
         vs.kind = VS_IMM;
-        vs.val = parse_numeric(num_tok.cont);
+        vs.val = parse_numeric(num_tok);
         return vs;
     } else {
-        printf("ERR: unrecognized token %s for value arg\n", next.cont);
+        printf("ERR: unrecognized token %.*s for value arg\n", next.len, next.str);
     }
     return vs;
 }
 
-AStatement read_statement(ParserState *pst, const char *mnem, const char *a1, const char *a2, const char *a3) {
+AStatement read_statement(ParserState *pst, Token mnem, Token a1, Token a2, Token a3) {
     // given guaranteed validation of opcode
-    InstructionInfo info = get_instruction_info(mnem);
+    InstructionInfo info = get_instruction_info_n(mnem.str, mnem.len);
     AStatement stmt = IMM_STATEMENT(info.opcode, 0, 0, 0);
     stmt.op = info.opcode;
 
     // read the instruction data
     if ((info.type & INSTR_K_R1) > 0) {
-        stmt.a1 = IMM_ARG(get_register(a1));
+        stmt.a1 = IMM_ARG(get_register_n(a1.str, a1.len));
     }
     if ((info.type & INSTR_K_R2) > 0) {
-        stmt.a2 = IMM_ARG(get_register(a2));
+        stmt.a2 = IMM_ARG(get_register_n(a2.str, a2.len));
     }
     if ((info.type & INSTR_K_R3) > 0) {
-        stmt.a3 = IMM_ARG(get_register(a3));
+        stmt.a3 = IMM_ARG(get_register_n(a3.str, a3.len));
     }
 
     if ((info.type & INSTR_K_I1) > 0) {
-        if (a1)
+        if (a1.len)
             stmt.a1 = IMM_ARG(parse_numeric(a1));
         else
             stmt.a1 = read_value_arg(pst);
     } else if ((info.type & INSTR_K_I2) > 0) {
-        if (a2)
+        if (a2.len)
             stmt.a2 = IMM_ARG(parse_numeric(a2));
         else
             stmt.a2 = read_value_arg(pst);
     } else if ((info.type & INSTR_K_I3) > 0) {
-        if (a3)
+        if (a3.len)
             stmt.a3 = IMM_ARG(parse_numeric(a3));
         else
             stmt.a3 = read_value_arg(pst);
@@ -250,141 +262,194 @@ AStatement read_statement(ParserState *pst, const char *mnem, const char *a1, co
     return stmt;
 }
 
-int match_macro_argdef(MacroDef *md, const char *arg) {
-    if (!arg) return -1;
+int match_macro_argdef(MacroDef *md, Token arg) {
+    if (!arg.len) return -1;
     for (size_t i = 0; i < md->args.ct; i++) {
         MacroArg arg_def = buf_get_MacroArg(&md->args, i);
-        if (streq(arg_def.name, arg)) {
+        if (tok_eq(arg_def.name, arg)) {
             return i;
         }
     }
     return -1;
 }
 
-void expand_macro(ParserState *pst, MacroDef *md, Buffie_AStatement *statements) {
-    // printf("unrolling macro: %s\n", md->name);
-    const char *inputs[md->args.ct];
+/**
+ * Parse a statement of a macro body like read_statement, noting which operands come from the macro's arguments.
+ * Arguments that are not given have length 0.
+ */
+MacroStatement compile_macro_statement(MacroDef *md, Token mnem, Token a1, Token a2, Token a3) {
+    InstructionInfo info = get_instruction_info_n(mnem.str, mnem.len);
+    MacroStatement ms = {.stmt = IMM_STATEMENT(info.opcode, 0, 0, 0), .sz = info.sz};
+    Token args[3] = {a1, a2, a3};
+    ValueSource *vals[3] = {&ms.stmt.a1, &ms.stmt.a2, &ms.stmt.a3};
+    const InstructionType reg_kinds[3] = {INSTR_K_R1, INSTR_K_R2, INSTR_K_R3};
+    // like read_statement, only the first immediate operand is read
+    int imm = (info.type & INSTR_K_I1) ? 0 : (info.type & INSTR_K_I2) ? 1 : (info.type & INSTR_K_I3) ? 2 : -1;
+
+    for (int k = 0; k < 3; k++) {
+        int arg = match_macro_argdef(md, args[k]);
+        ms.operands[k] = (MacroOperand){.kind = MACRO_OPERAND_LIT, .arg = arg >= 0 ? arg : 0};
+        if (k == imm) {
+            if (arg >= 0) {
+                ms.operands[k].kind = MACRO_OPERAND_ARG_VAL;
+            } else if (args[k].len) {
+                *vals[k] = IMM_ARG(parse_numeric(args[k]));
+            } else {
+                ms.operands[k].kind = MACRO_OPERAND_SOURCE;
+            }
+        } else if ((info.type & reg_kinds[k]) > 0) {
+            if (arg >= 0) {
+                ms.operands[k].kind = MACRO_OPERAND_ARG_REG;
+            } else {
+                *vals[k] = IMM_ARG(get_register_n(args[k].str, args[k].len));
+            }
+        }
+    }
+    return ms;
+}
+
+void parser_emit(ParserState *st, AStatement stmt) {
+    if (st->emit) {
+        st->emit(st, stmt);
+    } else {
+        buf_push_AStatement(&st->src->statements, stmt);
+    }
+}
+
+void expand_macro(ParserState *pst, MacroDef *md) {
+    // printf("unrolling macro: %.*s\n", md->name.len, md->name.str);
+    Token inputs[md->args.ct];
     // save the input args
     for (size_t i = 0; i < md->args.ct; i++) {
-        Token input_arg = expect_token(pst, IDENTIFIER);
-        inputs[i] = input_arg.cont;
-    }
-    // unroll and expand the macro
-    for (size_t i = 0; i < md->statements.ct; i++) {
-        // take the next statement
-        RawStatement raw_stmt = buf_get_RawStatement(&md->statements, i);
-        // replace the raw args with matching args, if applicable
-        int matched_argdef1 = match_macro_argdef(md, raw_stmt.a1);
-        if (matched_argdef1 >= 0)
-            raw_stmt.a1 = inputs[matched_argdef1];
-        int matched_argdef2 = match_macro_argdef(md, raw_stmt.a2);
-        if (matched_argdef2 >= 0)
-            raw_stmt.a2 = inputs[matched_argdef2];
-        int matched_argdef3 = match_macro_argdef(md, raw_stmt.a3);
-        if (matched_argdef3 >= 0)
-            raw_stmt.a3 = inputs[matched_argdef3];
-        AStatement st = read_statement(pst, raw_stmt.mnem, raw_stmt.a1, raw_stmt.a2, raw_stmt.a3);
-        buf_push_AStatement(statements, st);
-        InstructionInfo info = get_instruction_info(raw_stmt.mnem);
-        pst->offset += info.sz;
-    }
-}
-
-void define_macro(ParserState *st, const char *name) {
+        inputs[i] = expect_token(pst, IDENTIFIER);
+    }
+    // copy the body, patching in the args
+    for (size_t i = 0; i < md->body.ct; i++) {
+        const MacroStatement *ms = &md->body.buf[i];
+        AStatement st = ms->stmt;
+        ValueSource *vals[3] = {&st.a1, &st.a2, &st.a3};
+        for (int k = 0; k < 3; k++) {
+            const Token *input = &inputs[ms->operands[k].arg];
+            switch (ms->operands[k].kind) {
+            case MACRO_OPERAND_ARG_REG:
+                *vals[k] = IMM_ARG(get_register_n(input->str, input->len));
+                break;
+            case MACRO_OPERAND_ARG_VAL:
+                // a missing argument is read from the source, which is how label references are passed
+                *vals[k] = input->len ? IMM_ARG(parse_numeric(*input)) : read_value_arg(pst);
+                break;
+            case MACRO_OPERAND_SOURCE:
+                *vals[k] = read_value_arg(pst);
+                break;
+            }
+        }
+        parser_emit(pst, st);
+        pst->offset += ms->sz;
+    }
+}
+
+/**
+ * Define a macro from its argument list and body. Returns false if the name is already a macro.
+ */
+bool define_macro(ParserState *st, Token name) {
     MacroDef def;
-    def.name = util_strdup(name);
-    buf_alloc_MacroArg(&def.args, 4);
+    def.name = name;
+    buf_alloc_in_MacroArg(&def.args, st->arena, 4);
     while (peek_token(st).kind != MARK) {
         Token arg = expect_token(st, IDENTIFIER); // expect an argument bind
         MacroArg arg_def;
-        arg_def.name = util_strdup(arg.cont);
-        if (arg_def.name[0] == 'r') {
+        arg_def.name = arg;
+        if (arg.str[0] == 'r') {
             arg_def.type = MACROARG_REG;
-        } else if (arg_def.name[0] == 'v') {
+        } else if (arg.str[0] == 'v') {
             arg_def.type = MACROARG_VAL;
         }
         buf_push_MacroArg(&def.args, arg_def);
     }
     expect_token(st, MARK); // eat the mark
     // interpret the macro body
-    buf_alloc_RawStatement(&def.statements, 4);
+    buf_alloc_in_MacroStatement(&def.body, st->arena, 4);
     while (true) {
         Token next = peek_token(st);
-        if (next.kind == MARK && streq(next.cont, "::")) {
+        if (next.kind == MARK && tok_is(next, "::")) {
             expect_token(st, MARK); // end of macro def
             break;
         }
         // otherwise, we should have an identifier
         Token iden = expect_token(st, IDENTIFIER);
-        const char *mnem = iden.cont;
-        InstructionInfo info = get_instruction_info(mnem);
-        const char *a1 = NULL, *a2 = NULL, *a3 = NULL;
+        InstructionInfo info = get_instruction_info_n(iden.str, iden.len);
+        Token a1 = {.len = 0}, a2 = {.len = 0}, a3 = {.len = 0};
         if (info.type == INSTR_INV) { // not a base instruction
                                       // we don't support referencing macros within macros
-            printf("unrecognized mnemonic: %s\n", mnem);
+            printf("unrecognized mnemonic: %.*s\n", iden.len, iden.str);
         } else {
             if ((info.type & (INSTR_K_R1 | INSTR_K_I1)) > 0) {
-                a1 = take_token(st).cont;
+                a1 = take_token(st);
             }
             if ((info.type & (INSTR_K_R2 | INSTR_K_I2)) > 0) {
-                a2 = take_token(st).cont;
+                a2 = take_token(st);
             }
             if ((info.type & (INSTR_K_R3 | INSTR_K_I3)) > 0) {
-                a3 = take_token(st).cont;
+                a3 = take_token(st);
             }
         }
-        RawStatement raw_stmt = (RawStatement){.mnem = mnem, .a1 = a1, .a2 = a2, .a3 = a3};
-        buf_push_RawStatement(&def.statements, raw_stmt);
+        buf_push_MacroStatement(&def.body, compile_macro_statement(&def, iden, a1, a2, a3));
     }
 
+    // the body is read either way, so parsing carries on after it
+    if (!hashtable_put(&st->macro_index, name.str, name.len, st->macros.ct)) {
+        printf("ERROR: macro %.*s is already defined\n", name.len, name.str);
+        return false;
+    }
     buf_push_MacroDef(&st->macros, def); // push the macro
+    return true;
 }
 
-MacroDef resolve_macro(ParserState *pst, const char *name) {
+MacroDef resolve_macro(ParserState *pst, Token name) {
     MacroDef md;
-    md.name = NULL;
+    md.name.len = 0;
     // find the defined macro
-    for (size_t i = 0; i < pst->macros.ct; i++) {
-        MacroDef md = buf_get_MacroDef(&pst->macros, i);
-        if (streq(md.name, name)) {
-            return md;
-        }
+    size_t i;
+    if (hashtable_get(&pst->macro_index, name.str, name.len, &i)) {
+        return buf_get_MacroDef(&pst->macros, i);
     }
-    // we do not throw an error, the caller will handle that if name is null
+    // we do not throw an error, the caller will handle that if name is empty
     return md;
 }
 
-void define_label(ParserState *st, const char *name) {
-    char *label_name = util_strdup(name);
-    LabelDef ld = {.name = label_name, .offset = st->offset};
+/**
+ * Define a label at the current offset. Returns false if the name is already a label.
+ */
+bool define_label(ParserState *st, Token name) {
+    if (!hashtable_put(&st->label_index, name.str, name.len, st->labels.ct)) {
+        printf("ERROR: label %.*s is already defined\n", name.len, name.str);
+        return false;
+    }
+    LabelDef ld = {.name = name, .offset = st->offset};
     buf_push_LabelDef(&st->labels, ld);
+    return true;
 }
 
-int resolve_label(ParserState *st, char *name) {
+int resolve_label(ParserState *st, Token name) {
     // find the defined label
-    for (size_t i = 0; i < st->labels.ct; i++) {
-        LabelDef lb = buf_get_LabelDef(&st->labels, i);
-        if (streq(lb.name, name)) {
-            printf("resolved label: %s @ $%04x \n", lb.name, lb.offset);
-            return lb.offset;
-        }
+    size_t i;
+    if (hashtable_get(&st->label_index, name.str, name.len, &i)) {
+        return buf_get_LabelDef(&st->labels, i).offset;
     }
-    printf("ERROR: failed to resolve label %s\n", name);
+    printf("ERROR: failed to resolve label %.*s\n", name.len, name.str);
     return 0; // not resolved
 }
 
 void reallocate_program_data(SourceProgram *src, size_t space) {
-    if (!src->data) {
-        src->data = malloc(sizeof(BYTE) * space);
-    } else {
-        src->data = realloc(src->data, sizeof(BYTE) * (src->data_size + space));
-    }
+    // data blocks usually follow each other with nothing allocated in between, so this extends in place
+    src->data = arena_grow(src->arena, src->data, src->data_size, sizeof(BYTE) * (src->data_size + space));
 }
 
 void resolve_value_source(ParserState *pst, ValueSource *vs) {
     if (vs->kind == VS_REF) {
         vs->kind = VS_IMM;
-        int label_addr = resolve_label(pst, vs->ref.label);
+        Token label = {.str = vs->ref.label, .len = vs->ref.label_len};
+        int label_addr = resolve_label(pst, label);
         vs->val = label_addr + vs->ref.add_offset;
     }
 }
@@ -400,127 +465,151 @@ void resolve_statements(SourceProgram *src, ParserState *pst) {
     }
 }
 
-SourceProgram parse(LexResult lexed) {
-    ParserState st = {.lexed = &lexed, .token = 0, .cpos = 0, .offset = 0};
-    buf_alloc_LabelDef(&st.labels, 16);
-    buf_alloc_MacroDef(&st.macros, 16);
-
-    SourceProgram src;
-    source_program_init(&src);
+/**
+ * Set up to parse the tokens into src. Everything is allocated in arena, which the tokens' source must outlive.
+ */
+void parser_state_init(ParserState *st, Arena *arena, LexResult *lexed, SourceProgram *src) {
+    *st = (ParserState){.arena = arena, .lexed = lexed, .token = 0, .offset = 0, .src = src};
+    buf_alloc_in_LabelDef(&st->labels, arena, 16);
+    buf_alloc_in_MacroDef(&st->macros, arena, 16);
+    hashtable_init(&st->label_index, arena, 16);
+    hashtable_init(&st->macro_index, arena, 16);
+    source_program_init(src, arena);
+}
 
-    // entry label
-    char *entry_label = NULL;
+/**
+ * Parse every statement, handing them to parser_emit, and the data into the source program. The first statement is a
+ * nop that leaves room for the entry jump. Returns false if parsing stopped at a token it did not expect.
+ */
+bool parse_statements(ParserState *st, Token *entry_label) {
+    SourceProgram *src = st->src;
 
     // emit the entry jump (as nop)
-    buf_push_AStatement(&src.statements, IMM_STATEMENT(OP_NOP, 0, 0, 0));
-    st.offset += INSTR_SIZE; // push space for entry jump
+    parser_emit(st, IMM_STATEMENT(OP_NOP, 0, 0, 0));
+    st->offset += INSTR_SIZE; // push space for entry jump
 
     // parse the lex result into a list of instructions
-    while (st.token < lexed.token_count) {
-        Token next = peek_token(&st);
+    while (st->token < st->lexed->token_count) {
+        Token next = peek_token(st);
         switch (next.kind) {
         case DIRECTIVE: { // handle directive
-            Token dir = take_token(&st);
-            if (streq(dir.cont, "#entry")) { // entrypoint directive
+            Token dir = take_token(st);
+            if (tok_is(dir, "#entry")) { // entrypoint directive
                 // following label has the entry point
-                expect_token(&st, MARK);
-                Token label_ref = expect_token(&st, IDENTIFIER);
-                entry_label = label_ref.cont;   // store entry label
-            } else if (streq(dir.cont, "#d")) { // data directive
-                expect_token(&st, PACK_START);  // eat pack start
+                expect_token(st, MARK);
+                Token label_ref = expect_token(st, IDENTIFIER);
+                *entry_label = label_ref;      // store entry label
+            } else if (tok_is(dir, "#d")) {    // data directive
+                expect_token(st, PACK_START); // eat pack start
                 // check pack type indicator
-                Token pack_type_indicator = expect_token(&st, ALPHA | QUOT);
+                Token pack_type_indicator = expect_token(st, ALPHA | QUOT);
                 size_t pack_len = 0; // size of packed data
 
                 switch (pack_type_indicator.kind) {
                 case ALPHA: { // byte pack
-                    Token pack = expect_token(&st, NUMERIC_CONSTANT);
-                    pack_len = strlen(pack.cont);
+                    Token pack = expect_token(st, NUMERIC_CONSTANT);
+                    pack_len = pack.len;
                     if (pack_len % 2 != 0) {
                         // odd number of half-bytes, invalid
                         printf("ERROR: invalid data (must be even)\n");
                     }
-                    pack_len = pack_len / 2;              // divide by two because 0xff = 1 byte
-                    BYTE *pack_data = datahex(pack.cont); // convert data from hex
-                    // write the pack data to the binary
-                    reallocate_program_data(&src, pack_len);
-                    // copy the data
-                    memcpy(src.data + src.data_size, pack_data, pack_len);
-                    free(pack_data); // free decoded data
+                    pack_len = pack_len / 2; // divide by two because 0xff = 1 byte
+                    // write the pack data to the binary, converting it from hex in place
+                    reallocate_program_data(src, pack_len);
+                    if (!datahex_into(src->data + src->data_size, pack.str, pack.len)) {
+                        printf("ERROR: invalid data (must be hex)\n");
+                    }
                     break;
                 }
                 case QUOT: {
-                    Token pack = take_token(&st); // any following token is valid
-                    pack_len = strlen(pack.cont);
+                    Token pack = take_token(st); // any following token is valid
+                    pack_len = pack.len;
                     // copy string from token to data
-                    reallocate_program_data(&src, pack_len);
-                    memcpy(src.data + src.data_size, pack.cont, pack_len);
+                    reallocate_program_data(src, pack_len);
+                    memcpy(src->data + src->data_size, pack.str, pack_len);
                     break;
                 }
                 default:
-                    printf("unrecognized pack type %s\n", pack_type_indicator.cont);
+                    printf("unrecognized pack type %.*s\n", pack_type_indicator.len, pack_type_indicator.str);
                     break;
                 }
 
                 // update offset
-                src.data_size += pack_len;
-                st.offset += pack_len;
+                src->data_size += pack_len;
+                st->offset += pack_len;
                 printf("data block, len: $%04x\n", (UWORD)pack_len);
             }
             break;
         }
         case IDENTIFIER: {
-            Token iden = expect_token(&st, IDENTIFIER);
-            Token next = peek_token(&st);
-            if (next.kind == MARK && streq(next.cont, ":")) { // label def (only if single mark)
-                expect_token(&st, MARK);                      // eat the mark
-                define_label(&st, iden.cont);                 // create label
+            Token iden = expect_token(st, IDENTIFIER);
+            Token next = peek_token(st);
+            if (next.kind == MARK && tok_is(next, ":")) { // label def (only if single mark)
+                expect_token(st, MARK);                   // eat the mark
+                if (!define_label(st, iden)) {            // create label
+                    src->status = 1;
+                }
                 break;
-            } else if (next.kind == BIND) {   // macro def
-                expect_token(&st, BIND);      // eat the bind
-                define_macro(&st, iden.cont); // define the macro
+            } else if (next.kind == BIND) {     // macro def
+                expect_token(st, BIND);         // eat the bind
+                if (!define_macro(st, iden)) { // define the macro
+                    src->status = 1;
+                }
                 break;
             } else { // instruction
-                const char *mnem = iden.cont;
-                InstructionInfo info = get_instruction_info(mnem);
-                const char *a1 = NULL, *a2 = NULL, *a3 = NULL;
-                if (info.type == INSTR_INV) {               // didn't match standard instruction names
-                    MacroDef md = resolve_macro(&st, mnem); // check if a matching macro exists
-                    if (!md.name) {                         // invalid mnemonic
-                        printf("unrecognized mnemonic: %s\n", mnem);
+                InstructionInfo info = get_instruction_info_n(iden.str, iden.len);
+                Token a1 = {.len = 0}, a2 = {.len = 0}, a3 = {.len = 0};
+                if (info.type == INSTR_INV) {              // didn't match standard instruction names
+                    MacroDef md = resolve_macro(st, iden); // check if a matching macro exists
+                    if (!md.name.len) {                    // invalid mnemonic
+                        printf("unrecognized mnemonic: %.*s\n", iden.len, iden.str);
                     } else {
                         // expand the macro
-                        expand_macro(&st, &md, &src.statements);
+                        expand_macro(st, &md);
                         break;
                     }
                 } else { // fill in arguments
                     if ((info.type & INSTR_K_R1) > 0) {
-                        a1 = expect_token(&st, IDENTIFIER).cont;
+                        a1 = expect_token(st, IDENTIFIER);
                     }
                     if ((info.type & INSTR_K_R2) > 0) {
-                        a2 = expect_token(&st, IDENTIFIER).cont;
+                        a2 = expect_token(st, IDENTIFIER);
                     }
                     if ((info.type & INSTR_K_R3) > 0) {
-                        a3 = expect_token(&st, IDENTIFIER).cont;
+                        a3 = expect_token(st, IDENTIFIER);
                     }
                 }
 
-                AStatement stmt = read_statement(&st, iden.cont, a1, a2, a3); // read statement
-                buf_push_AStatement(&src.statements, stmt);                   // push statement
-                st.offset += info.sz;                                         // update code offset
+                AStatement stmt = read_statement(st, iden, a1, a2, a3); // read statement
+                parser_emit(st, stmt);                                  // push statement
+                st->offset += info.sz;                                  // update code offset
             }
             break;
         }
         default:
-            printf("ERR: unexpected token #%d\n", st.token);
-            src.status = 1;
-            parser_state_cleanup(&st);
-            return src;
+            printf("ERR: unexpected token #%d\n", st->token);
+            src->status = 1;
+            return false;
         }
     }
 
+    return true;
+}
+
+/**
+ * Parse the tokens into a program. Everything is allocated in arena, which the tokens' source must outlive.
+ */
+SourceProgram parse(Arena *arena, LexResult lexed) {
+    ParserState st;
+    SourceProgram src;
+    parser_state_init(&st, arena, &lexed, &src);
+    Token entry_label = {.len = 0};
+    if (!parse_statements(&st, &entry_label)) {
+        return src;
+    }
+
     // check for entry point label
-    if (entry_label) {
+    if (entry_label.len) {
         // resolve the label and replace the entry jump
         UWORD entry_addr = resolve_label(&st, entry_label);
         buf_set_AStatement(&src.statements, 0, IMM_STATEMENT(OP_JMI, entry_addr, 0, 0));
@@ -530,8 +619,6 @@ SourceProgram parse(LexResult lexed) {
     // resolve everything else
     resolve_statements(&src, &st);
 
-    parser_state_cleanup(&st);
-
     // update program information
     return src;
 }
@@ -571,7 +658,7 @@ CompiledProgram compile_program(SourceProgram src) {
 
     // this will only work if src is fully simplified (1 Statement : 1 Instruction)
     cmp.instruction_count = src.statements.ct;
-    cmp.instructions = malloc(sizeof(Instruction) * cmp.instruction_count);
+    cmp.instructions = arena_alloc(src.arena, sizeof(Instruction) * src.statements.ct);
     // copy data
     cmp.data = src.data;
     cmp.data_size = src.data_size;
@@ -587,15 +674,9 @@ CompiledProgram compile_program(SourceProgram src) {
     return cmp;
 }
 
-void free_source_program(SourceProgram src, bool free_data) {
-    // free statement buffer
-    buf_free_AStatement(&src.statements);
-    if (free_data && src.data) {
-        free(src.data); // free data
-        src.data = NULL;
-    }
-}
-
+/**
+ * Free a program decoded from a binary. Assembled programs live in the assembler's arena instead.
+ */
 void free_compiled_program(CompiledProgram cmp) {
     // we don't touch data.
     // free the instructions
@@ -608,27 +689,6 @@ void free_compiled_program(CompiledProgram cmp) {
 
 /* #region Binary */
 
-void write_short(FILE *ouf, uint8_t v) {
-    char w0 = (v >> 0) & 0xff;
-    char w1 = (v >> 8) & 0xff;
-    fwrite(&w0, sizeof(w0), 1, ouf);
-    fwrite(&w1, sizeof(w1), 1, ouf);
-}
-
-void write_instruction(FILE *ouf, Instruction *in) {
-    char w = '\0';
-    // write binary statement data
-    w = in->opcode;
-    fwrite(&w, sizeof(w), 1, ouf);
-    // write binary args
-    w = in->a1;
-    fwrite(&w, sizeof(w), 1, ouf);
-    w = in->a2;
-    fwrite(&w, sizeof(w), 1, ouf);
-    w = in->a3;
-    fwrite(&w, sizeof(w), 1, ouf);
-}
-
 typedef struct {
     bool valid_magic;
     // uint16_t entry;
@@ -637,42 +697,72 @@ typedef struct {
     size_t decode_offset;
 } RGHeader;
 
-void write_compiled_program(FILE *ouf, CompiledProgram cmp) {
-    char w = '\0';
-
-    // write header
-    RGHeader head;
-    head.valid_magic = true;
-    head.code_size = cmp.instruction_count * INSTR_SIZE;
-    head.data_size = cmp.data_size;
-    head.decode_offset = HEADER_SIZE;
-    const char *RG_MAGIC = "rg";
-    fputs(RG_MAGIC, ouf); // magic
-    // fwrite(&cmp.entry, sizeof(cmp.entry), 1, ouf); // entrypoint
-    fwrite(&head.code_size, sizeof(head.code_size), 1, ouf); // code size
-    fwrite(&head.data_size, sizeof(head.data_size), 1, ouf); // data size
-    printf("head[%02d] \n", HEADER_SIZE);
+/**
+ * A program laid out as a .rg file, header, data and code, in one buffer
+ */
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t code_size; // bytes of code at the end of buf
+} ProgramImage;
+
+void put_short(char *out, uint16_t v) {
+    out[0] = (v >> 0) & 0xff;
+    out[1] = (v >> 8) & 0xff;
+}
 
-    // write data
+/**
+ * Lay out the program as a .rg file in a buffer allocated in arena. The image can be written out as is, or loaded
+ * directly with emu_load.
+ */
+ProgramImage build_program_image(Arena *arena, CompiledProgram cmp) {
+    ProgramImage img;
+    img.code_size = cmp.instruction_count * INSTR_SIZE; // every compiled instruction is a base instruction
+    img.size = HEADER_SIZE + cmp.data_size + img.code_size;
+    img.buf = arena_alloc(arena, img.size);
+
+    // header
+    img.buf[0] = 'r'; // magic
+    img.buf[1] = 'g';
+    put_short(img.buf + 2, img.code_size); // code size
+    put_short(img.buf + 4, cmp.data_size); // data size
+
+    // data, then code
+    char *out = img.buf + HEADER_SIZE;
     if (cmp.data) {
-        for (int i = 0; i < cmp.data_size; i++) {
-            w = cmp.data[i];
-            fwrite(&w, sizeof(w), 1, ouf);
-        }
-        printf("data[%d] \n", (int)cmp.data_size);
+        memcpy(out, cmp.data, cmp.data_size);
     }
+    out += cmp.data_size;
+    for (size_t i = 0; i < cmp.instruction_count; i++) {
+        out[0] = cmp.instructions[i].opcode;
+        out[1] = cmp.instructions[i].a1;
+        out[2] = cmp.instructions[i].a2;
+        out[3] = cmp.instructions[i].a3;
+        out += INSTR_SIZE;
+    }
+    return img;
+}
 
-    // write code
-    size_t code_offset = 0;
+/**
+ * Write the image with a single write. Returns false if it was not written completely.
+ */
+bool write_program_image(FILE *ouf, ProgramImage img) {
+    // unbuffered, so the image is not copied through the stdio buffer and goes out in one call
+    setvbuf(ouf, NULL, _IONBF, 0);
+    return fwrite(img.buf, 1, img.size, ouf) == img.size;
+}
 
-    // write instructions
-    for (int i = 0; i < cmp.instruction_count; i++) {
-        Instruction in = cmp.instructions[i];
-        InstructionInfo info = get_instruction_info_op(in.opcode);
-        write_instruction(ouf, &in);
-        code_offset += info.sz;
+/**
+ * Write the program as a .rg file, reporting the size of each section. The image is built in arena.
+ */
+bool write_compiled_program(FILE *ouf, Arena *arena, CompiledProgram cmp) {
+    ProgramImage img = build_program_image(arena, cmp);
+    printf("head[%02d] \n", HEADER_SIZE);
+    if (cmp.data) {
+        printf("data[%d] \n", (int)cmp.data_size);
     }
-    printf("code[%d] \n", (int)code_offset);
+    printf("code[%d] \n", (int)img.code_size);
+    return write_program_image(ouf, img);
 }
 
 /* #endregion */
@@ -681,7 +771,7 @@ void write_compiled_program(FILE *ouf, CompiledProgram cmp) {
 
 void dump_instruction(Instruction in, bool rich) {
     const char *op_name = get_instruction_mnem(in.opcode);
-    InstructionInfo info = get_instruction_info(op_name);
+    InstructionInfo info = get_instruction_info_op(in.opcode);
 
     if (rich) {
         printf("[%3s]", op_name);
@@ -7,6 +7,8 @@ provides extensions to assembler
 
 #include "asm.h"
 
+/* #region Pseudo Instructions */
+
 typedef struct {
     size_t pos;
     SourceProgram *src;
@@ -14,9 +16,88 @@ typedef struct {
 
 AStatement take_statement(PseudoAssemblerState *pas) { return buf_get_AStatement(&pas->src->statements, pas->pos++); }
 
+/**
+ * Operand of an instruction in a pseudo instruction's expansion: one of the pseudo instruction's operands, or a
+ * literal value
+ */
+typedef struct {
+    BYTE arg;  // 1 to 3 to copy that operand, 0 for the literal
+    UWORD val; // literal value
+} PseudoOperand;
+
+#define PX_ARG(N) {.arg = N}
+#define PX_VAL(V) {.arg = 0, .val = V}
+
+typedef struct {
+    OPCODE op;
+    PseudoOperand a1, a2, a3;
+} PseudoStep;
+
+typedef struct {
+    BYTE ct; // 0 for instructions that are not pseudo instructions
+    PseudoStep steps[4];
+} PseudoExpansion;
+
+/**
+ * What each pseudo instruction expands to. Expansions may contain other pseudo instructions, up to one level deep.
+ */
+const PseudoExpansion pseudo_expansions[256] = {
+    // jmp rA: mov pc rA
+    [OP_JMP] = {1, {{OP_MOV, PX_VAL(REG_RPC), PX_ARG(1), PX_VAL(0)}}},
+    // jmi imm: set pc imm
+    [OP_JMI] = {1, {{OP_SET, PX_VAL(REG_RPC), PX_ARG(1), PX_ARG(2)}}},
+    // swp rA rB: swap using the temporary
+    [OP_SWP] = {3,
+                {{OP_MOV, PX_VAL(REG_RAT), PX_ARG(1), PX_VAL(0)},
+                 {OP_MOV, PX_ARG(1), PX_ARG(2), PX_VAL(0)},
+                 {OP_MOV, PX_ARG(2), PX_VAL(REG_RAT), PX_VAL(0)}}},
+    // adi rA imm: set at imm; add rA rA at
+    [OP_ADI] = {2,
+                {{OP_SET, PX_VAL(REG_RAT), PX_ARG(2), PX_VAL(0)},
+                 {OP_ADD, PX_ARG(1), PX_ARG(1), PX_VAL(REG_RAT)}}},
+    // sbi rA imm: set at imm; sub rA rA at
+    [OP_SBI] = {2,
+                {{OP_SET, PX_VAL(REG_RAT), PX_ARG(2), PX_VAL(0)},
+                 {OP_SUB, PX_ARG(1), PX_ARG(1), PX_VAL(REG_RAT)}}},
+    // psh rA: lower sp and then save
+    [OP_PSH] = {3,
+                {{OP_SET, PX_VAL(REG_RAT), PX_VAL(sizeof(UWORD)), PX_VAL(0)},
+                 {OP_SUB, PX_VAL(REG_RSP), PX_VAL(REG_RSP), PX_VAL(REG_RAT)},
+                 {OP_STW, PX_VAL(REG_RSP), PX_ARG(1), PX_VAL(0)}}},
+    // pop rA: load the value and then raise sp
+    [OP_POP] = {3,
+                {{OP_SET, PX_VAL(REG_RAT), PX_VAL(sizeof(UWORD)), PX_VAL(0)},
+                 {OP_LDW, PX_ARG(1), PX_VAL(REG_RSP), PX_VAL(0)},
+                 {OP_ADD, PX_VAL(REG_RSP), PX_VAL(REG_RSP), PX_VAL(REG_RAT)}}},
+    // cal rA: push the return address [pc + 16] and jump to rA
+    [OP_CAL] = {4,
+                {{OP_SET, PX_VAL(REG_RAT), PX_VAL(sizeof(UWORD) * 4), PX_VAL(0)},
+                 {OP_ADD, PX_VAL(REG_RAD), PX_VAL(REG_RAT), PX_VAL(REG_RPC)},
+                 {OP_PSH, PX_VAL(REG_RAD), PX_VAL(0), PX_VAL(0)},
+                 {OP_JMP, PX_ARG(1), PX_VAL(0), PX_VAL(0)}}},
+    // ret: pop the return address to ad and jump to it
+    [OP_RET] = {2, {{OP_POP, PX_VAL(REG_RAD), PX_VAL(0), PX_VAL(0)}, {OP_JMP, PX_VAL(REG_RAD), PX_VAL(0), PX_VAL(0)}}},
+};
+
+ValueSource pseudo_operand(PseudoOperand op, const AStatement *in) {
+    const ValueSource *args[4] = {NULL, &in->a1, &in->a2, &in->a3};
+    // operands are copied whole, so a label reference is carried into the expansion
+    return op.arg ? *args[op.arg] : IMM_ARG(op.val);
+}
+
+/**
+ * Instantiate one step of the expansion of in
+ */
+AStatement pseudo_step(const PseudoStep *step, const AStatement *in) {
+    return (AStatement){.op = step->op,
+                        .a1 = pseudo_operand(step->a1, in),
+                        .a2 = pseudo_operand(step->a2, in),
+                        .a3 = pseudo_operand(step->a3, in)};
+}
+
 SourceProgram compile_pseudo_instructions(SourceProgram src) {
     SourceProgram prg;
-    source_program_init(&prg);
+    source_program_init(&prg, src.arena);
     // copy from source program
     prg.entry = src.entry;
     prg.data = src.data;
@@ -28,119 +109,14 @@ SourceProgram compile_pseudo_instructions(SourceProgram src) {
 
     while (pas.pos < src.statements.ct) {
         AStatement in = take_statement(&pas);
-
-        // process the statement
-        switch (in.op) {
-        case OP_JMP: {
-            // jmp rA
-            // compile to mov reg to pc
-            /*
-                mov pc rA
-            */
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_MOV, REG_RPC, in.a1.val, 0));
-            break;
-        }
-        case OP_JMI: {
-            // jmi imm
-            // compile to setting pc
-            /*
-                set pc imm
-            */
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_SET, REG_RPC, in.a1.val, in.a2.val));
-            break;
-        }
-        case OP_SWP: {
-            // swp rA rB
-            // compile to swap using temp
-            /*
-                mov at rA
-                mov rA rB
-                mov rB at
-            */
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_MOV, REG_RAT, in.a1.val, 0));
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_MOV, in.a1.val, in.a2.val, 0));
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_MOV, in.a2.val, REG_RAT, 0));
-            break;
-        }
-        case OP_ADI: {
-            // adi rA imm
-            // compile to expand expression
-            /*
-                set at imm
-                add rA rA at
-            */
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_SET, REG_RAT, in.a2.val, 0));
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_ADD, in.a1.val, in.a1.val, REG_RAT));
-            break;
-        }
-        case OP_SBI: {
-            // sbi rA imm
-            // compile to expand expression
-            /*
-                set at imm
-                sub rA rA at
-            */
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_SET, REG_RAT, in.a2.val, 0));
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_SUB, in.a1.val, in.a1.val, REG_RAT));
-            break;
-        }
-        case OP_PSH: {
-            // psh rA
-            // compile to lower sp and then save
-            /*
-                set at 4
-                sub sp sp at
-                stw sp rA
-            */
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_SET, REG_RAT, sizeof(UWORD), 0));
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_SUB, REG_RSP, REG_RSP, REG_RAT));
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_STW, REG_RSP, in.a1.val, 0));
-            break;
-        }
-        case OP_POP: {
-            // pop rA
-            // compile to load value and then raise sp
-            /*
-                set at 4
-                ldw rA sp
-                add sp sp at
-            */
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_SET, REG_RAT, sizeof(UWORD), 0));
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_LDW, in.a1.val, REG_RSP, 0));
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_ADD, REG_RSP, REG_RSP, REG_RAT));
-            break;
-        }
-        case OP_CAL: {
-            // cal rA
-            // compile to push pc then jmp to addr
-            /*
-                set at 16 ; ret addr offset
-                add ad at pc ; calculate [pc + offset]
-                psh ad
-                jmp rA
-            */
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_SET, REG_RAT, sizeof(UWORD) * 4, 0));
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_ADD, REG_RAD, REG_RAT, REG_RPC));
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_PSH, REG_RAD, 0, 0));
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_JMP, in.a1.val, 0, 0));
-            break;
-        }
-        case OP_RET: {
-            // ret
-            // compile to pop pc to ad then mov
-            /*
-                pop ad
-                jmp ad
-            */
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_POP, REG_RAD, 0, 0));
-            buf_push_AStatement(&prg.statements, IMM_STATEMENT(OP_JMP, REG_RAD, 0, 0));
-            break;
-            break;
-        }
-        default:
+        const PseudoExpansion *px = &pseudo_expansions[in.op];
+        if (px->ct == 0) {
             // copy instruction
             buf_push_AStatement(&prg.statements, in);
-            break;
+            continue;
+        }
+        for (int i = 0; i < px->ct; i++) {
+            buf_push_AStatement(&prg.statements, pseudo_step(&px->steps[i], &in));
         }
     }
 
@@ -150,7 +126,107 @@ SourceProgram compile_pseudo_instructions(SourceProgram src) {
 SourceProgram simplify_pseudo_2pass(SourceProgram src) {
     // two-pass compile pseudo
     SourceProgram s1 = compile_pseudo_instructions(src);
-    SourceProgram s2 = compile_pseudo_instructions(s1);
-    free_source_program(s1, false);
-    return s2;
+    return compile_pseudo_instructions(s1);
 }
+
+/* #endregion */
+
+/* #region Single Pass */
+
+/**
+ * An instruction whose operand refers to a label that was not defined yet when it was emitted
+ */
+typedef struct {
+    size_t at;       // index of the instruction in the code
+    AStatement stmt; // statement it was compiled from, to compile again once the label is known
+} Fixup;
+
+BUFFIE_OF(Fixup)
+BUFFIE_OF(Instruction)
+
+typedef struct Emitter {
+    Buffie_Instruction code;
+    Buffie_Fixup fixups;
+} Emitter;
+
+/**
+ * Resolve a reference to a label that is already defined. Returns false if the label is not known yet.
+ */
+bool resolve_defined(ParserState *st, ValueSource *vs) {
+    size_t i;
+    if (vs->kind != VS_REF) {
+        return true;
+    }
+    if (!hashtable_get(&st->label_index, vs->ref.label, vs->ref.label_len, &i)) {
+        return false;
+    }
+    vs->kind = VS_IMM;
+    vs->val = buf_get_LabelDef(&st->labels, i).offset + vs->ref.add_offset;
+    return true;
+}
+
+/**
+ * Parser hook that compiles each statement as it is read, expanding pseudo instructions in place
+ */
+void emit_statement(ParserState *st, AStatement stmt) {
+    const PseudoExpansion *px = &pseudo_expansions[stmt.op];
+    for (int i = 0; i < px->ct; i++) {
+        emit_statement(st, pseudo_step(&px->steps[i], &stmt));
+    }
+    if (px->ct > 0) {
+        return;
+    }
+    Emitter *em = st->emitter;
+    // all three are tried, so each operand that can be is resolved
+    bool resolved = resolve_defined(st, &stmt.a1) & resolve_defined(st, &stmt.a2) & resolve_defined(st, &stmt.a3);
+    if (!resolved) {
+        buf_push_Fixup(&em->fixups, (Fixup){.at = em->code.ct, .stmt = stmt});
+    }
+    buf_push_Instruction(&em->code, compile_statement(&stmt));
+}
+
+/**
+ * Assemble the tokens in one pass, compiling statements as they are parsed and patching references to labels defined
+ * after them at the end. Produces the same program as parse, simplify_pseudo_2pass and compile_program. Everything is
+ * allocated in arena. Returns the status of the parse; cmp is only filled in if parsing reached the end.
+ */
+int assemble(Arena *arena, LexResult lexed, CompiledProgram *cmp) {
+    ParserState st;
+    SourceProgram src;
+    parser_state_init(&st, arena, &lexed, &src);
+    Emitter em;
+    buf_alloc_in_Instruction(&em.code, arena, 64 + lexed.token_count / 4); // most statements take a few tokens
+    buf_alloc_in_Fixup(&em.fixups, arena, 16);
+    st.emitter = &em;
+    st.emit = emit_statement;
+
+    Token entry_label = {.len = 0};
+    if (!parse_statements(&st, &entry_label)) {
+        return src.status;
+    }
+
+    if (entry_label.len) {
+        // replace the entry nop with the set that jmi expands to
+        AStatement entry_jump = IMM_STATEMENT(OP_JMI, (UWORD)resolve_label(&st, entry_label), 0, 0);
+        AStatement entry_set = pseudo_step(&pseudo_expansions[OP_JMI].steps[0], &entry_jump);
+        em.code.buf[0] = compile_statement(&entry_set);
+    }
+
+    // every label is defined now
+    for (size_t i = 0; i < em.fixups.ct; i++) {
+        Fixup *fx = &em.fixups.buf[i];
+        resolve_value_source(&st, &fx->stmt.a1);
+        resolve_value_source(&st, &fx->stmt.a2);
+        resolve_value_source(&st, &fx->stmt.a3);
+        em.code.buf[fx->at] = compile_statement(&fx->stmt);
+    }
+
+    compiled_program_init(cmp);
+    cmp->instructions = em.code.buf;
+    cmp->instruction_count = em.code.ct;
+    cmp->data = src.data;
+    cmp->data_size = src.data_size;
+    return src.status;
+}
+
+/* #endregion */
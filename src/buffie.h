@@ -1,3 +1,4 @@
+#include "arena.h"
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -6,6 +7,7 @@
         TYPE *buf;                                                                                                     \
         size_t ct;                                                                                                     \
         size_t buf_sz;                                                                                                 \
+        Arena *arena; /* NULL for the heap */                                                                          \
     } Buffie_##TYPE;
 
 #define DECLARE_BUFFIE_FUNCS(TYPE)                                                                                     \
@@ -13,6 +15,15 @@
         b->buf_sz = count;                                                                                             \
         b->ct = 0;                                                                                                     \
         b->buf = malloc(count * sizeof(TYPE));                                                                         \
+        b->arena = NULL;                                                                                               \
+    }                                                                                                                  \
+                                                                                                                       \
+    /* like buf_alloc, with the buffer in an arena, so it is freed along with it */                                    \
+    void buf_alloc_in_##TYPE(Buffie_##TYPE *b, Arena *arena, size_t count) {                                           \
+        b->buf_sz = count;                                                                                             \
+        b->ct = 0;                                                                                                     \
+        b->buf = arena_alloc(arena, count * sizeof(TYPE));                                                             \
+        b->arena = arena;                                                                                              \
     }                                                                                                                  \
                                                                                                                        \
     void buf_set_##TYPE(Buffie_##TYPE *b, size_t i, TYPE val) { b->buf[i] = val; }                                     \
@@ -21,8 +32,13 @@
     void buf_push_##TYPE(Buffie_##TYPE *b, TYPE val) {                                                                 \
         b->ct++;                                                                                                       \
         if (b->buf_sz <= b->ct) {                                                                                      \
+            size_t old_sz = b->buf_sz;                                                                                 \
             b->buf_sz = b->buf_sz * 2;                                                                                 \
-            b->buf = realloc(b->buf, b->buf_sz * sizeof(TYPE));                                                        \
+            if (b->arena) {                                                                                            \
+                b->buf = arena_grow(b->arena, b->buf, old_sz * sizeof(TYPE), b->buf_sz * sizeof(TYPE));                \
+            } else {                                                                                                   \
+                b->buf = realloc(b->buf, b->buf_sz * sizeof(TYPE));                                                    \
+            }                                                                                                          \
         }                                                                                                              \
         buf_set_##TYPE(b, b->ct - 1, val);                                                                             \
     }                                                                                                                  \
@@ -30,7 +46,9 @@
     void buf_pop_##TYPE(Buffie_##TYPE *b) { b->ct--; }                                                                 \
                                                                                                                        \
     void buf_free_##TYPE(Buffie_##TYPE *b) {                                                                           \
-        free(b->buf);                                                                                                  \
+        if (!b->arena) {                                                                                               \
+            free(b->buf);                                                                                              \
+        }                                                                                                              \
         b->ct = 0;                                                                                                     \
         b->buf_sz = 0;                                                                                                 \
         b->buf = NULL;                                                                                                 \
@@ -27,16 +27,13 @@ int main(int argc, char **argv) {
         }
     }
 
-    // open input file
-    FILE *inf_fp = fopen(in_file, "rb");
-    if (inf_fp == NULL) {
+    // map input file
+    FileReadResult inf_read = util_map_file(in_file);
+    if (inf_read.content == NULL) {
         fprintf(stderr, "cannot open input file\n");
         return 1;
     }
 
-    FileReadResult inf_read = util_read_file_contents(inf_fp);
-    fclose(inf_fp);
-
     DecoderResult decode_result = decode_compiled_program(inf_read.content, inf_read.size);
     if (decode_result.status == 0) { // successful decode
         printf("== DUMP ==\n");
@@ -47,7 +44,7 @@ int main(int argc, char **argv) {
     }
 
     // clean up
-    free(inf_read.content);
+    util_free_file(inf_read);
     free_compiled_program(decode_result.cmp);
 
     return 0;
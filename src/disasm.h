@@ -9,16 +9,19 @@ provides dissasembly
 #include "instr.h"
 
 typedef struct {
-    char *buf;
+    const char *buf;
     size_t size;
     size_t pos;
 } DecoderState;
 
 ARG take_arg(DecoderState *st) { return st->buf[st->pos++]; }
 
-RGHeader decode_header(char *buf, size_t buf_sz) {
+/**
+ * Read the header at the start of buf; warn says whether to complain when there is none
+ */
+RGHeader decode_header(const char *buf, size_t buf_sz, bool warn) {
     RGHeader hd;
-    hd.valid_magic = (buf[0] == 'r') && (buf[1] == 'g');
+    hd.valid_magic = (buf_sz >= HEADER_SIZE) && (buf[0] == 'r') && (buf[1] == 'g');
     if (hd.valid_magic) {
         uint8_t code_size_l = buf[2];
         uint8_t code_size_h = buf[3];
@@ -30,7 +33,9 @@ RGHeader decode_header(char *buf, size_t buf_sz) {
 
         hd.decode_offset = HEADER_SIZE; // start after header
     } else {
-        printf("WARN: magic header not matched. reading as bare binary.\n");
+        if (warn) {
+            printf("WARN: magic header not matched. reading as bare binary.\n");
+        }
         // set default values
         hd.code_size = buf_sz;
         hd.data_size = 0;
@@ -50,15 +55,18 @@ typedef struct {
     int status;
 } DecoderResult;
 
-DecoderResult decode_compiled_program(char *buf, size_t buf_sz) {
+/**
+ * Decode the code section of a program image. The image is walked in place, so it can be a read-only file mapping.
+ */
+DecoderResult decode_compiled_program(const char *buf, size_t buf_sz) {
     // read header
-    RGHeader hd = decode_header(buf, buf_sz);
+    RGHeader hd = decode_header(buf, buf_sz, true);
     DecoderState st = {.buf = buf, .size = hd.code_size, .pos = hd.decode_offset + hd.data_size};
 
     CompiledProgram cmp;
     compiled_program_init(&cmp);
     cmp.data_size = hd.data_size;
-    cmp.instructions = malloc(sizeof(Instruction) * cmp.instruction_count);
+    cmp.instructions = malloc(sizeof(Instruction) * (hd.code_size / INSTR_SIZE + 1));
 
     // check size multiple
     if ((hd.code_size % INSTR_SIZE) != 0) {
@@ -71,7 +79,11 @@ DecoderResult decode_compiled_program(char *buf, size_t buf_sz) {
     }
 
     size_t code_end = hd.decode_offset + hd.data_size + hd.code_size;
-    while (st.pos < code_end) {
+    if (code_end > buf_sz) {
+        printf("WARN: code section runs past the end of the file, truncating.\n");
+        code_end = buf_sz;
+    }
+    while (st.pos + INSTR_SIZE <= code_end) {
         ARG op = take_arg(&st);
         ARG a1 = take_arg(&st);
         ARG a2 = take_arg(&st);
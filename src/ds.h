@@ -3,9 +3,14 @@ ds.h
 basic data structures
 */
 
+#pragma once
+
+#include "arena.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* #region List and Stack */
 
@@ -39,7 +44,7 @@ void *list_peek(List *l) { return l->top->data; }
 void stack_push(List *l, void *d) {
     // alloc a new node to hold 'c'
     ListNode *node;
-    node = malloc(sizeof(node));
+    node = malloc(sizeof(ListNode));
     node->data = d;
     node->link = NULL;
     // there is no top node, make a new one
@@ -66,7 +71,7 @@ void *stack_pop(List *l) {
 void list_push(List *l, void *d) {
     // alloc a new node to hold 'c'
     ListNode *node;
-    node = malloc(sizeof(node));
+    node = malloc(sizeof(ListNode));
     node->data = d;
     node->link = NULL;
     // check top node
@@ -106,5 +111,120 @@ int list_indexof(List *l, void* item) {
 /* #endregion */
 
 /* #region Hashtable */
-// TODO: damn it
+
+/**
+ * String keyed table with open addressing and linear probing. Keys are (pointer, length) slices that need not be null
+ * terminated; they are not copied, so they must outlive the table.
+ */
+typedef struct {
+    const char *key; // NULL for an empty slot
+    size_t len;
+    size_t val;
+} HashEntry;
+
+typedef struct {
+    HashEntry *entries;
+    size_t cap;   // number of slots, a power of two
+    size_t ct;    // number of keys
+    Arena *arena; // NULL for the heap
+} Hashtable;
+
+// FNV-1a
+uint64_t hashtable_hash(const char *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 0x100000001b3;
+    }
+    return h;
+}
+
+HashEntry *hashtable_alloc_entries(Hashtable *ht) {
+    if (!ht->arena) {
+        return calloc(ht->cap, sizeof(HashEntry));
+    }
+    HashEntry *entries = arena_alloc(ht->arena, ht->cap * sizeof(HashEntry));
+    memset(entries, 0, ht->cap * sizeof(HashEntry));
+    return entries;
+}
+
+/**
+ * Create a table for at least cap keys, in arena or on the heap if it is NULL
+ */
+void hashtable_init(Hashtable *ht, Arena *arena, size_t cap) {
+    ht->cap = 16;
+    while (ht->cap < cap) {
+        ht->cap *= 2;
+    }
+    ht->ct = 0;
+    ht->arena = arena;
+    ht->entries = hashtable_alloc_entries(ht);
+}
+
+void hashtable_free(Hashtable *ht) {
+    if (!ht->arena) {
+        free(ht->entries);
+    }
+    ht->entries = NULL;
+    ht->cap = 0;
+    ht->ct = 0;
+}
+
+/**
+ * Slot holding key, or the empty slot where it would go
+ */
+HashEntry *hashtable_slot(Hashtable *ht, const char *key, size_t len) {
+    size_t mask = ht->cap - 1;
+    size_t i = hashtable_hash(key, len) & mask;
+    while (ht->entries[i].key && (ht->entries[i].len != len || memcmp(ht->entries[i].key, key, len) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return &ht->entries[i];
+}
+
+/**
+ * Look up key. Returns false if it is not in the table.
+ */
+bool hashtable_get(Hashtable *ht, const char *key, size_t len, size_t *val) {
+    HashEntry *e = hashtable_slot(ht, key, len);
+    if (!e->key) {
+        return false;
+    }
+    *val = e->val;
+    return true;
+}
+
+void hashtable_grow(Hashtable *ht) {
+    HashEntry *old = ht->entries;
+    size_t old_cap = ht->cap;
+    ht->cap *= 2;
+    ht->entries = hashtable_alloc_entries(ht);
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key) {
+            *hashtable_slot(ht, old[i].key, old[i].len) = old[i];
+        }
+    }
+    if (!ht->arena) {
+        free(old);
+    }
+}
+
+/**
+ * Add key with a value. Returns false, leaving the table as it was, if key is already there.
+ */
+bool hashtable_put(Hashtable *ht, const char *key, size_t len, size_t val) {
+    // keep the load under 3/4 so probes stay short
+    if ((ht->ct + 1) * 4 > ht->cap * 3) {
+        hashtable_grow(ht);
+    }
+    HashEntry *e = hashtable_slot(ht, key, len);
+    if (e->key) {
+        return false;
+    }
+    e->key = key;
+    e->len = len;
+    e->val = val;
+    ht->ct++;
+    return true;
+}
+
 /* #endregion */
@@ -1,4 +1,10 @@
 #include "emu.h"
+#include "emu_jit.h"
+#include "emu_batch.h"
+#include "emu_fuzz.h"
+#include "emu_prof.h"
+#include "emu_trace.h"
+#include "emu_replay.h"
 #include "asm.h"
 #include "disasm.h"
 #include "util.h"
@@ -7,54 +13,278 @@
 typedef struct {
     bool debug;
     bool step;
+    EmuDispatch dispatch;
+    bool jit;
+    bool jit_check;
+    bool stats;
+    size_t mem_sz;
+    uint64_t max_ticks;
+    bool batch;
+    int jobs;
+    char *results;
+    bool fuzz;
+    FuzzConfig fuzz_cfg;
+    char *profile; // folded stacks output, NULL when not profiling
+    char *trace;   // binary trace output, NULL when not tracing
+    bool replay;
+    uint64_t replay_interval;
 } EmuOptions;
 
+/**
+ * Run every program in the manifest and write their final states to the results file
+ */
+int emu_batch_main(EmuOptions *options, char *manifest) {
+    BatchRunner br = {
+        .mem_sz = options->mem_sz,
+        .tick_limit = options->max_ticks,
+        .dispatch = options->dispatch,
+        .jit = options->jit,
+        .worker_ct = options->jobs,
+    };
+    if (manifest == NULL || !batch_read_manifest(&br, manifest)) {
+        fprintf(stderr, "cannot open manifest\n");
+        return 1;
+    }
+
+    double run_start = seconds_now();
+    batch_run(&br);
+    double elapsed = seconds_now() - run_start;
+
+    size_t exits[EMU_EXIT_TRAP + 1] = {0};
+    uint64_t ticks = 0;
+    for (size_t i = 0; i < br.jobs.ct; i++) {
+        exits[br.jobs.buf[i].exit]++;
+        ticks += br.jobs.buf[i].ticks;
+    }
+    printf("ran %zu programs on %d workers in %.3f s: %zu halted, %zu out of ticks, %zu faulted, %zu trapped, "
+           "%zu stopped, %zu failed to load\n",
+           br.jobs.ct, br.worker_ct, elapsed, exits[EMU_EXIT_HALT], exits[EMU_EXIT_TICKS], exits[EMU_EXIT_FAULT],
+           exits[EMU_EXIT_TRAP], exits[EMU_EXIT_NONE], exits[EMU_EXIT_LOAD]);
+    if (options->stats) {
+        printf("batch: %lu ticks, %.2f MIPS\n", ticks, elapsed > 0 ? ticks / elapsed / 1e6 : 0.0);
+    }
+
+    int status = 0;
+    if (!batch_write_results(&br, options->results)) {
+        fprintf(stderr, "cannot write results file\n");
+        status = 1;
+    }
+    batch_free(&br);
+    return status;
+}
+
 int main(int argc, char **argv) {
     printf("[REGULAR_ad] emulator v1.1\n");
     if (argc < 2) {
         printf("usage: emu <in> --flags\n");
+        printf("       emu --batch <manifest> -j <workers> --flags\n");
     }
 
     char *in_file = argv[1];
+    int first_flag = 2;
 
     EmuOptions options = {
         .step = false,
-        .debug = true,
+        .debug = false,
+        .dispatch = EMU_THREADED ? EMU_DISPATCH_THREADED : EMU_DISPATCH_SWITCH,
+        .jit = false,
+        .jit_check = false,
+        .stats = false,
+        .mem_sz = MEMORY_SIZE,
+        .max_ticks = UINT64_MAX,
+        .batch = false,
+        .jobs = batch_default_workers(),
+        .results = "results.rgb",
+        .fuzz = false,
+        .fuzz_cfg = {.input_addr = 0, .input_sz = 0, .in_fd = 198, .out_fd = 199, .map_path = NULL},
+        .profile = NULL,
+        .trace = NULL,
+        .replay = false,
+        .replay_interval = REPLAY_DEFAULT_INTERVAL,
     };
 
-    for (int i = 2; i < argc; i++) {
+    if (in_file && streq(in_file, "--batch")) {
+        // the manifest takes the place of the input file
+        options.batch = true;
+        in_file = argc > 2 ? argv[2] : NULL;
+        first_flag = 3;
+    }
+
+    for (int i = first_flag; i < argc; i++) {
         char *flg = argv[i];
         if (streq(flg, "--step")) {
             options.step = true;
         }
+        if (streq(flg, "--debug")) {
+            options.debug = true;
+        }
         if (streq(flg, "--nodbg")) {
             options.debug = false;
         }
+        if (streq(flg, "--dispatch=switch")) {
+            options.dispatch = EMU_DISPATCH_SWITCH;
+        }
+        if (streq(flg, "--dispatch=threaded")) {
+            if (EMU_THREADED) {
+                options.dispatch = EMU_DISPATCH_THREADED;
+            } else {
+                printf("threaded dispatch not available in this build, using switch\n");
+            }
+        }
+        if (streq(flg, "--jit")) {
+            options.jit = true;
+        }
+        if (streq(flg, "--jit-check")) {
+            options.jit = true;
+            options.jit_check = true;
+        }
+        if (streq(flg, "--stats")) {
+            options.stats = true;
+        }
+        if (strncmp(flg, "--mem=", 6) == 0) {
+            size_t mem_sz = util_parse_size(flg + 6);
+            if (mem_sz < MEMORY_SIZE || mem_sz > MAX_MEMORY_SIZE || mem_sz % sizeof(UWORD) != 0) {
+                fprintf(stderr, "invalid memory size: %s (64K to 4G, word aligned)\n", flg + 6);
+                return 2;
+            }
+            options.mem_sz = mem_sz;
+        }
+        if (strncmp(flg, "--max-ticks=", 12) == 0) {
+            options.max_ticks = strtoull(flg + 12, NULL, 0);
+        }
+        if (streq(flg, "-j") && i + 1 < argc) {
+            options.jobs = atoi(argv[++i]);
+        }
+        if (strncmp(flg, "--results=", 10) == 0) {
+            options.results = flg + 10;
+        }
+        if (strncmp(flg, "--fuzz=", 7) == 0) {
+            char *sep;
+            options.fuzz = true;
+            options.fuzz_cfg.input_addr = strtoul(flg + 7, &sep, 0);
+            options.fuzz_cfg.input_sz = *sep == ':' ? util_parse_size(sep + 1) : 0;
+        }
+        if (strncmp(flg, "--fuzz-fds=", 11) == 0) {
+            char *sep;
+            options.fuzz_cfg.in_fd = strtol(flg + 11, &sep, 10);
+            options.fuzz_cfg.out_fd = *sep == ',' ? strtol(sep + 1, NULL, 10) : options.fuzz_cfg.out_fd;
+        }
+        if (strncmp(flg, "--fuzz-map=", 11) == 0) {
+            options.fuzz_cfg.map_path = flg + 11;
+        }
+        if (streq(flg, "--profile")) {
+            options.profile = "profile.folded";
+        }
+        if (strncmp(flg, "--profile=", 10) == 0) {
+            options.profile = flg + 10;
+        }
+        if (strncmp(flg, "--trace=", 8) == 0) {
+            options.trace = flg + 8;
+        }
+        if (streq(flg, "--replay")) {
+            options.replay = true;
+        }
+        if (strncmp(flg, "--replay=", 9) == 0) {
+            options.replay = true;
+            options.replay_interval = strtoull(flg + 9, NULL, 0);
+        }
     }
 
-    // open input file
-    FILE *inf_fp = fopen(in_file, "rb");
-    if (inf_fp == NULL) {
-        fprintf(stderr, "cannot open input file\n");
-        return 1;
+    if (options.batch) {
+        return emu_batch_main(&options, in_file);
+    }
+    if (options.fuzz && (options.fuzz_cfg.input_sz == 0 ||
+                         (size_t)options.fuzz_cfg.input_addr + options.fuzz_cfg.input_sz > options.mem_sz)) {
+        fprintf(stderr, "invalid fuzz input range, expected --fuzz=<addr>:<size> inside memory\n");
+        return 2;
     }
 
-    FileReadResult inf_read = util_read_file_contents(inf_fp);
-    fclose(inf_fp);
-
-    EmulatorState *emu_st = emu_init();
+    EmulatorState *emu_st = emu_init(options.mem_sz);
+    if (emu_st == NULL) {
+        fprintf(stderr, "cannot reserve %zu bytes of guest memory\n", options.mem_sz);
+        return 1;
+    }
     // set opts
     emu_st->onestep = options.step;
     emu_st->debug = options.debug;
+    emu_st->dispatch = options.dispatch;
+    emu_st->tick_limit = options.max_ticks;
+    emu_st->quiet = options.fuzz;
+    // breakpoints are sized by the emulator's memory, so they are set once it exists
+    for (int i = first_flag; i < argc; i++) {
+        if (strncmp(argv[i], "--break=", 8) == 0) {
+            emu_debug_set(emu_st, argv[i] + 8, EMU_BREAK_PC);
+        }
+    }
+    if (options.jit && !jit_attach(emu_st, options.jit_check)) {
+        printf("JIT not available on this host, interpreting\n");
+    }
 
-    // copy binary to offset 0
-    RGHeader hd = emu_load(emu_st, 0, inf_read.content, inf_read.size);
-    uint16_t code_start = hd.data_size;
+    // map binary to offset 0
+    RGHeader hd;
+    if (!emu_load_file(emu_st, in_file, &hd)) {
+        fprintf(stderr, "cannot open input file\n");
+        emu_free(emu_st);
+        return 1;
+    }
+    UWORD code_start = hd.data_size;
+    if (options.fuzz) {
+        int status = fuzz_serve(emu_st, code_start, &options.fuzz_cfg);
+        jit_detach(emu_st);
+        emu_free(emu_st);
+        return status;
+    }
+    if (options.profile && !prof_attach(emu_st, code_start)) {
+        printf("cannot allocate profile counters, not profiling\n");
+    }
+    if (options.trace && !trace_attach(emu_st, options.trace, code_start)) {
+        fprintf(stderr, "cannot open trace file %s\n", options.trace);
+    }
+    if (options.replay) {
+        replay_attach(emu_st, options.replay_interval);
+    }
+    double run_start = seconds_now();
     emu_run(emu_st, code_start); // jump to the start of code
+    if (emu_st->trace && !trace_detach(emu_st)) {
+        fprintf(stderr, "cannot write trace file %s\n", options.trace);
+    }
+    if (emu_st->prof) {
+        prof_dump_hot(emu_st);
+        if (!prof_write_folded(emu_st, options.profile)) {
+            fprintf(stderr, "cannot write profile to %s\n", options.profile);
+        }
+    }
+    if (options.stats) {
+        double elapsed = seconds_now() - run_start;
+        const char *engine = emu_st->dispatch == EMU_DISPATCH_THREADED ? "threaded" : "switch";
+        if (emu_st->jit) {
+            engine = "jit";
+        }
+        if (emu_st->prof) {
+            engine = "profiling";
+        }
+        if (options.trace) {
+            engine = "tracing";
+        }
+        if (emu_st->breaks.ct > 0) {
+            engine = "breakpoint";
+        }
+        printf("%s dispatch: %.3f s, %.2f MIPS\n", engine, elapsed, elapsed > 0 ? emu_st->ticks / elapsed / 1e6 : 0.0);
+        if (emu_st->jit) {
+            printf("jit: %lu blocks translated\n", emu_st->jit->translated);
+        }
+    }
+    int status = 0;
+    if (emu_st->jit && emu_st->jit->mismatches > 0) {
+        printf("jit check found %lu mismatches\n", emu_st->jit->mismatches);
+        status = 3;
+    }
 
     // clean up
+    replay_detach(emu_st);
+    prof_detach(emu_st);
+    jit_detach(emu_st);
     emu_free(emu_st);
-    free(inf_read.content);
 
-    return 0;
+    return status;
 }
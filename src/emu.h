@@ -6,11 +6,49 @@ provides emulation capability
 #pragma once
 #include "disasm.h"
 #include "instr.h"
+#include "buffie.h"
+#include "util.h"
 #include <stdbool.h>
 
-const size_t MEMORY_SIZE = 64 * 1024; // 65K
+#if defined(__unix__)
+#define EMU_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define EMU_MMAP 0
+#endif
+
+// guest memory is followed by an inaccessible guard band covering the rest of what a UWORD can address, so loads need
+// no bounds checks and a stray access faults on the host; this reserves 4G, so it needs a 64-bit host
+#if EMU_MMAP && UINTPTR_MAX > UINT32_MAX
+#define EMU_GUARD 1
+#include <signal.h>
+#else
+#define EMU_GUARD 0
+#endif
+#include <setjmp.h>
+
+const size_t MEMORY_SIZE = 64 * 1024;                 // 65K, default address space
+const size_t MAX_MEMORY_SIZE = (size_t)UINT32_MAX + 1; // 4G, everything a UWORD can address
 const size_t REGISTER_COUNT = 32;
 const size_t SIMPLE_REGISTER_COUNT = 8;
+#define EMU_MAX_FUSED 6 // longest superinstruction (cal)
+
+// guest memory is tracked in pages for snapshots and resets
+#define EMU_PAGE_SHIFT 12
+#define EMU_PAGE_SIZE ((size_t)1 << EMU_PAGE_SHIFT)
+#define EMU_PAGE_DIRTY 1   // written since the last snapshot, restore, or reset
+#define EMU_PAGE_TOUCHED 2 // written since the last reset, so it may not be zero
+
+#define EMU_COVERAGE_SIZE (64 * 1024) // edge coverage counters, a power of two
+
+// debugger stops, per word of memory
+#define EMU_BREAK_PC 1    // stop before the instruction runs
+#define EMU_BREAK_ONCE 2  // like EMU_BREAK_PC, removed once hit
+#define EMU_WATCH_READ 4  // stop after a load from the word
+#define EMU_WATCH_WRITE 8 // stop after a store to the word
 
 #define INTERRUPT_PAUSE 0x01   // pause execution
 #define INTERRUPT_DUMPCPU 0x02 // dump cpu state
@@ -19,63 +57,903 @@ const size_t SIMPLE_REGISTER_COUNT = 8;
 #define INTERRUPT_BREAK 0x05   // debug break
 #define INTERRUPT_CONT 0x06   // debug continue
 
+// threaded dispatch needs GCC/Clang labels-as-values; EMU_NO_THREADED forces the portable switch
+#if defined(__GNUC__) && !defined(EMU_NO_THREADED)
+#define EMU_THREADED 1
+#else
+#define EMU_THREADED 0
+#endif
+
+typedef enum {
+    EMU_DISPATCH_SWITCH,   // portable switch in emu_exec
+    EMU_DISPATCH_THREADED, // computed goto, one indirect jump per handler
+} EmuDispatch;
+
+// dense handler indices for the dispatch tables
+typedef enum {
+    EOP_NOP,
+    EOP_ADD,
+    EOP_SUB,
+    EOP_AND,
+    EOP_ORR,
+    EOP_XOR,
+    EOP_NOT,
+    EOP_LSH,
+    EOP_ASH,
+    EOP_TCU,
+    EOP_TCS,
+    EOP_SET,
+    EOP_MOV,
+    EOP_LDW,
+    EOP_STW,
+    EOP_INT,
+    EOP_HLT,
+    EOP_BRX,
+    EOP_TRP, // anything that fails verification: unknown or unimplemented opcodes, registers past the last
+    // superinstructions for the pseudo-instruction expansions in asm_ext.h
+    EOP_PSH, // set at 4, sub sp sp at, stw sp rA
+    EOP_POP, // set at 4, ldw rA sp, add sp sp at
+    EOP_CAL, // set at 16, add ad at pc, psh ad, mov pc rA
+    EOP_RET, // pop ad, mov pc ad
+    EOP_ADI, // set at imm, add rA rA at
+    EOP_SBI, // set at imm, sub rA rA at
+    EOP_COUNT,
+} EmuOp;
+
 typedef struct {
+    OPCODE opcode;
+    BYTE op; // EmuOp handler index
+    ARG a1, a2, a3;
+    BYTE fused; // EmuOp handler of the superinstruction starting here, op if there is none
+    BYTE flen;  // instructions covered by fused
+    ARG fa;     // register operand of the superinstruction
+    UWORD imm;  // immediate operand, assembled at decode time
+} DecodedInstruction;
+
+typedef enum {
+    EMU_EXIT_NONE,  // still running, or stopped by the debugger
+    EMU_EXIT_HALT,  // executed hlt
+    EMU_EXIT_TICKS, // ran out of its tick budget
+    EMU_EXIT_LOAD,  // the program could not be loaded
+    EMU_EXIT_FAULT, // accessed memory outside the guest address space
+    EMU_EXIT_TRAP,  // executed an instruction that failed verification
+} EmuExit;
+
+typedef struct {
+    UWORD addr; // word aligned
+    BYTE kind;  // EMU_BREAK_* and EMU_WATCH_* flags
+} EmuBreak;
+
+BUFFIE_OF(EmuBreak)
+
+struct JitState;    // see emu_jit.h
+struct EmuProfile; // see emu_prof.h
+struct EmuTrace;   // see emu_trace.h
+struct EmuReplay;  // see emu_replay.h
+
+typedef struct EmulatorState {
     UWORD *reg;
     BYTE *mem;
     size_t mem_sz;
+    BYTE *mem_map;            // host mapping backing mem, mem may start a few bytes into it to end on a page
+    size_t mem_map_sz;        // size of the host mapping in bytes
+    BYTE *page_flags;         // EMU_PAGE_* flags for every page of guest memory
+    UWORD *dirty_list;        // pages with EMU_PAGE_DIRTY set
+    size_t dirty_ct;
+    UWORD *touched_list;      // pages with EMU_PAGE_TOUCHED set
+    size_t touched_ct;
+    uint64_t baseline;        // id of the snapshot the dirty pages are relative to, 0 if none
+    uint64_t snapshot_ct;     // snapshots taken, for baseline ids
+    DecodedInstruction *code; // predecoded code section, indexed by (pc - code_base) / INSTR_SIZE
+    UWORD code_base;          // address of the predecoded code section
+    UWORD code_sz;            // size of the predecoded code section in bytes
+    uint64_t code_gen;        // bumped whenever the predecoded code changes
     bool executing;
     uint64_t ticks;
+    uint64_t tick_limit;    // stop once ticks reaches this, UINT64_MAX for no budget
+    EmuExit exit;           // why execution stopped
+    UWORD fault_pc;         // instruction that faulted, for EMU_EXIT_FAULT and EMU_EXIT_TRAP
+    UWORD fault_addr;       // address it accessed
+    bool quiet;             // no emulator chatter and no interactive interrupts, for batch runs
+    BYTE *coverage;         // EMU_COVERAGE_SIZE edge hit counters, NULL unless coverage is collected
+    Buffie_EmuBreak breaks; // breakpoints and watchpoints; the fast loops only run while there are none
+    BYTE *break_map;        // a bit per word of memory with a pc breakpoint, NULL until a stop is set
+    BYTE *watch_rd_map;     // a bit per word watched for loads
+    BYTE *watch_wr_map;     // a bit per word watched for stores
+    size_t break_map_sz;    // size of each map in bytes
     bool debug;
-    bool onestep; // step one at a time
+    bool onestep;                                     // step one at a time
+    EmuDispatch dispatch;                             // interpreter used when not debugging
+    struct JitState *jit;                             // native code cache, NULL unless attached
+    void (*jit_run)(struct EmulatorState *emu_st);    // runs in place of the interpreter when jit is attached
+    struct EmuProfile *prof;                          // execution profile, NULL unless attached
+    void (*prof_run)(struct EmulatorState *emu_st);   // runs in place of the interpreter when profiling
+    struct EmuTrace *trace;                           // binary trace, NULL unless attached
+    void (*trace_run)(struct EmulatorState *emu_st);  // runs in place of the interpreter when tracing
+    struct EmuReplay *replay;                         // checkpoints for seeking, NULL unless attached
+    void (*replay_run)(struct EmulatorState *emu_st); // runs in place of the run loops when checkpointing
+    // restores the state after tick ticks, for the debugger
+    bool (*replay_seek)(struct EmulatorState *emu_st, uint64_t tick);
 } EmulatorState;
 
-/* #region Init, Deinit, and Loading */
+/* #region Faults */
+
+// accesses outside guest memory jump back to emu_run on the thread that made them
+static _Thread_local EmulatorState *emu_guarded; // emulator running on this thread, NULL if none
+#if EMU_GUARD
+static _Thread_local sigjmp_buf emu_fault_jmp;
+#define EMU_FAULT_SETJMP() sigsetjmp(emu_fault_jmp, 1)
+#define EMU_FAULT_LONGJMP() siglongjmp(emu_fault_jmp, 1)
+#else
+static _Thread_local jmp_buf emu_fault_jmp;
+#define EMU_FAULT_SETJMP() setjmp(emu_fault_jmp)
+#define EMU_FAULT_LONGJMP() longjmp(emu_fault_jmp, 1)
+#endif
+
+#if EMU_GUARD
+/**
+ * Turn a host fault in the guard band of the running emulator into a guest fault
+ */
+void emu_guard_handler(int sig, siginfo_t *info, void *ctx) {
+    (void)ctx;
+    EmulatorState *emu_st = emu_guarded;
+    BYTE *addr = info->si_addr;
+    if (emu_st && addr >= emu_st->mem && addr < emu_st->mem_map + emu_st->mem_map_sz) {
+        emu_st->fault_addr = addr - emu_st->mem;
+        EMU_FAULT_LONGJMP();
+    }
+    // not a guest access: once this returns, the access faults again and gets the default action
+    signal(sig, SIG_DFL);
+}
+
+void emu_guard_install() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = emu_guard_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+}
+#endif
+
+/**
+ * Fault on a word access past the end of memory. Without a guard band every access is checked; with one only stores
+ * are, since a store straddling the end would write its first bytes before the guard faults.
+ */
+void emu_check_access(EmulatorState *emu_st, UWORD addr) {
+    if ((size_t)addr + sizeof(UWORD) > emu_st->mem_sz && emu_guarded == emu_st) {
+        emu_st->fault_addr = addr;
+        EMU_FAULT_LONGJMP();
+    }
+}
+
+/**
+ * Stop execution after an access outside memory by the instruction at pc
+ */
+void emu_fault(EmulatorState *emu_st, UWORD pc, UWORD addr) {
+    emu_st->executing = false;
+    emu_st->exit = EMU_EXIT_FAULT;
+    emu_st->fault_pc = pc;
+    emu_st->fault_addr = addr;
+    if (!emu_st->quiet) {
+        printf("-- FAULT: $%04x accessed $%08x outside memory --\n", pc, addr);
+    }
+}
+
+/* #endregion */
+
+/* #region Init and Deinit */
+
+/**
+ * Reserve zeroed memory. Pages are only committed once they are touched.
+ */
+BYTE *emu_mem_map(size_t mem_sz) {
+#if EMU_MMAP
+    void *mem = mmap(NULL, mem_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+#else
+    return calloc(mem_sz, sizeof(BYTE));
+#endif
+}
+
+void emu_mem_unmap(BYTE *mem, size_t mem_sz) {
+#if EMU_MMAP
+    munmap(mem, mem_sz);
+#else
+    (void)mem_sz;
+    free(mem);
+#endif
+}
+
+/**
+ * Reserve zeroed guest memory of mem_sz bytes. With EMU_GUARD the memory is placed to end on a host page boundary,
+ * and the mapping goes on, inaccessible, past everything a UWORD address can reach, so the first byte after guest
+ * memory already faults. Sets *map and *map_sz to the whole mapping and returns the start of guest memory.
+ */
+BYTE *emu_guest_map(size_t mem_sz, BYTE **map, size_t *map_sz) {
+#if EMU_GUARD
+    size_t page_sz = sysconf(_SC_PAGESIZE);
+    size_t open_sz = (mem_sz + page_sz - 1) & ~(page_sz - 1);
+    size_t lead = open_sz - mem_sz;
+    // a word loaded from the last address reaches a few bytes further
+    *map_sz = (lead + MAX_MEMORY_SIZE + sizeof(UWORD) + page_sz - 1) & ~(page_sz - 1);
+    *map = mmap(NULL, *map_sz, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (*map == MAP_FAILED) {
+        return NULL;
+    }
+    if (mprotect(*map, open_sz, PROT_READ | PROT_WRITE) != 0) {
+        munmap(*map, *map_sz);
+        return NULL;
+    }
+    return *map + lead;
+#else
+    *map_sz = mem_sz;
+    *map = emu_mem_map(mem_sz);
+    return *map;
+#endif
+}
+
+size_t emu_page_count(EmulatorState *emu_st) { return (emu_st->mem_sz + EMU_PAGE_SIZE - 1) >> EMU_PAGE_SHIFT; }
 
-EmulatorState *emu_init() {
+/**
+ * Size of a page in bytes; only the last page of memory can be short
+ */
+size_t emu_page_size(EmulatorState *emu_st, size_t page) {
+    size_t addr = page << EMU_PAGE_SHIFT;
+    return emu_st->mem_sz - addr < EMU_PAGE_SIZE ? emu_st->mem_sz - addr : EMU_PAGE_SIZE;
+}
+
+/**
+ * Forget all page tracking, for when every page is known to be zero
+ */
+void emu_pages_clear(EmulatorState *emu_st) {
+    for (size_t i = 0; i < emu_st->touched_ct; i++) {
+        emu_st->page_flags[emu_st->touched_list[i]] = 0;
+    }
+    emu_st->dirty_ct = 0;
+    emu_st->touched_ct = 0;
+    emu_st->baseline = 0;
+}
+
+/**
+ * Create an emulator with a guest address space of mem_sz bytes (at most MAX_MEMORY_SIZE).
+ * Returns NULL if the address space cannot be reserved.
+ */
+EmulatorState *emu_init(size_t mem_sz) {
     EmulatorState *emu_st = malloc(sizeof(EmulatorState));
-    emu_st->mem_sz = MEMORY_SIZE;
+    emu_st->mem_sz = mem_sz;
 
-    size_t mem_alloc_sz = MEMORY_SIZE * sizeof(BYTE);
-    emu_st->mem = malloc(mem_alloc_sz);
+    emu_st->mem = emu_guest_map(mem_sz, &emu_st->mem_map, &emu_st->mem_map_sz);
+    if (!emu_st->mem) {
+        free(emu_st);
+        return NULL;
+    }
+    size_t page_ct = emu_page_count(emu_st);
+    emu_st->page_flags = calloc(page_ct, sizeof(BYTE));
+    emu_st->dirty_list = calloc(page_ct, sizeof(UWORD));
+    emu_st->touched_list = calloc(page_ct, sizeof(UWORD));
+    emu_st->dirty_ct = 0;
+    emu_st->touched_ct = 0;
+    emu_st->baseline = 0;
+    emu_st->snapshot_ct = 0;
     size_t reg_alloc_sz = REGISTER_COUNT * sizeof(UWORD);
     emu_st->reg = malloc(reg_alloc_sz);
 
-    // initialize all data
-    memset(emu_st->mem, 0, mem_alloc_sz);
+    // initialize registers, memory starts out zeroed
     memset(emu_st->reg, 0, reg_alloc_sz);
 
     // set RSP to last word
     emu_st->reg[REG_RSP] = emu_st->mem_sz - sizeof(WORD);
 
+    // nothing is predecoded until a program is loaded
+    emu_st->code = NULL;
+    emu_st->code_base = 0;
+    emu_st->code_sz = 0;
+    emu_st->code_gen = 0;
+    emu_st->jit = NULL;
+    emu_st->jit_run = NULL;
+    emu_st->prof = NULL;
+    emu_st->prof_run = NULL;
+    emu_st->trace = NULL;
+    emu_st->trace_run = NULL;
+    emu_st->replay = NULL;
+    emu_st->replay_run = NULL;
+    emu_st->replay_seek = NULL;
+
     // reset settings
     emu_st->debug = false;
     emu_st->onestep = 0;
     emu_st->ticks = 0;
+    emu_st->tick_limit = UINT64_MAX;
+    emu_st->exit = EMU_EXIT_NONE;
+    emu_st->fault_pc = 0;
+    emu_st->fault_addr = 0;
+    emu_st->quiet = false;
+    emu_st->coverage = NULL;
+    emu_st->breaks = (Buffie_EmuBreak){.buf = NULL, .ct = 0, .buf_sz = 0};
+    emu_st->break_map = NULL;
+    emu_st->watch_rd_map = NULL;
+    emu_st->watch_wr_map = NULL;
+    emu_st->break_map_sz = 0;
+    emu_st->dispatch = EMU_THREADED ? EMU_DISPATCH_THREADED : EMU_DISPATCH_SWITCH;
+#if EMU_GUARD
+    emu_guard_install();
+#endif
 
     return emu_st;
 }
 
+/**
+ * Return to the state right after emu_init so the emulator can run another program.
+ * The memory reservation and predecode buffer are kept; settings are left alone.
+ */
+void emu_reset(EmulatorState *emu_st) {
+    // only pages that were written can be nonzero, and they stay committed for the next program
+    for (size_t i = 0; i < emu_st->touched_ct; i++) {
+        size_t page = emu_st->touched_list[i];
+        memset(emu_st->mem + (page << EMU_PAGE_SHIFT), 0, emu_page_size(emu_st, page));
+    }
+    emu_pages_clear(emu_st);
+    memset(emu_st->reg, 0, REGISTER_COUNT * sizeof(UWORD));
+    emu_st->reg[REG_RSP] = emu_st->mem_sz - sizeof(WORD);
+    emu_st->code_base = 0;
+    emu_st->code_sz = 0;
+    emu_st->code_gen++;
+    emu_st->executing = false;
+    emu_st->ticks = 0;
+    emu_st->exit = EMU_EXIT_NONE;
+    emu_st->fault_pc = 0;
+    emu_st->fault_addr = 0;
+}
+
 void emu_free(EmulatorState *emu_st) {
     // free data
     free(emu_st->reg);
-    free(emu_st->mem);
+    emu_mem_unmap(emu_st->mem_map, emu_st->mem_map_sz);
+    free(emu_st->page_flags);
+    free(emu_st->dirty_list);
+    free(emu_st->touched_list);
+    free(emu_st->code);
+    buf_free_EmuBreak(&emu_st->breaks);
+    if (emu_st->break_map) {
+        emu_mem_unmap(emu_st->break_map, emu_st->break_map_sz);
+        emu_mem_unmap(emu_st->watch_rd_map, emu_st->break_map_sz);
+        emu_mem_unmap(emu_st->watch_wr_map, emu_st->break_map_sz);
+    }
     // free emu emu_state
     free(emu_st);
 }
 
+/* #endregion */
+
+/* #region Predecoding */
+
+/**
+ * Read the raw instruction at an address in memory
+ */
+Instruction emu_fetch(EmulatorState *emu_st, UWORD addr) {
+#if !EMU_GUARD
+    emu_check_access(emu_st, addr);
+#endif
+    Instruction in = {.opcode = emu_st->mem[addr],
+                      .a1 = emu_st->mem[addr + 1],
+                      .a2 = emu_st->mem[addr + 2],
+                      .a3 = emu_st->mem[addr + 3]};
+    return in;
+}
+
+/**
+ * Check the operands of a raw instruction against its kinds in instr.h. Handlers index the register file with
+ * register operands directly, so every instruction is verified once when it is decoded and never again.
+ */
+bool emu_verify(Instruction in) {
+    InstructionType type = get_instruction_info_op(in.opcode).type;
+    if (type == INSTR_INV) {
+        return false;
+    }
+    return !((type & INSTR_K_R1) && in.a1 >= REGISTER_COUNT) && !((type & INSTR_K_R2) && in.a2 >= REGISTER_COUNT) &&
+           !((type & INSTR_K_R3) && in.a3 >= REGISTER_COUNT);
+}
+
+/**
+ * Resolve a raw instruction into the form executed by the emulator. Instructions that fail verification, and
+ * opcodes the emulator does not implement, decode to a trap.
+ */
+DecodedInstruction emu_decode(Instruction in) {
+    DecodedInstruction dec = {.opcode = in.opcode, .op = EOP_TRP, .a1 = in.a1, .a2 = in.a2, .a3 = in.a3, .imm = 0};
+    switch (in.opcode) {
+    case OP_NOP:
+        dec.op = EOP_NOP;
+        break;
+    case OP_ADD:
+        dec.op = EOP_ADD;
+        break;
+    case OP_SUB:
+        dec.op = EOP_SUB;
+        break;
+    case OP_AND:
+        dec.op = EOP_AND;
+        break;
+    case OP_ORR:
+        dec.op = EOP_ORR;
+        break;
+    case OP_XOR:
+        dec.op = EOP_XOR;
+        break;
+    case OP_NOT:
+        dec.op = EOP_NOT;
+        break;
+    case OP_LSH:
+        dec.op = EOP_LSH;
+        break;
+    case OP_ASH:
+        dec.op = EOP_ASH;
+        break;
+    case OP_TCU:
+        dec.op = EOP_TCU;
+        break;
+    case OP_TCS:
+        dec.op = EOP_TCS;
+        break;
+    case OP_SET:
+        dec.op = EOP_SET;
+        dec.imm = in.a2 | (in.a3 << 8);
+        break;
+    case OP_MOV:
+        dec.op = EOP_MOV;
+        break;
+    case OP_LDW:
+        dec.op = EOP_LDW;
+        break;
+    case OP_STW:
+        dec.op = EOP_STW;
+        break;
+    case OP_INT:
+        dec.op = EOP_INT;
+        break;
+    case OP_HLT:
+        dec.op = EOP_HLT;
+        break;
+    case OP_BRX:
+        dec.op = EOP_BRX;
+        break;
+    }
+    if (!emu_verify(in)) {
+        dec.op = EOP_TRP;
+    }
+    dec.fused = dec.op;
+    dec.flen = 1;
+    dec.fa = 0;
+    return dec;
+}
+
+bool emu_is_set_at(const DecodedInstruction *in, UWORD imm) {
+    return in->op == EOP_SET && in->a1 == REG_RAT && in->imm == imm;
+}
+
+bool emu_is_op(const DecodedInstruction *in, EmuOp op, ARG a1, ARG a2, ARG a3) {
+    return in->op == op && in->a1 == a1 && in->a2 == a2 && in->a3 == a3;
+}
+
+/**
+ * Recognize a pseudo-instruction expansion from asm_ext.h at in[0..avail) and turn in[0] into its superinstruction.
+ * Operands that would read or write pc mid-sequence are left alone.
+ */
+void emu_fuse(DecodedInstruction *in, size_t avail) {
+    in->fused = in->op;
+    in->flen = 1;
+    in->fa = 0;
+    if (in->op != EOP_SET || in->a1 != REG_RAT) {
+        return; // every expansion starts by setting at
+    }
+    // cal rA: set at 16, add ad at pc, set at 4, sub sp sp at, stw sp ad, mov pc rA
+    if (avail >= 6 && emu_is_set_at(&in[0], 4 * sizeof(UWORD)) && emu_is_op(&in[1], EOP_ADD, REG_RAD, REG_RAT, REG_RPC) &&
+        emu_is_set_at(&in[2], sizeof(UWORD)) && emu_is_op(&in[3], EOP_SUB, REG_RSP, REG_RSP, REG_RAT) &&
+        in[4].op == EOP_STW && in[4].a1 == REG_RSP && in[4].a2 == REG_RAD && in[5].op == EOP_MOV &&
+        in[5].a1 == REG_RPC && in[5].a2 != REG_RPC) {
+        in->fused = EOP_CAL;
+        in->flen = 6;
+        in->fa = in[5].a2;
+        return;
+    }
+    if (avail >= 3 && emu_is_set_at(&in[0], sizeof(UWORD))) {
+        // ret: set at 4, ldw ad sp, add sp sp at, mov pc ad
+        if (avail >= 4 && in[1].op == EOP_LDW && in[1].a1 == REG_RAD && in[1].a2 == REG_RSP &&
+            emu_is_op(&in[2], EOP_ADD, REG_RSP, REG_RSP, REG_RAT) && in[3].op == EOP_MOV && in[3].a1 == REG_RPC &&
+            in[3].a2 == REG_RAD) {
+            in->fused = EOP_RET;
+            in->flen = 4;
+            return;
+        }
+        // psh rA: set at 4, sub sp sp at, stw sp rA
+        if (emu_is_op(&in[1], EOP_SUB, REG_RSP, REG_RSP, REG_RAT) && in[2].op == EOP_STW && in[2].a1 == REG_RSP &&
+            in[2].a2 != REG_RPC) {
+            in->fused = EOP_PSH;
+            in->flen = 3;
+            in->fa = in[2].a2;
+            return;
+        }
+        // pop rA: set at 4, ldw rA sp, add sp sp at
+        if (in[1].op == EOP_LDW && in[1].a1 != REG_RPC && in[1].a2 == REG_RSP &&
+            emu_is_op(&in[2], EOP_ADD, REG_RSP, REG_RSP, REG_RAT)) {
+            in->fused = EOP_POP;
+            in->flen = 3;
+            in->fa = in[1].a1;
+            return;
+        }
+    }
+    // adi rA imm / sbi rA imm: set at imm, add/sub rA rA at
+    if (avail >= 2 && (in[1].op == EOP_ADD || in[1].op == EOP_SUB) && in[1].a1 != REG_RPC && in[1].a1 == in[1].a2 &&
+        in[1].a3 == REG_RAT) {
+        in->fused = in[1].op == EOP_ADD ? EOP_ADI : EOP_SBI;
+        in->flen = 2;
+        in->fa = in[1].a1;
+    }
+}
+
+/**
+ * Re-decode the cached instructions overlapping [addr, addr + size)
+ */
+void emu_predecode_range(EmulatorState *emu_st, UWORD addr, UWORD size) {
+    UWORD lo = addr < emu_st->code_base ? 0 : addr - emu_st->code_base;
+    UWORD hi = addr + size - emu_st->code_base; // one past the last touched byte
+    if (hi > emu_st->code_sz) {
+        hi = emu_st->code_sz;
+    }
+    for (UWORD i = lo / INSTR_SIZE; i * INSTR_SIZE < hi; i++) {
+        UWORD in_addr = emu_st->code_base + i * INSTR_SIZE;
+        emu_st->code[i] = emu_decode(emu_fetch(emu_st, in_addr));
+    }
+    // superinstructions starting up to EMU_MAX_FUSED - 1 entries earlier may cover the changed entries
+    size_t code_ct = emu_st->code_sz / INSTR_SIZE;
+    size_t first = lo / INSTR_SIZE;
+    first = first < EMU_MAX_FUSED - 1 ? 0 : first - (EMU_MAX_FUSED - 1);
+    for (size_t i = first; i * INSTR_SIZE < hi; i++) {
+        emu_fuse(&emu_st->code[i], code_ct - i);
+    }
+    emu_st->code_gen++;
+}
+
+/**
+ * Predecode the code section so execution does not have to rebuild instructions every tick
+ */
+void emu_predecode(EmulatorState *emu_st, UWORD base, UWORD size) {
+    if (base > emu_st->mem_sz) {
+        base = emu_st->mem_sz;
+    }
+    if (size > emu_st->mem_sz - base) {
+        size = emu_st->mem_sz - base; // never cache past the end of memory
+    }
+    emu_st->code_base = base;
+    emu_st->code_sz = size - (size % INSTR_SIZE); // trailing partial words are never cached
+    // reuses the previous buffer when the emulator is reset and loaded again
+    emu_st->code = realloc(emu_st->code, (emu_st->code_sz / INSTR_SIZE + 1) * sizeof(DecodedInstruction));
+    emu_predecode_range(emu_st, base, emu_st->code_sz);
+}
+
+/**
+ * Report the instructions of the predecoded code section that failed verification, which trap if they are executed.
+ * Returns how many there are.
+ */
+size_t emu_verify_code(EmulatorState *emu_st) {
+    size_t invalid_ct = 0;
+    UWORD first_invalid = 0;
+    for (size_t i = 0; i < emu_st->code_sz / INSTR_SIZE; i++) {
+        if (emu_st->code[i].op == EOP_TRP && invalid_ct++ == 0) {
+            first_invalid = emu_st->code_base + i * INSTR_SIZE;
+        }
+    }
+    if (invalid_ct > 0 && !emu_st->quiet) {
+        printf("WARN: %zu invalid instructions in code, first at $%04x; they trap if executed.\n", invalid_ct,
+               first_invalid);
+    }
+    return invalid_ct;
+}
+
+/**
+ * Keep the predecoded code coherent after a store of `size` bytes at addr
+ */
+void emu_invalidate(EmulatorState *emu_st, UWORD addr, UWORD size) {
+    // unsigned wraparound makes this a single compare for [code_base - size + 1, code_base + code_sz)
+    if (addr - emu_st->code_base + (size - 1) < emu_st->code_sz + (size - 1)) {
+        emu_predecode_range(emu_st, addr, size);
+    }
+}
+
+/**
+ * Get the decoded instruction at pc, from the cache when possible.
+ * `slot` receives instructions decoded on the fly from outside the cache.
+ */
+const DecodedInstruction *emu_fetch_decoded(EmulatorState *emu_st, UWORD pc, DecodedInstruction *slot) {
+    UWORD off = pc - emu_st->code_base;
+    if (off < emu_st->code_sz && (off % INSTR_SIZE) == 0) {
+        return &emu_st->code[off / INSTR_SIZE];
+    }
+    *slot = emu_decode(emu_fetch(emu_st, pc));
+    return slot;
+}
+
+/* #endregion */
+
+/* #region Memory Access */
+
+/**
+ * Address the load or store in would access. Returns false if in does not access memory.
+ */
+bool emu_access_addr(EmulatorState *emu_st, const DecodedInstruction *in, UWORD *addr) {
+    if (in->op == EOP_LDW) {
+        *addr = emu_st->reg[in->a2];
+    } else if (in->op == EOP_STW) {
+        *addr = emu_st->reg[in->a1];
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void emu_mark_page(EmulatorState *emu_st, size_t page) {
+    BYTE flags = emu_st->page_flags[page];
+    if (!(flags & EMU_PAGE_DIRTY)) {
+        emu_st->dirty_list[emu_st->dirty_ct++] = page;
+    }
+    if (!(flags & EMU_PAGE_TOUCHED)) {
+        emu_st->touched_list[emu_st->touched_ct++] = page;
+    }
+    emu_st->page_flags[page] = EMU_PAGE_DIRTY | EMU_PAGE_TOUCHED;
+}
+
+/**
+ * Record a write of size bytes at addr for snapshots and resets
+ */
+void emu_mark_written(EmulatorState *emu_st, size_t addr, size_t size) {
+    if (size == 0 || addr >= emu_st->mem_sz) {
+        return;
+    }
+    size_t last = addr + size - 1 < emu_st->mem_sz ? addr + size - 1 : emu_st->mem_sz - 1;
+    for (size_t page = addr >> EMU_PAGE_SHIFT; page <= last >> EMU_PAGE_SHIFT; page++) {
+        if (!(emu_st->page_flags[page] & EMU_PAGE_DIRTY)) {
+            emu_mark_page(emu_st, page);
+        }
+    }
+}
+
+UWORD emu_load_word(EmulatorState *emu_st, UWORD addr) {
+#if !EMU_GUARD
+    emu_check_access(emu_st, addr);
+#endif
+    return emu_st->mem[addr + 0] << 0 | emu_st->mem[addr + 1] << 8 | emu_st->mem[addr + 2] << 16 |
+           emu_st->mem[addr + 3] << 24;
+}
+
+void emu_store_word(EmulatorState *emu_st, UWORD addr, UWORD val) {
+    emu_check_access(emu_st, addr);
+    emu_st->mem[addr + 0] = (val >> 0) & 0xff;
+    emu_st->mem[addr + 1] = (val >> 8) & 0xff;
+    emu_st->mem[addr + 2] = (val >> 16) & 0xff;
+    emu_st->mem[addr + 3] = (val >> 24) & 0xff;
+    emu_mark_written(emu_st, addr, sizeof(UWORD));
+    emu_invalidate(emu_st, addr, sizeof(UWORD));
+}
+
+/**
+ * Copy size bytes from the host into guest memory at addr, clamped to the end of memory
+ */
+void emu_write_bytes(EmulatorState *emu_st, UWORD addr, const BYTE *src, size_t size) {
+    if (addr >= emu_st->mem_sz) {
+        return;
+    }
+    if (size > emu_st->mem_sz - addr) {
+        size = emu_st->mem_sz - addr;
+    }
+    memcpy(emu_st->mem + addr, src, size);
+    emu_mark_written(emu_st, addr, size);
+    emu_invalidate(emu_st, addr, size);
+}
+
+/* #endregion */
+
+/* #region Loading */
+
 /**
  * Load the program data into memory
  */
-RGHeader emu_load(EmulatorState *emu_st, int offset, char *program, size_t program_sz) {
+RGHeader emu_load(EmulatorState *emu_st, UWORD offset, char *program, size_t program_sz) {
     // read RG header
-    RGHeader hd = decode_header(program, program_sz);
-    dump_header(hd);
+    RGHeader hd = decode_header(program, program_sz, !emu_st->quiet);
+    if (!emu_st->quiet) {
+        dump_header(hd);
+    }
     // offset the copy to start after the header
     size_t copy_sz = program_sz - hd.decode_offset;
+    if (offset + copy_sz > emu_st->mem_sz) {
+        if (!emu_st->quiet) {
+            printf("WARN: program does not fit in memory, truncating.\n");
+        }
+        copy_sz = offset < emu_st->mem_sz ? emu_st->mem_sz - offset : 0;
+    }
     memcpy(emu_st->mem + offset, program + hd.decode_offset, copy_sz);
+    emu_mark_written(emu_st, offset, copy_sz);
+    // the code section follows the data section
+    emu_predecode(emu_st, offset + hd.data_size, hd.code_size);
+    emu_verify_code(emu_st);
     return hd;
 }
 
+#if EMU_MMAP
+/**
+ * Read the program in fd straight into guest memory, without an intermediate buffer.
+ * Returns false, having loaded nothing, if the file is too short for a header.
+ */
+bool emu_read_program(EmulatorState *emu_st, int fd, RGHeader *hd) {
+    struct stat sb;
+    char head[HEADER_SIZE];
+    if (fstat(fd, &sb) != 0 || pread(fd, head, HEADER_SIZE, 0) != HEADER_SIZE) {
+        return false;
+    }
+    *hd = decode_header(head, sb.st_size, !emu_st->quiet);
+    if (!emu_st->quiet) {
+        dump_header(*hd);
+    }
+    size_t copy_sz = sb.st_size - hd->decode_offset;
+    if (copy_sz > emu_st->mem_sz) {
+        if (!emu_st->quiet) {
+            printf("WARN: program does not fit in memory, truncating.\n");
+        }
+        copy_sz = emu_st->mem_sz;
+    }
+    size_t done = 0;
+    while (done < copy_sz) {
+        ssize_t got = pread(fd, emu_st->mem + done, copy_sz - done, hd->decode_offset + done);
+        if (got <= 0) {
+            break; // the file shrank, the rest stays zero
+        }
+        done += got;
+    }
+    emu_mark_written(emu_st, 0, done);
+    emu_predecode(emu_st, hd->data_size, hd->code_size);
+    emu_verify_code(emu_st);
+    return true;
+}
+#endif
+
+/**
+ * Load a program file into guest memory. The file is read once, so changing it afterwards does not affect the running
+ * program. Returns false if the file cannot be opened.
+ */
+bool emu_load_file(EmulatorState *emu_st, const char *path, RGHeader *hd) {
+#if EMU_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool loaded = emu_read_program(emu_st, fd, hd);
+    close(fd);
+    if (loaded) {
+        return true;
+    }
+#endif
+    // read the whole file, also taking files too short for a header as bare binaries
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    FileReadResult file = util_read_file_contents(fp);
+    fclose(fp);
+    *hd = emu_load(emu_st, 0, file.content, file.size);
+    free(file.content);
+    return true;
+}
+
+/* #endregion */
+
+/* #region Snapshots */
+
+typedef struct {
+    EmulatorState *owner;
+    uint64_t id;
+    UWORD *reg;
+    uint64_t ticks;
+    bool executing;
+    EmuExit exit;
+    bool debug;
+    bool onestep;
+    BYTE *pages;        // contents of the pages that had been written when the snapshot was taken
+    UWORD *saved_pages; // page number of each entry in pages
+    size_t saved_ct;
+    uint32_t *slot;     // for every page of memory, 1 + its index in pages, or 0 if the page was zero
+} EmuSnapshot;
+
+/**
+ * Capture registers, memory, ticks, and debug flags. Only pages written since the last reset are copied.
+ * Afterwards dirty pages are tracked relative to this snapshot, so restoring it only touches what changed.
+ */
+EmuSnapshot *emu_snapshot(EmulatorState *emu_st) {
+    EmuSnapshot *snap = malloc(sizeof(EmuSnapshot));
+    snap->owner = emu_st;
+    snap->id = ++emu_st->snapshot_ct;
+    snap->reg = malloc(REGISTER_COUNT * sizeof(UWORD));
+    memcpy(snap->reg, emu_st->reg, REGISTER_COUNT * sizeof(UWORD));
+    snap->ticks = emu_st->ticks;
+    snap->executing = emu_st->executing;
+    snap->exit = emu_st->exit;
+    snap->debug = emu_st->debug;
+    snap->onestep = emu_st->onestep;
+
+    snap->saved_ct = emu_st->touched_ct;
+    snap->pages = malloc(snap->saved_ct * EMU_PAGE_SIZE);
+    snap->saved_pages = malloc(snap->saved_ct * sizeof(UWORD));
+    snap->slot = calloc(emu_page_count(emu_st), sizeof(uint32_t));
+    for (size_t i = 0; i < snap->saved_ct; i++) {
+        size_t page = emu_st->touched_list[i];
+        memcpy(snap->pages + i * EMU_PAGE_SIZE, emu_st->mem + (page << EMU_PAGE_SHIFT), emu_page_size(emu_st, page));
+        snap->saved_pages[i] = page;
+        snap->slot[page] = i + 1;
+    }
+
+    // start tracking against the snapshot
+    for (size_t i = 0; i < emu_st->dirty_ct; i++) {
+        emu_st->page_flags[emu_st->dirty_list[i]] &= ~EMU_PAGE_DIRTY;
+    }
+    emu_st->dirty_ct = 0;
+    emu_st->baseline = snap->id;
+    return snap;
+}
+
+/**
+ * Bring a page back to its contents in snap
+ */
+void emu_restore_page(EmulatorState *emu_st, const EmuSnapshot *snap, size_t page) {
+    BYTE *dst = emu_st->mem + (page << EMU_PAGE_SHIFT);
+    size_t size = emu_page_size(emu_st, page);
+    if (snap->slot[page]) {
+        memcpy(dst, snap->pages + (snap->slot[page] - 1) * EMU_PAGE_SIZE, size);
+    } else {
+        memset(dst, 0, size);
+    }
+    emu_invalidate(emu_st, page << EMU_PAGE_SHIFT, size); // the page may hold code
+}
+
+/**
+ * Return the emulator to a snapshot. When the snapshot is the current baseline only dirty pages are restored,
+ * otherwise memory is reset and every saved page is copied back.
+ */
+void emu_restore(EmulatorState *emu_st, const EmuSnapshot *snap) {
+    if (snap->owner == emu_st && emu_st->baseline == snap->id) {
+        for (size_t i = 0; i < emu_st->dirty_ct; i++) {
+            size_t page = emu_st->dirty_list[i];
+            emu_restore_page(emu_st, snap, page);
+            emu_st->page_flags[page] &= ~EMU_PAGE_DIRTY;
+        }
+        emu_st->dirty_ct = 0;
+    } else {
+        UWORD code_base = emu_st->code_base;
+        UWORD code_sz = emu_st->code_sz;
+        emu_reset(emu_st);
+        for (size_t i = 0; i < snap->saved_ct; i++) {
+            size_t page = snap->saved_pages[i];
+            emu_restore_page(emu_st, snap, page);
+            emu_st->page_flags[page] = EMU_PAGE_TOUCHED;
+            emu_st->touched_list[emu_st->touched_ct++] = page;
+        }
+        emu_predecode(emu_st, code_base, code_sz);
+        emu_st->baseline = snap->owner == emu_st ? snap->id : 0;
+    }
+    memcpy(emu_st->reg, snap->reg, REGISTER_COUNT * sizeof(UWORD));
+    emu_st->ticks = snap->ticks;
+    emu_st->executing = snap->executing;
+    emu_st->exit = snap->exit;
+    emu_st->debug = snap->debug;
+    emu_st->onestep = snap->onestep;
+}
+
+void emu_snapshot_free(EmuSnapshot *snap) {
+    free(snap->reg);
+    free(snap->pages);
+    free(snap->saved_pages);
+    free(snap->slot);
+    free(snap);
+}
+
 /* #endregion */
 
 /* #region Dumping */
@@ -113,6 +991,9 @@ void emu_dump(EmulatorState *emu_st, bool full) {
  * Handle interrupts in emulator
  */
 void emu_interrupt(EmulatorState *emu_st, UWORD interrupt) {
+    if (emu_st->quiet) {
+        return; // nobody is watching, and nobody can answer a pause or break
+    }
     printf("--INT: $%08x-- \n", interrupt);
     switch (interrupt) {
     case INTERRUPT_PAUSE: {
@@ -133,9 +1014,9 @@ void emu_interrupt(EmulatorState *emu_st, UWORD interrupt) {
         // pages don't exist so dump 256 after sp
         UWORD sp = emu_st->reg[0];
         printf("sp = $%04x\n", sp);
-        for (UWORD i = sp; i < sp + 256; i++) {
+        for (size_t i = sp; i < (size_t)sp + 256 && i < emu_st->mem_sz; i++) {
             if ((i - sp) % 16 == 0) {
-                printf("\n  $%04x   ", i);
+                printf("\n  $%04x   ", (UWORD)i);
             }
             uint8_t by = emu_st->mem[i];
             printf("%02x ", by);
@@ -147,7 +1028,7 @@ void emu_interrupt(EmulatorState *emu_st, UWORD interrupt) {
         // dump stack
         printf("-- STK --\n");
         UWORD sp = emu_st->reg[REG_RSP];
-        for (UWORD addr = sp; addr < emu_st->mem_sz; addr += sizeof(UWORD)) {
+        for (size_t addr = sp; addr + sizeof(UWORD) <= emu_st->mem_sz; addr += sizeof(UWORD)) {
             UWORD data = emu_st->mem[addr + 0] << 0 | emu_st->mem[addr + 1] << 8 | emu_st->mem[addr + 2] << 16 |
                          emu_st->mem[addr + 3] << 24;
             printf(" %0x", data);
@@ -175,173 +1056,937 @@ void emu_interrupt(EmulatorState *emu_st, UWORD interrupt) {
 
 /* #region Instruction Execution */
 
+void emu_op_nop(EmulatorState *emu_st, const DecodedInstruction *in) {
+    // do nothing
+    (void)emu_st;
+    (void)in;
+}
+
+void emu_op_add(EmulatorState *emu_st, const DecodedInstruction *in) {
+    emu_st->reg[in->a1] = emu_st->reg[in->a2] + emu_st->reg[in->a3];
+}
+
+void emu_op_sub(EmulatorState *emu_st, const DecodedInstruction *in) {
+    emu_st->reg[in->a1] = emu_st->reg[in->a2] - emu_st->reg[in->a3];
+}
+
+void emu_op_and(EmulatorState *emu_st, const DecodedInstruction *in) {
+    emu_st->reg[in->a1] = emu_st->reg[in->a2] & emu_st->reg[in->a3];
+}
+
+void emu_op_orr(EmulatorState *emu_st, const DecodedInstruction *in) {
+    emu_st->reg[in->a1] = emu_st->reg[in->a2] | emu_st->reg[in->a3];
+}
+
+void emu_op_xor(EmulatorState *emu_st, const DecodedInstruction *in) {
+    emu_st->reg[in->a1] = emu_st->reg[in->a2] ^ emu_st->reg[in->a3];
+}
+
+void emu_op_not(EmulatorState *emu_st, const DecodedInstruction *in) {
+    emu_st->reg[in->a1] = ~emu_st->reg[in->a2];
+}
+
+void emu_op_lsh(EmulatorState *emu_st, const DecodedInstruction *in) {
+    WORD shift = emu_st->reg[in->a3];
+    if (shift >= 0) {
+        emu_st->reg[in->a1] = emu_st->reg[in->a2] << shift;
+    } else {
+        emu_st->reg[in->a1] = emu_st->reg[in->a2] >> -shift;
+    }
+}
+
+void emu_op_ash(EmulatorState *emu_st, const DecodedInstruction *in) {
+    WORD shift = emu_st->reg[in->a3];
+    if (shift >= 0) {
+        emu_st->reg[in->a1] = ((WORD)emu_st->reg[in->a2]) << shift;
+    } else {
+        emu_st->reg[in->a1] = ((WORD)emu_st->reg[in->a2]) >> -shift;
+    }
+}
+
+void emu_op_tcu(EmulatorState *emu_st, const DecodedInstruction *in) {
+    WORD sign = 0;
+    if (emu_st->reg[in->a2] > emu_st->reg[in->a3]) {
+        sign = 1;
+    } else if (emu_st->reg[in->a2] < emu_st->reg[in->a3]) {
+        sign = -1;
+    }
+    emu_st->reg[in->a1] = sign;
+}
+
+void emu_op_tcs(EmulatorState *emu_st, const DecodedInstruction *in) {
+    WORD sign = 0;
+    if (((WORD)emu_st->reg[in->a2]) > ((WORD)emu_st->reg[in->a3])) {
+        sign = 1;
+    } else if (((WORD)emu_st->reg[in->a2]) < ((WORD)emu_st->reg[in->a3])) {
+        sign = -1;
+    }
+    emu_st->reg[in->a1] = sign;
+}
+
+void emu_op_set(EmulatorState *emu_st, const DecodedInstruction *in) { emu_st->reg[in->a1] = in->imm; }
+
+void emu_op_mov(EmulatorState *emu_st, const DecodedInstruction *in) { emu_st->reg[in->a1] = emu_st->reg[in->a2]; }
+
+void emu_op_ldw(EmulatorState *emu_st, const DecodedInstruction *in) {
+    emu_st->reg[in->a1] = emu_load_word(emu_st, emu_st->reg[in->a2]);
+}
+
+void emu_op_stw(EmulatorState *emu_st, const DecodedInstruction *in) {
+    emu_store_word(emu_st, emu_st->reg[in->a1], emu_st->reg[in->a2]);
+}
+
+void emu_op_int(EmulatorState *emu_st, const DecodedInstruction *in) {
+    UWORD interrupt = emu_st->reg[in->a1];
+    emu_interrupt(emu_st, interrupt);
+}
+
+void emu_op_hlt(EmulatorState *emu_st, const DecodedInstruction *in) {
+    (void)in;
+    emu_st->executing = false;
+    emu_st->exit = EMU_EXIT_HALT;
+}
+
+void emu_op_brx(EmulatorState *emu_st, const DecodedInstruction *in) {
+    if (emu_st->reg[in->a2] > 0) {
+        emu_st->reg[REG_RPC] = emu_st->reg[in->a1];
+    }
+}
+
+/**
+ * Stop on an instruction that failed verification. pc has already moved past it.
+ */
+void emu_op_trp(EmulatorState *emu_st, const DecodedInstruction *in) {
+    UWORD pc = emu_st->reg[REG_RPC] - INSTR_SIZE;
+    emu_st->executing = false;
+    emu_st->exit = EMU_EXIT_TRAP;
+    emu_st->fault_pc = pc;
+    emu_st->fault_addr = 0;
+    if (!emu_st->quiet) {
+        printf("-- TRAP: $%04x invalid instruction %02x %02x %02x %02x --\n", pc, in->opcode, in->a1, in->a2,
+               in->a3);
+    }
+}
+
+/*
+ * Superinstructions replay their expansion step by step so aliasing operands behave exactly as unfused.
+ * They return the number of instructions executed.
+ */
+
+int emu_super_psh(EmulatorState *emu_st, const DecodedInstruction *in) {
+    UWORD *reg = emu_st->reg;
+    int flen = in->flen; // stores may re-decode in
+    reg[REG_RAT] = sizeof(UWORD);
+    reg[REG_RSP] -= reg[REG_RAT];
+    emu_store_word(emu_st, reg[REG_RSP], reg[in->fa]); // last use of in
+    reg[REG_RPC] += (flen - 1) * INSTR_SIZE;
+    return flen;
+}
+
+int emu_super_pop(EmulatorState *emu_st, const DecodedInstruction *in) {
+    UWORD *reg = emu_st->reg;
+    reg[REG_RAT] = sizeof(UWORD);
+    reg[in->fa] = emu_load_word(emu_st, reg[REG_RSP]);
+    reg[REG_RSP] += reg[REG_RAT];
+    reg[REG_RPC] += (in->flen - 1) * INSTR_SIZE;
+    return in->flen;
+}
+
+int emu_super_cal(EmulatorState *emu_st, const DecodedInstruction *in) {
+    UWORD *reg = emu_st->reg;
+    int flen = in->flen; // stores may re-decode in
+    reg[REG_RAT] = 4 * sizeof(UWORD);
+    reg[REG_RAD] = reg[REG_RAT] + reg[REG_RPC] + INSTR_SIZE; // pc as seen by the second instruction
+    reg[REG_RAT] = sizeof(UWORD);
+    reg[REG_RSP] -= reg[REG_RAT];
+    ARG target = in->fa;
+    uint64_t code_gen = emu_st->code_gen;
+    emu_store_word(emu_st, reg[REG_RSP], reg[REG_RAD]);
+    if (emu_st->code_gen != code_gen) {
+        // the store rewrote code, so the final jump has to be fetched again
+        reg[REG_RPC] += (flen - 2) * INSTR_SIZE;
+        return flen - 1;
+    }
+    reg[REG_RPC] = reg[target];
+    return flen;
+}
+
+int emu_super_ret(EmulatorState *emu_st, const DecodedInstruction *in) {
+    UWORD *reg = emu_st->reg;
+    reg[REG_RAT] = sizeof(UWORD);
+    reg[REG_RAD] = emu_load_word(emu_st, reg[REG_RSP]);
+    reg[REG_RSP] += reg[REG_RAT];
+    reg[REG_RPC] = reg[REG_RAD];
+    return in->flen;
+}
+
+int emu_super_adi(EmulatorState *emu_st, const DecodedInstruction *in) {
+    UWORD *reg = emu_st->reg;
+    reg[REG_RAT] = in->imm;
+    reg[in->fa] += reg[REG_RAT];
+    reg[REG_RPC] += (in->flen - 1) * INSTR_SIZE;
+    return in->flen;
+}
+
+int emu_super_sbi(EmulatorState *emu_st, const DecodedInstruction *in) {
+    UWORD *reg = emu_st->reg;
+    reg[REG_RAT] = in->imm;
+    reg[in->fa] -= reg[REG_RAT];
+    reg[REG_RPC] += (in->flen - 1) * INSTR_SIZE;
+    return in->flen;
+}
+
 /**
  * Execute an instruction in the emulator
  */
-void emu_exec(EmulatorState *emu_st, Instruction in) {
-    switch (in.opcode) {
-    case OP_NOP: {
-        // do nothing
+void emu_exec(EmulatorState *emu_st, const DecodedInstruction *in) {
+    switch (in->op) {
+    case EOP_NOP:
+        emu_op_nop(emu_st, in);
         break;
-    }
-    case OP_ADD: {
-        emu_st->reg[in.a1] = emu_st->reg[in.a2] + emu_st->reg[in.a3];
+    case EOP_ADD:
+        emu_op_add(emu_st, in);
         break;
-    }
-    case OP_SUB: {
-        emu_st->reg[in.a1] = emu_st->reg[in.a2] - emu_st->reg[in.a3];
+    case EOP_SUB:
+        emu_op_sub(emu_st, in);
         break;
-    }
-    case OP_AND: {
-        emu_st->reg[in.a1] = emu_st->reg[in.a2] & emu_st->reg[in.a3];
+    case EOP_AND:
+        emu_op_and(emu_st, in);
         break;
-    }
-    case OP_ORR: {
-        emu_st->reg[in.a1] = emu_st->reg[in.a2] | emu_st->reg[in.a3];
+    case EOP_ORR:
+        emu_op_orr(emu_st, in);
         break;
-    }
-    case OP_XOR: {
-        emu_st->reg[in.a1] = emu_st->reg[in.a2] ^ emu_st->reg[in.a3];
+    case EOP_XOR:
+        emu_op_xor(emu_st, in);
         break;
-    }
-    case OP_NOT: {
-        emu_st->reg[in.a1] = ~emu_st->reg[in.a2];
+    case EOP_NOT:
+        emu_op_not(emu_st, in);
         break;
-    }
-    case OP_LSH: {
-        WORD shift = emu_st->reg[in.a3];
-        if (shift >= 0) {
-            emu_st->reg[in.a1] = emu_st->reg[in.a2] << shift;
-        } else {
-            emu_st->reg[in.a1] = emu_st->reg[in.a2] >> -shift;
-        }
+    case EOP_LSH:
+        emu_op_lsh(emu_st, in);
+        break;
+    case EOP_ASH:
+        emu_op_ash(emu_st, in);
+        break;
+    case EOP_TCU:
+        emu_op_tcu(emu_st, in);
+        break;
+    case EOP_TCS:
+        emu_op_tcs(emu_st, in);
+        break;
+    case EOP_SET:
+        emu_op_set(emu_st, in);
+        break;
+    case EOP_MOV:
+        emu_op_mov(emu_st, in);
+        break;
+    case EOP_LDW:
+        emu_op_ldw(emu_st, in);
+        break;
+    case EOP_STW:
+        emu_op_stw(emu_st, in);
+        break;
+    case EOP_INT:
+        emu_op_int(emu_st, in);
+        break;
+    case EOP_HLT:
+        emu_op_hlt(emu_st, in);
+        break;
+    case EOP_BRX:
+        emu_op_brx(emu_st, in);
+        break;
+    case EOP_TRP:
+        emu_op_trp(emu_st, in);
+        break;
+    default:
         break;
     }
-    case OP_ASH: {
-        WORD shift = emu_st->reg[in.a3];
-        if (shift >= 0) {
-            emu_st->reg[in.a1] = ((WORD)emu_st->reg[in.a2]) << shift;
+}
+
+/**
+ * Execute the superinstruction starting at in, or in alone if there is none.
+ * Returns the number of instructions executed.
+ */
+int emu_exec_fused(EmulatorState *emu_st, const DecodedInstruction *in) {
+    switch (in->fused) {
+    case EOP_PSH:
+        return emu_super_psh(emu_st, in);
+    case EOP_POP:
+        return emu_super_pop(emu_st, in);
+    case EOP_CAL:
+        return emu_super_cal(emu_st, in);
+    case EOP_RET:
+        return emu_super_ret(emu_st, in);
+    case EOP_ADI:
+        return emu_super_adi(emu_st, in);
+    case EOP_SBI:
+        return emu_super_sbi(emu_st, in);
+    default:
+        emu_exec(emu_st, in);
+        return 1;
+    }
+}
+
+/**
+ * Execute like emu_exec_fused, but run in alone when its superinstruction would take more than room ticks, so a tick
+ * budget is never overshot. Returns the number of instructions executed.
+ */
+int emu_exec_within(EmulatorState *emu_st, const DecodedInstruction *in, uint64_t room) {
+    if (in->flen > room) {
+        emu_exec(emu_st, in);
+        return 1;
+    }
+    return emu_exec_fused(emu_st, in);
+}
+
+/**
+ * Fetch, execute, and count a single instruction
+ */
+void emu_step(EmulatorState *emu_st) {
+    DecodedInstruction slot;
+    const DecodedInstruction *in = emu_fetch_decoded(emu_st, emu_st->reg[REG_RPC], &slot);
+    emu_st->reg[REG_RPC] += INSTR_SIZE;
+    emu_exec(emu_st, in);
+    emu_st->ticks++;
+}
+
+/**
+ * Stop execution because the tick budget is used up
+ */
+void emu_out_of_ticks(EmulatorState *emu_st) {
+    emu_st->executing = false;
+    emu_st->exit = EMU_EXIT_TICKS;
+}
+
+/**
+ * Whether the fast loops must hand control back to emu_run
+ */
+bool emu_wants_debugger(EmulatorState *emu_st) { return emu_st->debug || emu_st->onestep; }
+
+/**
+ * Run without debugging until halted, dispatching through emu_exec
+ */
+void emu_run_switch(EmulatorState *emu_st) {
+    uint64_t ticks = emu_st->ticks;
+    UWORD *reg = emu_st->reg;
+    const DecodedInstruction *code = emu_st->code;
+    const UWORD code_base = emu_st->code_base;
+    const UWORD code_sz = emu_st->code_sz;
+    const uint64_t tick_limit = emu_st->tick_limit;
+    DecodedInstruction slot;
+    while (emu_st->executing) {
+        if (ticks >= tick_limit) {
+            emu_out_of_ticks(emu_st);
+            break;
+        }
+        const DecodedInstruction *in;
+        UWORD off = reg[REG_RPC] - code_base;
+        if (off < code_sz && (off % INSTR_SIZE) == 0) {
+            in = &code[off / INSTR_SIZE];
         } else {
-            emu_st->reg[in.a1] = ((WORD)emu_st->reg[in.a2]) >> -shift;
+            in = emu_fetch_decoded(emu_st, reg[REG_RPC], &slot);
         }
-        break;
-    }
-    case OP_TCU: {
-        WORD sign = 0;
-        if (emu_st->reg[in.a2] > emu_st->reg[in.a3]) {
-            sign = 1;
-        } else if (emu_st->reg[in.a2] < emu_st->reg[in.a3]) {
-            sign = -1;
+        reg[REG_RPC] += INSTR_SIZE;
+        emu_st->ticks = ticks; // current when a load or store faults
+        ticks += emu_exec_within(emu_st, in, tick_limit - ticks);
+        // only interrupts can turn on debugging
+        if (in->op == EOP_INT && emu_wants_debugger(emu_st)) {
+            break;
         }
-        emu_st->reg[in.a1] = sign;
-        break;
     }
-    case OP_TCS: {
-        WORD sign = 0;
-        if (((WORD)emu_st->reg[in.a2]) > ((WORD)emu_st->reg[in.a3])) {
-            sign = 1;
-        } else if (((WORD)emu_st->reg[in.a2]) < ((WORD)emu_st->reg[in.a3])) {
-            sign = -1;
+    emu_st->ticks = ticks;
+}
+
+/**
+ * Count a control transfer that did not fall through in the coverage map. Counts stop at 255 instead of wrapping to 0,
+ * which would read as never taken.
+ */
+void emu_cover_edge(BYTE *coverage, UWORD from, UWORD to) {
+    uint32_t src = (from / INSTR_SIZE) * 0x9e3779b1u;
+    uint32_t dst = (to / INSTR_SIZE) * 0x85ebca6bu;
+    BYTE *count = &coverage[((src >> 1) ^ dst) & (EMU_COVERAGE_SIZE - 1)];
+    *count += *count != 0xff;
+}
+
+/**
+ * Run without debugging until halted like emu_run_switch, recording edge coverage
+ */
+void emu_run_cover(EmulatorState *emu_st) {
+    uint64_t ticks = emu_st->ticks;
+    UWORD *reg = emu_st->reg;
+    BYTE *coverage = emu_st->coverage;
+    const uint64_t tick_limit = emu_st->tick_limit;
+    DecodedInstruction slot;
+    while (emu_st->executing) {
+        if (ticks >= tick_limit) {
+            emu_out_of_ticks(emu_st);
+            break;
+        }
+        UWORD pc = reg[REG_RPC];
+        const DecodedInstruction *in = emu_fetch_decoded(emu_st, pc, &slot);
+        reg[REG_RPC] += INSTR_SIZE;
+        emu_st->ticks = ticks; // current when a load or store faults
+        int ct = emu_exec_within(emu_st, in, tick_limit - ticks);
+        ticks += ct;
+        if (reg[REG_RPC] != pc + ct * INSTR_SIZE) {
+            emu_cover_edge(coverage, pc + (ct - 1) * INSTR_SIZE, reg[REG_RPC]);
+        }
+        if (in->op == EOP_INT && emu_wants_debugger(emu_st)) {
+            break;
         }
-        emu_st->reg[in.a1] = sign;
-        break;
     }
-    case OP_SET: {
-        emu_st->reg[in.a1] = in.a2 | (in.a3 << 8);
-        break;
+    emu_st->ticks = ticks;
+}
+
+#if EMU_THREADED
+// labels-as-values are a GNU extension
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/**
+ * Run without debugging until halted, with one indirect jump per handler instead of a shared switch
+ */
+void emu_run_threaded(EmulatorState *emu_st) {
+    static const void *handlers[EOP_COUNT] = {
+        [EOP_NOP] = &&op_nop, [EOP_ADD] = &&op_add, [EOP_SUB] = &&op_sub, [EOP_AND] = &&op_and,
+        [EOP_ORR] = &&op_orr, [EOP_XOR] = &&op_xor, [EOP_NOT] = &&op_not, [EOP_LSH] = &&op_lsh,
+        [EOP_ASH] = &&op_ash, [EOP_TCU] = &&op_tcu, [EOP_TCS] = &&op_tcs, [EOP_SET] = &&op_set,
+        [EOP_MOV] = &&op_mov, [EOP_LDW] = &&op_ldw, [EOP_STW] = &&op_stw, [EOP_INT] = &&op_int,
+        [EOP_HLT] = &&op_hlt, [EOP_BRX] = &&op_brx, [EOP_TRP] = &&op_trp, [EOP_PSH] = &&op_psh,
+        [EOP_POP] = &&op_pop, [EOP_CAL] = &&op_cal, [EOP_RET] = &&op_ret, [EOP_ADI] = &&op_adi,
+        [EOP_SBI] = &&op_sbi,
+    };
+    uint64_t ticks = emu_st->ticks;
+    UWORD *reg = emu_st->reg;
+    const DecodedInstruction *code = emu_st->code;
+    const UWORD code_base = emu_st->code_base;
+    const UWORD code_sz = emu_st->code_sz;
+    const uint64_t tick_limit = emu_st->tick_limit;
+    DecodedInstruction slot;
+    const DecodedInstruction *in;
+
+#define DISPATCH()                                                                                                     \
+    do {                                                                                                               \
+        if (ticks >= tick_limit) {                                                                                     \
+            emu_out_of_ticks(emu_st);                                                                                  \
+            goto done;                                                                                                 \
+        }                                                                                                              \
+        UWORD off = reg[REG_RPC] - code_base;                                                                          \
+        if (off < code_sz && (off % INSTR_SIZE) == 0) {                                                                \
+            in = &code[off / INSTR_SIZE];                                                                              \
+        } else {                                                                                                       \
+            emu_st->ticks = ticks; /* the fetch can fault */                                                           \
+            in = emu_fetch_decoded(emu_st, reg[REG_RPC], &slot);                                                       \
+        }                                                                                                              \
+        reg[REG_RPC] += INSTR_SIZE;                                                                                    \
+        ticks++;                                                                                                       \
+        /* a superinstruction runs only if all of it fits in the budget */                                             \
+        goto *handlers[ticks - 1 + in->flen <= tick_limit ? in->fused : in->op];                                       \
+    } while (0)
+#define HANDLER(name)                                                                                                  \
+    op_##name : emu_op_##name(emu_st, in);                                                                             \
+    DISPATCH();
+// handlers that access memory keep emu_st->ticks current in case the access faults
+#define MEM_HANDLER(name)                                                                                              \
+    op_##name : emu_st->ticks = ticks - 1;                                                                             \
+    emu_op_##name(emu_st, in);                                                                                         \
+    DISPATCH();
+#define SUPER_HANDLER(name)                                                                                            \
+    op_##name : emu_st->ticks = ticks - 1;                                                                             \
+    ticks += emu_super_##name(emu_st, in) - 1;                                                                         \
+    DISPATCH();
+
+    if (!emu_st->executing) {
+        return;
     }
-    case OP_MOV: {
-        emu_st->reg[in.a1] = emu_st->reg[in.a2];
-        break;
+    DISPATCH();
+
+    HANDLER(nop)
+    HANDLER(add)
+    HANDLER(sub)
+    HANDLER(and)
+    HANDLER(orr)
+    HANDLER(xor)
+    HANDLER(not)
+    HANDLER(lsh)
+    HANDLER(ash)
+    HANDLER(tcu)
+    HANDLER(tcs)
+    HANDLER(set)
+    HANDLER(mov)
+    MEM_HANDLER(ldw)
+    MEM_HANDLER(stw)
+    HANDLER(brx)
+    SUPER_HANDLER(psh)
+    SUPER_HANDLER(pop)
+    SUPER_HANDLER(cal)
+    SUPER_HANDLER(ret)
+    SUPER_HANDLER(adi)
+    SUPER_HANDLER(sbi)
+op_int:
+    emu_op_int(emu_st, in);
+    if (emu_wants_debugger(emu_st)) {
+        goto done;
     }
-    case OP_LDW: {
-        UWORD addr = emu_st->reg[in.a2];
-        emu_st->reg[in.a1] = emu_st->mem[addr + 0] << 0 | emu_st->mem[addr + 1] << 8 | emu_st->mem[addr + 2] << 16 |
-                             emu_st->mem[addr + 3] << 24;
-        break;
+    DISPATCH();
+op_trp:
+    emu_op_trp(emu_st, in);
+    goto done;
+op_hlt:
+    emu_op_hlt(emu_st, in);
+done:
+    emu_st->ticks = ticks;
+
+#undef SUPER_HANDLER
+#undef MEM_HANDLER
+#undef HANDLER
+#undef DISPATCH
+}
+
+#pragma GCC diagnostic pop
+#endif
+
+/* #endregion */
+
+/* #region Breakpoints */
+
+bool emu_map_bit(const BYTE *map, size_t addr) {
+    size_t word = addr / sizeof(UWORD);
+    return map[word >> 3] >> (word & 7) & 1;
+}
+
+void emu_map_set(BYTE *map, size_t addr, bool on) {
+    size_t word = addr / sizeof(UWORD);
+    if (on) {
+        map[word >> 3] |= 1 << (word & 7);
+    } else {
+        map[word >> 3] &= ~(1 << (word & 7));
     }
-    case OP_STW: {
-        UWORD addr = emu_st->reg[in.a1];
-        emu_st->mem[addr + 0] = (emu_st->reg[in.a2] >> 0) & 0xff;
-        emu_st->mem[addr + 1] = (emu_st->reg[in.a2] >> 8) & 0xff;
-        emu_st->mem[addr + 2] = (emu_st->reg[in.a2] >> 16) & 0xff;
-        emu_st->mem[addr + 3] = (emu_st->reg[in.a2] >> 24) & 0xff;
-        break;
+}
+
+/**
+ * Reserve the stop maps on first use, so emulators that never set one pay nothing
+ */
+bool emu_break_maps(EmulatorState *emu_st) {
+    if (emu_st->break_map) {
+        return true;
     }
-    case OP_INT: {
-        UWORD interrupt = emu_st->reg[in.a1];
-        emu_interrupt(emu_st, interrupt);
-        break;
+    size_t map_sz = (emu_st->mem_sz / sizeof(UWORD) + 7) / 8;
+    BYTE *maps[3];
+    for (int i = 0; i < 3; i++) {
+        maps[i] = emu_mem_map(map_sz);
+        if (!maps[i]) {
+            while (i-- > 0) {
+                emu_mem_unmap(maps[i], map_sz);
+            }
+            return false;
+        }
     }
-    case OP_HLT: {
-        emu_st->executing = false;
-        break;
+    emu_st->break_map = maps[0];
+    emu_st->watch_rd_map = maps[1];
+    emu_st->watch_wr_map = maps[2];
+    emu_st->break_map_sz = map_sz;
+    buf_alloc_EmuBreak(&emu_st->breaks, 8);
+    return true;
+}
+
+/**
+ * Bring the maps in line with the kinds set on a word
+ */
+void emu_break_sync(EmulatorState *emu_st, UWORD addr, BYTE kind) {
+    emu_map_set(emu_st->break_map, addr, kind & (EMU_BREAK_PC | EMU_BREAK_ONCE));
+    emu_map_set(emu_st->watch_rd_map, addr, kind & EMU_WATCH_READ);
+    emu_map_set(emu_st->watch_wr_map, addr, kind & EMU_WATCH_WRITE);
+}
+
+/**
+ * Add stops of the given kinds on the word containing addr. Returns false if addr is outside memory.
+ */
+bool emu_break_set(EmulatorState *emu_st, UWORD addr, BYTE kind) {
+    if (addr >= emu_st->mem_sz || !emu_break_maps(emu_st)) {
+        return false;
     }
-    case OP_BRX: {
-        if (emu_st->reg[in.a2] > 0) {
-            emu_st->reg[REG_RPC] = emu_st->reg[in.a1];
+    addr -= addr % sizeof(UWORD);
+    for (size_t i = 0; i < emu_st->breaks.ct; i++) {
+        EmuBreak *bk = &emu_st->breaks.buf[i];
+        if (bk->addr == addr) {
+            bk->kind |= kind;
+            emu_break_sync(emu_st, addr, bk->kind);
+            return true;
         }
-        break;
     }
-    default:
-        break;
+    buf_push_EmuBreak(&emu_st->breaks, (EmuBreak){.addr = addr, .kind = kind});
+    emu_break_sync(emu_st, addr, kind);
+    return true;
+}
+
+/**
+ * Remove stops of the given kinds from the word containing addr
+ */
+void emu_break_clear(EmulatorState *emu_st, UWORD addr, BYTE kind) {
+    addr -= addr % sizeof(UWORD);
+    for (size_t i = 0; i < emu_st->breaks.ct; i++) {
+        EmuBreak *bk = &emu_st->breaks.buf[i];
+        if (bk->addr == addr) {
+            bk->kind &= ~kind;
+            emu_break_sync(emu_st, addr, bk->kind);
+            if (bk->kind == 0) {
+                *bk = emu_st->breaks.buf[--emu_st->breaks.ct];
+            }
+            return;
+        }
+    }
+}
+
+void emu_break_clear_all(EmulatorState *emu_st) {
+    while (emu_st->breaks.ct > 0) {
+        emu_break_clear(emu_st, emu_st->breaks.buf[0].addr, 0xff);
     }
 }
 
+void emu_break_list(EmulatorState *emu_st) {
+    if (emu_st->breaks.ct == 0) {
+        printf("no breakpoints or watchpoints\n");
+    }
+    for (size_t i = 0; i < emu_st->breaks.ct; i++) {
+        EmuBreak *bk = &emu_st->breaks.buf[i];
+        printf("  $%04x%s%s%s%s\n", bk->addr, bk->kind & EMU_BREAK_PC ? " break" : "",
+               bk->kind & EMU_BREAK_ONCE ? " until" : "", bk->kind & EMU_WATCH_READ ? " rwatch" : "",
+               bk->kind & EMU_WATCH_WRITE ? " watch" : "");
+    }
+}
+
+/**
+ * Whether there is a pc breakpoint on the instruction at pc
+ */
+bool emu_break_at(EmulatorState *emu_st, UWORD pc) { return pc < emu_st->mem_sz && emu_map_bit(emu_st->break_map, pc); }
+
+/**
+ * Report a breakpoint on the instruction about to run, which has not run yet. Returns whether there was one.
+ */
+bool emu_break_next(EmulatorState *emu_st) {
+    UWORD next = emu_st->reg[REG_RPC];
+    if (emu_st->breaks.ct == 0 || !emu_break_at(emu_st, next)) {
+        return false;
+    }
+    printf("-- BREAK: $%04x --\n", next);
+    emu_break_clear(emu_st, next, EMU_BREAK_ONCE);
+    return true;
+}
+
+/**
+ * Whether in, about to run, accesses a watched word. Sets addr to the address it accesses.
+ */
+bool emu_watch_hit(EmulatorState *emu_st, const DecodedInstruction *in, UWORD *addr) {
+    if (!emu_access_addr(emu_st, in, addr)) {
+        return false;
+    }
+    const BYTE *map = in->op == EOP_LDW ? emu_st->watch_rd_map : emu_st->watch_wr_map;
+    // an unaligned access reaches into the next word
+    size_t last = (size_t)*addr + sizeof(UWORD) - 1;
+    return (*addr < emu_st->mem_sz && emu_map_bit(map, *addr)) || (last < emu_st->mem_sz && emu_map_bit(map, last));
+}
+
 /* #endregion */
 
+/* #region Debugger */
+
 #define CMD_INTERRUPT(cmd, intr)                                                                                       \
     else if (streq(cmd_buf, #cmd)) {                                                                                   \
         emu_interrupt(emu_st, intr);                                                                                   \
     }
 
+/**
+ * Print the tick, the instruction about to run, and the registers
+ */
+void emu_debug_where(EmulatorState *emu_st) {
+    printf("at tick %lu, next: ", emu_st->ticks);
+    dump_instruction(emu_fetch(emu_st, emu_st->reg[REG_RPC]), true);
+    emu_dump(emu_st, false);
+}
+
+/**
+ * Go back or forward to the state after tick ticks, when the run is being checkpointed
+ */
+void emu_debug_seek(EmulatorState *emu_st, uint64_t tick) {
+    if (!emu_st->replay) {
+        printf("run with --replay to seek\n");
+        return;
+    }
+    if (!emu_st->replay_seek(emu_st, tick)) {
+        printf("the run ends at tick %lu\n", emu_st->ticks);
+    }
+    // the run loops only check the pc an instruction leads to, not one seeked to
+    emu_break_next(emu_st);
+    emu_debug_where(emu_st);
+}
+
+/**
+ * Parse a debugger address, either $hex like the dumps print or a C literal
+ */
+bool emu_debug_addr(const char *arg, UWORD *addr) {
+    char *end;
+    unsigned long val = arg[0] == '$' ? strtoul(arg + 1, &end, 16) : strtoul(arg, &end, 0);
+    if (end == arg || *end != '\0' || val > UINT32_MAX) {
+        printf("invalid address: %s\n", arg);
+        return false;
+    }
+    *addr = val;
+    return true;
+}
+
+void emu_debug_set(EmulatorState *emu_st, const char *arg, BYTE kind) {
+    UWORD addr;
+    if (emu_debug_addr(arg, &addr) && !emu_break_set(emu_st, addr, kind)) {
+        printf("cannot stop at $%04x\n", addr);
+    }
+}
+
+/**
+ * Prompt for debugger commands until the user steps or continues
+ */
+void emu_debug_prompt(EmulatorState *emu_st) {
+    bool paused = true;
+    while (emu_st->onestep && paused) {
+        // execute commands
+        printf("dbg> ");
+        size_t cmd_bufsize = 256;
+        char cmd_buf[cmd_bufsize];
+        cmd_buf[0] = '\0';
+        util_getln(cmd_buf, cmd_bufsize);
+        cmd_buf[strcspn(cmd_buf, "\n")] = '\0'; // remove newline
+        if (streq(cmd_buf, "s") || strlen(cmd_buf) == 0) {
+            paused = false;
+        }
+        CMD_INTERRUPT(cpu, INTERRUPT_DUMPCPU)
+        CMD_INTERRUPT(mem, INTERRUPT_DUMPMEM)
+        CMD_INTERRUPT(stk, INTERRUPT_DUMPSTK)
+        CMD_INTERRUPT(cont, INTERRUPT_CONT)
+        else if (streq(cmd_buf, "rs")) {
+            emu_debug_seek(emu_st, emu_st->ticks > 0 ? emu_st->ticks - 1 : 0);
+        } else if (strncmp(cmd_buf, "goto ", 5) == 0) {
+            emu_debug_seek(emu_st, strtoull(cmd_buf + 5, NULL, 0));
+        } else if (strncmp(cmd_buf, "break ", 6) == 0) {
+            emu_debug_set(emu_st, cmd_buf + 6, EMU_BREAK_PC);
+        } else if (strncmp(cmd_buf, "watch ", 6) == 0) {
+            emu_debug_set(emu_st, cmd_buf + 6, EMU_WATCH_WRITE);
+        } else if (strncmp(cmd_buf, "rwatch ", 7) == 0) {
+            emu_debug_set(emu_st, cmd_buf + 7, EMU_WATCH_READ);
+        } else if (strncmp(cmd_buf, "clear ", 6) == 0) {
+            UWORD addr;
+            if (emu_debug_addr(cmd_buf + 6, &addr)) {
+                emu_break_clear(emu_st, addr, 0xff);
+            }
+        } else if (streq(cmd_buf, "clear")) {
+            emu_break_clear_all(emu_st);
+        } else if (streq(cmd_buf, "list")) {
+            emu_break_list(emu_st);
+        } else if (strncmp(cmd_buf, "until ", 6) == 0) {
+            UWORD addr;
+            if (emu_debug_addr(cmd_buf + 6, &addr) && emu_break_set(emu_st, addr, EMU_BREAK_ONCE)) {
+                // run freely until the stop is hit
+                emu_st->onestep = false;
+                paused = false;
+            }
+        } else {
+            printf("unknown command\n");
+        }
+    }
+}
+
+/**
+ * Report a breakpoint or watchpoint hit by the instruction at pc and prompt. For a breakpoint the instruction at the
+ * new pc has not run yet.
+ */
+void emu_break_stop(EmulatorState *emu_st, const DecodedInstruction *in, UWORD pc, bool watched, UWORD addr) {
+    if (watched) {
+        printf("-- WATCH: $%04x %s $%04x --\n", pc, in->op == EOP_STW ? "wrote" : "read", addr);
+    } else {
+        emu_break_next(emu_st);
+    }
+    emu_debug_where(emu_st);
+    emu_st->onestep = true;
+    emu_debug_prompt(emu_st);
+}
+
+/**
+ * Stop at a breakpoint on the entry point before it runs, since no instruction leads there
+ */
+void emu_break_entry(EmulatorState *emu_st) {
+    if (emu_break_next(emu_st)) {
+        emu_debug_where(emu_st);
+        emu_st->onestep = true;
+        emu_debug_prompt(emu_st);
+    }
+}
+
+/* #endregion */
+
+/* #region Run Loops */
+
+typedef enum {
+    EMU_MODE_PLAIN, // no debugging, fast dispatch
+    EMU_MODE_TRACE, // dump every instruction and the state after it
+    EMU_MODE_STEP,  // prompt after every instruction
+} EmuRunMode;
+
+EmuRunMode emu_run_mode(EmulatorState *emu_st) {
+    if (emu_st->onestep) {
+        return EMU_MODE_STEP;
+    }
+    return emu_st->debug ? EMU_MODE_TRACE : EMU_MODE_PLAIN;
+}
+
+/**
+ * Define a run loop specialized for one debugging mode. TRACE, STEP, and BREAKS are constants, so each variant only
+ * carries the per-tick work of its own mode. With BREAKS, the loop stops at breakpoints on the next instruction and
+ * after accesses to watched words. The loop returns once an interrupt or debugger command switches modes.
+ */
+#define DEFINE_EMU_RUN_VARIANT(NAME, MODE, TRACE, STEP, BREAKS)                                                               \
+    void NAME(EmulatorState *emu_st) {                                                                                 \
+        DecodedInstruction slot;                                                                                       \
+        while (emu_st->executing) {                                                                                    \
+            if (emu_st->ticks >= emu_st->tick_limit) {                                                                 \
+                emu_out_of_ticks(emu_st);                                                                              \
+                return;                                                                                                \
+            }                                                                                                          \
+            UWORD pc = emu_st->reg[REG_RPC];                                                                           \
+            const DecodedInstruction *in = emu_fetch_decoded(emu_st, pc, &slot);                                       \
+            UWORD watch_addr = 0;                                                                                      \
+            bool watched = BREAKS && emu_watch_hit(emu_st, in, &watch_addr);                                           \
+            emu_st->reg[REG_RPC] += INSTR_SIZE;                                                                        \
+            if (TRACE) {                                                                                               \
+                Instruction raw = {.opcode = in->opcode, .a1 = in->a1, .a2 = in->a2, .a3 = in->a3};                    \
+                dump_instruction(raw, true);                                                                           \
+            }                                                                                                          \
+            bool raised = in->op == EOP_INT;                                                                           \
+            emu_exec(emu_st, in);                                                                                      \
+            if (TRACE) {                                                                                               \
+                emu_dump(emu_st, false);                                                                               \
+            }                                                                                                          \
+            emu_st->ticks++;                                                                                           \
+            if (BREAKS && (watched || emu_break_at(emu_st, emu_st->reg[REG_RPC]))) {                                   \
+                emu_break_stop(emu_st, in, pc, watched, watch_addr);                                                   \
+                raised = true;                                                                                         \
+            }                                                                                                          \
+            if (STEP) {                                                                                                \
+                emu_debug_prompt(emu_st);                                                                              \
+                raised = true;                                                                                         \
+            }                                                                                                          \
+            if (raised && emu_run_mode(emu_st) != MODE) {                                                              \
+                return;                                                                                                \
+            }                                                                                                          \
+        }                                                                                                              \
+    }
+
+DEFINE_EMU_RUN_VARIANT(emu_run_trace, EMU_MODE_TRACE, true, false, emu_st->breaks.ct > 0)
+// single stepping still honors debug tracing, but it waits on the user anyway
+DEFINE_EMU_RUN_VARIANT(emu_run_step, EMU_MODE_STEP, emu_st->debug, true, false)
+// plain runs take this loop only while stops are set, so the fast loops never check for them
+DEFINE_EMU_RUN_VARIANT(emu_run_break, EMU_MODE_PLAIN, false, false, true)
+
+/**
+ * Run without debugging using the selected engine, until halted or until debugging is requested
+ */
+void emu_run_plain(EmulatorState *emu_st) {
+    if (emu_st->breaks.ct > 0) {
+        emu_run_break(emu_st);
+        return;
+    }
+    // translated blocks are not instrumented
+    if (emu_st->coverage) {
+        emu_run_cover(emu_st);
+        return;
+    }
+    if (emu_st->trace) {
+        emu_st->trace_run(emu_st);
+        return;
+    }
+    if (emu_st->prof) {
+        emu_st->prof_run(emu_st);
+        return;
+    }
+    if (emu_st->jit) {
+        emu_st->jit_run(emu_st);
+        return;
+    }
+#if EMU_THREADED
+    if (emu_st->dispatch == EMU_DISPATCH_THREADED) {
+        emu_run_threaded(emu_st);
+        return;
+    }
+#endif
+    emu_run_switch(emu_st);
+}
+
+/**
+ * Run in the mode the debug flags select until halted. Each variant runs until halted or until the mode changes.
+ */
+void emu_run_modes(EmulatorState *emu_st) {
+    while (emu_st->executing) {
+        switch (emu_run_mode(emu_st)) {
+        case EMU_MODE_PLAIN:
+            emu_run_plain(emu_st);
+            break;
+        case EMU_MODE_TRACE:
+            emu_run_trace(emu_st);
+            break;
+        case EMU_MODE_STEP:
+            emu_run_step(emu_st);
+            break;
+        }
+    }
+}
+
 /**
  * Start emulator execution at an entry point in memory
  */
-void emu_run(EmulatorState *emu_st, ARG entry) {
+void emu_run(EmulatorState *emu_st, UWORD entry) {
     // set PC regiemu_ster to entrypoint
-    printf("jumping to $%04x\n", entry);
+    if (!emu_st->quiet) {
+        printf("jumping to $%04x\n", entry);
+    }
     emu_st->reg[REG_RPC] = entry;
     emu_st->executing = true;
-    // emu_start decode loop
-    while (emu_st->executing) {
-        // decode instruction
-        ARG op = emu_st->mem[emu_st->reg[0]];
-        ARG d1 = emu_st->mem[emu_st->reg[0] + 1];
-        ARG d2 = emu_st->mem[emu_st->reg[0] + 2];
-        ARG d3 = emu_st->mem[emu_st->reg[0] + 3];
-        emu_st->reg[0] += INSTR_SIZE; // advance PC
-        Instruction in = {.opcode = op, .a1 = d1, .a2 = d2, .a3 = d3};
-        // InstructionInfo info = get_instruction_info_op(in.opcode);
-
-        if (emu_st->debug) {
-            dump_instruction(in, true); // dump instruction
-        }
-        emu_exec(emu_st, in); // execute instruction
-        if (emu_st->debug) {
-            emu_dump(emu_st, false); // dump abbrev. state
+    // a fault leaves the run loops without undoing what they changed
+    uint64_t tick_limit = emu_st->tick_limit;
+    bool quiet = emu_st->quiet;
+    emu_guarded = emu_st;
+    if (EMU_FAULT_SETJMP() == 0) {
+        if (emu_st->replay) {
+            emu_st->replay_run(emu_st);
+        } else {
+            emu_break_entry(emu_st);
+            emu_run_modes(emu_st);
         }
-
-        emu_st->ticks++;
-        bool paused = true;
-        while (emu_st->onestep && paused) {
-            // execute commands
-            printf("dbg> ");
-            size_t cmd_bufsize = 256;
-            char cmd_buf[cmd_bufsize];
-            util_getln(cmd_buf, cmd_bufsize);
-            cmd_buf[strlen(cmd_buf) - 1] = '\0'; // remove newline
-            if (streq(cmd_buf, "s") || strlen(cmd_buf) == 0) {
-                paused = false;
-            }
-            CMD_INTERRUPT(cpu, INTERRUPT_DUMPCPU)
-            CMD_INTERRUPT(mem, INTERRUPT_DUMPMEM)
-            CMD_INTERRUPT(stk, INTERRUPT_DUMPSTK)
-            CMD_INTERRUPT(cont, INTERRUPT_CONT)
-            else {
-                printf("unknown command\n");
+    } else {
+        emu_guarded = NULL;
+        emu_st->tick_limit = tick_limit;
+        emu_st->quiet = quiet;
+        // pc has moved past the instruction, unless fetching it was what faulted
+        UWORD pc = emu_st->reg[REG_RPC];
+        UWORD addr = emu_st->fault_addr;
+        if (addr - pc >= INSTR_SIZE) {
+            pc -= INSTR_SIZE;
+            DecodedInstruction in = emu_decode(emu_fetch(emu_st, pc));
+            // only loads and stores fault, so anything else started an expansion that ran as one unit. its steps up
+            // to the load or store have run, leaving the state that instruction saw; report it as the one that faulted
+            size_t last = emu_st->mem_sz - INSTR_SIZE;
+            for (int i = 1; i < 6 && in.op != EOP_LDW && in.op != EOP_STW && (size_t)pc + INSTR_SIZE <= last; i++) {
+                pc += INSTR_SIZE;
+                emu_st->ticks++;
+                in = emu_decode(emu_fetch(emu_st, pc));
             }
+            emu_st->reg[REG_RPC] = pc + INSTR_SIZE;
+            // report the word accessed rather than the byte that faulted
+            emu_access_addr(emu_st, &in, &addr);
         }
+        emu_fault(emu_st, pc, addr);
+    }
+    emu_guarded = NULL;
+    if (!emu_st->quiet) {
+        printf("stopped executing after %ld ticks.\n", emu_st->ticks);
     }
-    printf("stopped executing after %ld ticks.\n", emu_st->ticks);
 }
+
+/* #endregion */
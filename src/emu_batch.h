@@ -0,0 +1,286 @@
+/*
+emu_batch.h
+runs many independent programs across a pool of worker threads
+*/
+
+#pragma once
+
+#include "buffie.h"
+#include "emu.h"
+#include "emu_jit.h"
+#include "util.h"
+
+#if defined(__unix__)
+#define EMU_BATCH_THREADS 1
+#include <pthread.h>
+#include <unistd.h>
+#else
+#define EMU_BATCH_THREADS 0
+#endif
+
+#define BATCH_RESULTS_MAGIC "rgb"
+#define BATCH_RESULTS_VERSION 1
+#define BATCH_REGISTER_COUNT 32 // REGISTER_COUNT, which is not a constant expression
+#define BATCH_RECORD_SIZE (1 + sizeof(uint64_t) + BATCH_REGISTER_COUNT * sizeof(UWORD))
+
+typedef struct {
+    char *path;
+    EmuExit exit;
+    uint64_t ticks;
+    UWORD reg[BATCH_REGISTER_COUNT];
+} BatchJob;
+
+BUFFIE_OF(BatchJob)
+
+/**
+ * A worker's share of the job indices. The owner takes from the front, thieves take from the back.
+ */
+typedef struct {
+#if EMU_BATCH_THREADS
+    pthread_mutex_t lock;
+#endif
+    size_t lo;
+    size_t hi;
+} BatchQueue;
+
+typedef struct {
+    Buffie_BatchJob jobs;
+    BatchQueue *queues;
+    int worker_ct;
+    // settings for every emulator
+    size_t mem_sz;
+    uint64_t tick_limit;
+    EmuDispatch dispatch;
+    bool jit;
+} BatchRunner;
+
+typedef struct {
+    BatchRunner *runner;
+    int id;
+} BatchWorker;
+
+/* #region Manifest */
+
+/**
+ * Read one program path per line. Blank lines and lines starting with # are skipped.
+ * Returns false if the manifest cannot be opened.
+ */
+bool batch_read_manifest(BatchRunner *br, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    FileReadResult manifest = util_read_file_contents(fp);
+    fclose(fp);
+
+    buf_alloc_BatchJob(&br->jobs, 16);
+    char *line = manifest.content;
+    while (*line) {
+        size_t len = strcspn(line, "\r\n");
+        char *next = line + len + strspn(line + len, "\r\n");
+        line[len] = '\0';
+        if (len > 0 && line[0] != '#') {
+            BatchJob job = {.path = util_strdup(line), .exit = EMU_EXIT_NONE, .ticks = 0};
+            buf_push_BatchJob(&br->jobs, job);
+        }
+        line = next;
+    }
+    free(manifest.content);
+    return true;
+}
+
+/* #endregion */
+
+/* #region Workers */
+
+int batch_default_workers() {
+#if EMU_BATCH_THREADS
+    long ct = sysconf(_SC_NPROCESSORS_ONLN);
+    return ct > 0 ? (int)ct : 1;
+#else
+    return 1;
+#endif
+}
+
+bool batch_queue_take(BatchQueue *q, bool front, size_t *job) {
+    bool taken = false;
+#if EMU_BATCH_THREADS
+    pthread_mutex_lock(&q->lock);
+#endif
+    if (q->lo < q->hi) {
+        *job = front ? q->lo++ : --q->hi;
+        taken = true;
+    }
+#if EMU_BATCH_THREADS
+    pthread_mutex_unlock(&q->lock);
+#endif
+    return taken;
+}
+
+/**
+ * Take the next job for worker self, stealing from the other workers once its own queue is empty.
+ * No jobs are added after startup, so false means the whole batch is handed out.
+ */
+bool batch_take(BatchRunner *br, int self, size_t *job) {
+    if (batch_queue_take(&br->queues[self], true, job)) {
+        return true;
+    }
+    for (int i = 1; i < br->worker_ct; i++) {
+        if (batch_queue_take(&br->queues[(self + i) % br->worker_ct], false, job)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Run jobs on one emulator until the batch is done. The emulator is reset between programs, so its memory
+ * reservation, predecode buffer, and JIT cache are reused.
+ */
+void *batch_worker(void *arg) {
+    BatchWorker *w = arg;
+    BatchRunner *br = w->runner;
+    EmulatorState *emu_st = emu_init(br->mem_sz);
+    if (emu_st == NULL) {
+        return NULL; // the other workers steal this worker's jobs
+    }
+    emu_st->quiet = true;
+    emu_st->tick_limit = br->tick_limit;
+    emu_st->dispatch = br->dispatch;
+    if (br->jit) {
+        jit_attach(emu_st, false);
+    }
+
+    bool fresh = true;
+    size_t job_i;
+    while (batch_take(br, w->id, &job_i)) {
+        BatchJob *job = &br->jobs.buf[job_i];
+        if (!fresh) {
+            emu_reset(emu_st);
+        }
+        fresh = false;
+        RGHeader hd;
+        if (!emu_load_file(emu_st, job->path, &hd)) {
+            job->exit = EMU_EXIT_LOAD;
+            continue;
+        }
+
+        emu_run(emu_st, hd.data_size);
+        job->exit = emu_st->exit;
+        job->ticks = emu_st->ticks;
+        memcpy(job->reg, emu_st->reg, sizeof(job->reg));
+    }
+
+    jit_detach(emu_st);
+    emu_free(emu_st);
+    return NULL;
+}
+
+/**
+ * Run every job in the manifest on worker_ct workers
+ */
+void batch_run(BatchRunner *br) {
+    if (br->worker_ct < 1) {
+        br->worker_ct = 1;
+    }
+    size_t job_ct = br->jobs.ct;
+    br->queues = malloc(br->worker_ct * sizeof(BatchQueue));
+    BatchWorker *workers = malloc(br->worker_ct * sizeof(BatchWorker));
+    for (int i = 0; i < br->worker_ct; i++) {
+        // contiguous shares, so each worker mostly runs neighbouring manifest entries
+        br->queues[i].lo = job_ct * i / br->worker_ct;
+        br->queues[i].hi = job_ct * (i + 1) / br->worker_ct;
+        workers[i].runner = br;
+        workers[i].id = i;
+    }
+
+#if EMU_BATCH_THREADS
+    pthread_t *threads = malloc(br->worker_ct * sizeof(pthread_t));
+    for (int i = 0; i < br->worker_ct; i++) {
+        pthread_mutex_init(&br->queues[i].lock, NULL);
+    }
+    bool *started = calloc(br->worker_ct, sizeof(bool));
+    for (int i = 1; i < br->worker_ct; i++) {
+        started[i] = pthread_create(&threads[i], NULL, batch_worker, &workers[i]) == 0;
+    }
+    batch_worker(&workers[0]); // the calling thread is worker 0
+    for (int i = 1; i < br->worker_ct; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            batch_worker(&workers[i]); // no thread for it, run what is left of its share here
+        }
+    }
+    free(started);
+    for (int i = 0; i < br->worker_ct; i++) {
+        pthread_mutex_destroy(&br->queues[i].lock);
+    }
+    free(threads);
+#else
+    for (int i = 0; i < br->worker_ct; i++) {
+        batch_worker(&workers[i]);
+    }
+#endif
+
+    free(workers);
+    free(br->queues);
+    br->queues = NULL;
+}
+
+/* #endregion */
+
+/* #region Results */
+
+void batch_put_le(BYTE *out, uint64_t val, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        out[i] = (val >> (i * 8)) & 0xff;
+    }
+}
+
+/**
+ * Fill one BATCH_RECORD_SIZE result record: u8 exit reason, u64 ticks, and every register as a u32
+ */
+void batch_put_record(BYTE *rec, EmuExit exit, uint64_t ticks, const UWORD *reg) {
+    rec[0] = exit;
+    batch_put_le(rec + 1, ticks, sizeof(uint64_t));
+    for (size_t r = 0; r < BATCH_REGISTER_COUNT; r++) {
+        batch_put_le(rec + 1 + sizeof(uint64_t) + r * sizeof(UWORD), reg[r], sizeof(UWORD));
+    }
+}
+
+/**
+ * Write the results file: "rgb", a version byte, and a u32 record count, followed by one record per manifest entry
+ * in manifest order. All values are little endian.
+ */
+bool batch_write_results(BatchRunner *br, const char *path) {
+    size_t header_sz = 4 + sizeof(uint32_t);
+    size_t out_sz = header_sz + br->jobs.ct * BATCH_RECORD_SIZE;
+    BYTE *out = malloc(out_sz);
+    memcpy(out, BATCH_RESULTS_MAGIC, 3);
+    out[3] = BATCH_RESULTS_VERSION;
+    batch_put_le(out + 4, br->jobs.ct, sizeof(uint32_t));
+
+    BYTE *rec = out + header_sz;
+    for (size_t i = 0; i < br->jobs.ct; i++) {
+        BatchJob *job = &br->jobs.buf[i];
+        batch_put_record(rec, job->exit, job->ticks, job->reg);
+        rec += BATCH_RECORD_SIZE;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    bool ok = fp != NULL && fwrite(out, out_sz, 1, fp) == 1;
+    if (fp != NULL) {
+        ok = fclose(fp) == 0 && ok;
+    }
+    free(out);
+    return ok;
+}
+
+void batch_free(BatchRunner *br) {
+    for (size_t i = 0; i < br->jobs.ct; i++) {
+        free(br->jobs.buf[i].path);
+    }
+    buf_free_BatchJob(&br->jobs);
+}
+
+/* #endregion */
@@ -0,0 +1,160 @@
+/*
+emu_fuzz.h
+persistent mode: runs one loaded program over and over on inputs sent through a pipe
+*/
+
+#pragma once
+
+#include "emu.h"
+#include "emu_batch.h"
+
+#if defined(__unix__)
+#define EMU_FUZZ 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define EMU_FUZZ 0
+#endif
+
+#define FUZZ_HELLO_MAGIC "rgf"
+#define FUZZ_VERSION 1
+
+typedef struct {
+    UWORD input_addr;     // guest range the input is patched into
+    UWORD input_sz;       // longer inputs are cut, shorter ones zero filled
+    int in_fd;            // requests: u32 length, then the input
+    int out_fd;           // replies: a result record, then the coverage map unless it is shared
+    const char *map_path; // file to share the coverage map through, NULL to send it with every reply
+} FuzzConfig;
+
+#if EMU_FUZZ
+
+bool fuzz_read_full(int fd, void *buf, size_t size) {
+    BYTE *pos = buf;
+    while (size > 0) {
+        ssize_t got = read(fd, pos, size);
+        if (got <= 0) {
+            return false;
+        }
+        pos += got;
+        size -= got;
+    }
+    return true;
+}
+
+bool fuzz_write_full(int fd, const void *buf, size_t size) {
+    const BYTE *pos = buf;
+    while (size > 0) {
+        ssize_t put = write(fd, pos, size);
+        if (put <= 0) {
+            return false;
+        }
+        pos += put;
+        size -= put;
+    }
+    return true;
+}
+
+/**
+ * Map the coverage map from a file so the client can read it without copying
+ */
+BYTE *fuzz_map_coverage(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, EMU_COVERAGE_SIZE) == 0) {
+        map = mmap(NULL, EMU_COVERAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+#endif
+
+/**
+ * Serve inputs until the request pipe is closed. The program must already be loaded; its state at this point is
+ * snapshotted and restored before every input, so each run only pays for the pages the previous one wrote.
+ * Returns nonzero if the coverage map cannot be set up or the client goes away mid message.
+ */
+int fuzz_serve(EmulatorState *emu_st, UWORD entry, FuzzConfig *cfg) {
+#if EMU_FUZZ
+    bool shared = cfg->map_path != NULL;
+    emu_st->coverage = shared ? fuzz_map_coverage(cfg->map_path) : calloc(EMU_COVERAGE_SIZE, sizeof(BYTE));
+    if (emu_st->coverage == NULL) {
+        fprintf(stderr, "cannot set up coverage map\n");
+        return 1;
+    }
+
+    BYTE hello[4 + sizeof(uint32_t) + 1];
+    memcpy(hello, FUZZ_HELLO_MAGIC, 3);
+    hello[3] = FUZZ_VERSION;
+    batch_put_le(hello + 4, EMU_COVERAGE_SIZE, sizeof(uint32_t));
+    hello[4 + sizeof(uint32_t)] = shared;
+    int status = fuzz_write_full(cfg->out_fd, hello, sizeof(hello)) ? 0 : 1;
+
+    EmuSnapshot *snap = emu_snapshot(emu_st);
+    BYTE *input = malloc(cfg->input_sz ? cfg->input_sz : 1);
+    size_t reply_sz = BATCH_RECORD_SIZE + (shared ? 0 : EMU_COVERAGE_SIZE);
+    BYTE *reply = malloc(reply_sz);
+    uint64_t execs = 0;
+
+    BYTE len_buf[sizeof(uint32_t)];
+    while (status == 0 && fuzz_read_full(cfg->in_fd, len_buf, sizeof(len_buf))) {
+        size_t len = len_buf[0] | len_buf[1] << 8 | len_buf[2] << 16 | (size_t)len_buf[3] << 24;
+        size_t keep = len < cfg->input_sz ? len : cfg->input_sz;
+        memset(input + keep, 0, cfg->input_sz - keep);
+        if (!fuzz_read_full(cfg->in_fd, input, keep)) {
+            status = 1;
+            break;
+        }
+        // drop whatever does not fit the input range
+        for (size_t left = len - keep; left > 0;) {
+            BYTE sink[256];
+            size_t chunk = left < sizeof(sink) ? left : sizeof(sink);
+            if (!fuzz_read_full(cfg->in_fd, sink, chunk)) {
+                status = 1;
+                break;
+            }
+            left -= chunk;
+        }
+        if (status != 0) {
+            break;
+        }
+
+        emu_restore(emu_st, snap);
+        memset(emu_st->coverage, 0, EMU_COVERAGE_SIZE);
+        emu_write_bytes(emu_st, cfg->input_addr, input, cfg->input_sz);
+        emu_run(emu_st, entry);
+        execs++;
+
+        batch_put_record(reply, emu_st->exit, emu_st->ticks, emu_st->reg);
+        if (!shared) {
+            memcpy(reply + BATCH_RECORD_SIZE, emu_st->coverage, EMU_COVERAGE_SIZE);
+        }
+        if (!fuzz_write_full(cfg->out_fd, reply, reply_sz)) {
+            status = 1;
+        }
+    }
+    fprintf(stderr, "fuzz: %lu inputs\n", execs);
+
+    emu_snapshot_free(snap);
+    free(input);
+    free(reply);
+    if (shared) {
+        munmap(emu_st->coverage, EMU_COVERAGE_SIZE);
+    } else {
+        free(emu_st->coverage);
+    }
+    emu_st->coverage = NULL;
+    return status;
+#else
+    (void)emu_st;
+    (void)entry;
+    (void)cfg;
+    fprintf(stderr, "persistent mode is not available on this host\n");
+    return 1;
+#endif
+}
@@ -0,0 +1,772 @@
+/*
+emu_jit.h
+provides a basic-block JIT to x86-64 for the emulator
+*/
+
+#pragma once
+#include "emu.h"
+#include <stddef.h>
+
+#if defined(__x86_64__) && defined(__unix__)
+#define EMU_JIT 1
+#include <sys/mman.h>
+#else
+#define EMU_JIT 0
+#endif
+
+#define JIT_CACHE_SIZE (4 * 1024 * 1024) // executable code cache
+#define JIT_MAX_BLOCK 64                 // instructions per block
+#define JIT_MAX_INSTR_BYTES 128          // worst case host bytes per guest instruction
+#define JIT_MAX_SIDE_EXITS 4             // side exits per guest instruction
+#define JIT_NO_BLOCK ((BYTE *)1)         // marks pcs that start with an untranslatable instruction
+
+// block exit values, anything larger is the address of a patchable jump
+#define JIT_EXIT_DYNAMIC 0 // pc was computed at run time
+#define JIT_EXIT_INTERP 1  // the interpreter has to execute the instruction at pc
+
+typedef uintptr_t (*JitEnter)(EmulatorState *emu_st, BYTE *block);
+
+typedef struct JitState {
+    BYTE *buf;        // code cache, writable or executable but never both
+    bool writable;    // buf is currently mapped for emitting rather than running
+    size_t used;      // bytes of buf in use
+    JitEnter enter;   // trampoline into a block
+    BYTE *exit;       // epilogue shared by all blocks
+    BYTE **blocks;    // host entry per predecoded instruction, NULL until translated
+    size_t block_ct;  // entries in blocks
+    uint64_t code_gen; // code generation the cache was built from
+    bool chain;       // patch static exits to jump directly to their target block
+    bool check;       // compare every block against the interpreter
+    EmulatorState *shadow; // interpreter state for check mode
+    uint64_t translated;   // blocks translated
+    uint64_t mismatches;   // check mode failures
+} JitState;
+
+/* #region Code Emission */
+
+typedef struct {
+    BYTE *buf;
+    size_t pos;
+} JitEmitter;
+
+void jit_emit8(JitEmitter *em, BYTE v) { em->buf[em->pos++] = v; }
+
+void jit_emit32(JitEmitter *em, uint32_t v) {
+    memcpy(em->buf + em->pos, &v, sizeof(v));
+    em->pos += sizeof(v);
+}
+
+void jit_emit64(JitEmitter *em, uint64_t v) {
+    memcpy(em->buf + em->pos, &v, sizeof(v));
+    em->pos += sizeof(v);
+}
+
+void jit_emit_bytes(JitEmitter *em, const BYTE *bytes, size_t ct) {
+    memcpy(em->buf + em->pos, bytes, ct);
+    em->pos += ct;
+}
+
+// guest registers live at [rbx + 4 * reg], guest memory at [r12 + addr], the EmulatorState at r13
+#define JIT_EAX 0
+#define JIT_ECX 1
+#define JIT_EDX 2
+
+#define JIT_OP_ADD 0x03
+#define JIT_OP_OR 0x0b
+#define JIT_OP_AND 0x23
+#define JIT_OP_SUB 0x2b
+#define JIT_OP_XOR 0x33
+#define JIT_OP_CMP 0x3b
+#define JIT_OP_LOAD 0x8b
+#define JIT_OP_STORE 0x89
+
+/**
+ * Emit `op host_reg, [rbx + 4 * guest_reg]` (or the reverse for stores)
+ */
+void jit_emit_reg_op(JitEmitter *em, BYTE op, int host_reg, ARG guest_reg) {
+    jit_emit8(em, op);
+    jit_emit8(em, 0x43 | (host_reg << 3)); // [rbx + disp8]
+    jit_emit8(em, guest_reg * sizeof(UWORD));
+}
+
+/**
+ * Emit `mov dword [rbx + 4 * guest_reg], imm`
+ */
+void jit_emit_set_reg(JitEmitter *em, ARG guest_reg, UWORD imm) {
+    jit_emit8(em, 0xc7);
+    jit_emit8(em, 0x43);
+    jit_emit8(em, guest_reg * sizeof(UWORD));
+    jit_emit32(em, imm);
+}
+
+/**
+ * Emit a rel32 jump or conditional jump and return the offset of its displacement
+ */
+size_t jit_emit_jump(JitEmitter *em, BYTE cc) {
+    if (cc) {
+        jit_emit8(em, 0x0f);
+        jit_emit8(em, cc);
+    } else {
+        jit_emit8(em, 0xe9);
+    }
+    size_t disp = em->pos;
+    jit_emit32(em, 0);
+    return disp;
+}
+
+/**
+ * Map the code cache for emitting or for running. Returns false if the host refuses the change.
+ */
+bool jit_set_writable(JitState *jit, bool writable) {
+    if (jit->writable == writable) {
+        return true;
+    }
+#if EMU_JIT
+    if (mprotect(jit->buf, JIT_CACHE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0) {
+        return false;
+    }
+#endif
+    jit->writable = writable;
+    return true;
+}
+
+void jit_patch_jump(BYTE *disp, BYTE *target) {
+    int32_t rel = (int32_t)(target - (disp + sizeof(int32_t)));
+    memcpy(disp, &rel, sizeof(rel));
+}
+
+#define JIT_CC_JB 0x82
+#define JIT_CC_JZ 0x84
+#define JIT_CC_JA 0x87
+
+/**
+ * Emit `add/sub qword [r13 + ticks], imm`
+ */
+void jit_emit_ticks(JitEmitter *em, bool add, uint32_t ct) {
+    jit_emit8(em, 0x49);
+    jit_emit8(em, 0x81);
+    jit_emit8(em, add ? 0x85 : 0xad);
+    jit_emit32(em, offsetof(EmulatorState, ticks));
+    jit_emit32(em, ct);
+}
+
+/**
+ * Leave the block with a return value in eax
+ */
+void jit_emit_exit(JitEmitter *em, JitState *jit, uint32_t ret) {
+    jit_emit8(em, 0xb8); // mov eax, ret
+    jit_emit32(em, ret);
+    size_t disp = jit_emit_jump(em, 0);
+    jit_patch_jump(em->buf + disp, jit->exit);
+}
+
+/**
+ * Leave the block for a known pc. The final jump can later be patched to enter the target block directly.
+ */
+void jit_emit_static_exit(JitEmitter *em, JitState *jit, UWORD target) {
+    jit_emit_set_reg(em, REG_RPC, target);
+    // mov rax, <address of the jump displacement below>
+    jit_emit8(em, 0x48);
+    jit_emit8(em, 0xb8);
+    uint64_t site = (uint64_t)(uintptr_t)(em->buf + em->pos + sizeof(uint64_t) + 1);
+    jit_emit64(em, site);
+    size_t disp = jit_emit_jump(em, 0);
+    jit_patch_jump(em->buf + disp, jit->exit);
+}
+
+/**
+ * Build the trampoline and shared epilogue at the start of the code cache
+ */
+void jit_emit_trampoline(JitState *jit) {
+    JitEmitter em = {.buf = jit->buf, .pos = 0};
+    // enter(emu_st = rdi, block = rsi)
+    static const BYTE prologue[] = {
+        0x53,       // push rbx
+        0x41, 0x54, // push r12
+        0x41, 0x55, // push r13
+        0x49, 0x89, 0xfd, // mov r13, rdi
+    };
+    jit_emit_bytes(&em, prologue, sizeof(prologue));
+    jit_emit8(&em, 0x48); // mov rbx, [rdi + reg]
+    jit_emit8(&em, 0x8b);
+    jit_emit8(&em, 0x9f);
+    jit_emit32(&em, offsetof(EmulatorState, reg));
+    jit_emit8(&em, 0x4c); // mov r12, [rdi + mem]
+    jit_emit8(&em, 0x8b);
+    jit_emit8(&em, 0xa7);
+    jit_emit32(&em, offsetof(EmulatorState, mem));
+    jit_emit8(&em, 0xff); // jmp rsi
+    jit_emit8(&em, 0xe6);
+
+    jit->exit = em.buf + em.pos;
+    static const BYTE epilogue[] = {
+        0x41, 0x5d, // pop r13
+        0x41, 0x5c, // pop r12
+        0x5b,       // pop rbx
+        0xc3,       // ret
+    };
+    jit_emit_bytes(&em, epilogue, sizeof(epilogue));
+
+    jit->enter = (JitEnter)(uintptr_t)jit->buf;
+    jit->used = em.pos;
+}
+
+/* #endregion */
+
+/* #region Translation */
+
+/**
+ * Whether the JIT knows how to translate an instruction
+ */
+bool jit_can_translate(const DecodedInstruction *in) {
+    switch (in->op) {
+    case EOP_INT:
+    case EOP_HLT:
+    case EOP_TRP:
+        return false;
+    default:
+        // decoding verified the register operands, so they index the register file as they are
+        return true;
+    }
+}
+
+/**
+ * Whether an instruction writes its first operand register
+ */
+bool jit_writes_a1(const DecodedInstruction *in) {
+    switch (in->op) {
+    case EOP_NOP:
+    case EOP_STW:
+    case EOP_INT:
+    case EOP_HLT:
+    case EOP_BRX:
+    case EOP_TRP:
+        return false;
+    default:
+        return true;
+    }
+}
+
+/**
+ * Whether an instruction reads the pc register
+ */
+bool jit_reads_pc(const DecodedInstruction *in) {
+    switch (in->op) {
+    case EOP_NOP:
+    case EOP_SET:
+        return false;
+    case EOP_NOT:
+    case EOP_MOV:
+    case EOP_LDW:
+        return in->a2 == REG_RPC;
+    case EOP_STW:
+    case EOP_BRX:
+        return in->a1 == REG_RPC || in->a2 == REG_RPC;
+    default:
+        return in->a2 == REG_RPC || in->a3 == REG_RPC;
+    }
+}
+
+/**
+ * Emit a side exit that hands the instruction at pc to the interpreter
+ */
+void jit_emit_side_exit(JitEmitter *em, JitState *jit, UWORD pc, uint32_t skipped) {
+    jit_emit_ticks(em, false, skipped); // the block prologue counted instructions that never ran
+    jit_emit_set_reg(em, REG_RPC, pc);
+    jit_emit_exit(em, jit, JIT_EXIT_INTERP);
+}
+
+typedef struct {
+    size_t disp;   // offset of the jump displacement to patch
+    UWORD pc;      // guest pc of the instruction taking the side exit
+    uint32_t left; // instructions of the block that did not run
+} JitSideExit;
+
+/**
+ * Emit the host code for one guest instruction at pc
+ */
+void jit_emit_instruction(JitEmitter *em, EmulatorState *emu_st, const DecodedInstruction *in, UWORD pc,
+                          uint32_t left, JitSideExit *side, size_t *side_ct) {
+    if (jit_reads_pc(in)) {
+        // the interpreter advances pc before executing
+        jit_emit_set_reg(em, REG_RPC, pc + INSTR_SIZE);
+    }
+    switch (in->op) {
+    case EOP_NOP:
+        break;
+    case EOP_ADD:
+    case EOP_SUB:
+    case EOP_AND:
+    case EOP_ORR:
+    case EOP_XOR: {
+        static const BYTE ops[] = {[EOP_ADD] = JIT_OP_ADD,
+                                   [EOP_SUB] = JIT_OP_SUB,
+                                   [EOP_AND] = JIT_OP_AND,
+                                   [EOP_ORR] = JIT_OP_OR,
+                                   [EOP_XOR] = JIT_OP_XOR};
+        jit_emit_reg_op(em, JIT_OP_LOAD, JIT_EAX, in->a2);
+        jit_emit_reg_op(em, ops[in->op], JIT_EAX, in->a3);
+        jit_emit_reg_op(em, JIT_OP_STORE, JIT_EAX, in->a1);
+        break;
+    }
+    case EOP_NOT: {
+        jit_emit_reg_op(em, JIT_OP_LOAD, JIT_EAX, in->a2);
+        jit_emit8(em, 0xf7); // not eax
+        jit_emit8(em, 0xd0);
+        jit_emit_reg_op(em, JIT_OP_STORE, JIT_EAX, in->a1);
+        break;
+    }
+    case EOP_LSH:
+    case EOP_ASH: {
+        jit_emit_reg_op(em, JIT_OP_LOAD, JIT_ECX, in->a3);
+        jit_emit_reg_op(em, JIT_OP_LOAD, JIT_EAX, in->a2);
+        static const BYTE negative[] = {
+            0x85, 0xc9, // test ecx, ecx
+            0x79, 0x06, // jns +6
+            0xf7, 0xd9, // neg ecx
+            0xd3, 0x00, // shr/sar eax, cl (patched below)
+            0xeb, 0x02, // jmp +2
+            0xd3, 0xe0, // shl eax, cl
+        };
+        size_t at = em->pos;
+        jit_emit_bytes(em, negative, sizeof(negative));
+        em->buf[at + 7] = in->op == EOP_LSH ? 0xe8 : 0xf8;
+        jit_emit_reg_op(em, JIT_OP_STORE, JIT_EAX, in->a1);
+        break;
+    }
+    case EOP_TCU:
+    case EOP_TCS: {
+        jit_emit_reg_op(em, JIT_OP_LOAD, JIT_EAX, in->a2);
+        static const BYTE clear[] = {
+            0x31, 0xc9, // xor ecx, ecx
+            0x31, 0xd2, // xor edx, edx
+        };
+        jit_emit_bytes(em, clear, sizeof(clear));
+        jit_emit_reg_op(em, JIT_OP_CMP, JIT_EAX, in->a3);
+        BYTE greater = in->op == EOP_TCU ? 0x97 : 0x9f; // seta / setg
+        BYTE less = in->op == EOP_TCU ? 0x92 : 0x9c;    // setb / setl
+        const BYTE sign[] = {
+            0x0f, greater, 0xc1, // set(a|g) cl
+            0x0f, less, 0xc2,    // set(b|l) dl
+            0x29, 0xd1,          // sub ecx, edx
+        };
+        jit_emit_bytes(em, sign, sizeof(sign));
+        jit_emit_reg_op(em, JIT_OP_STORE, JIT_ECX, in->a1);
+        break;
+    }
+    case EOP_SET:
+        jit_emit_set_reg(em, in->a1, in->imm);
+        break;
+    case EOP_MOV:
+        jit_emit_reg_op(em, JIT_OP_LOAD, JIT_EAX, in->a2);
+        jit_emit_reg_op(em, JIT_OP_STORE, JIT_EAX, in->a1);
+        break;
+    case EOP_LDW: {
+        jit_emit_reg_op(em, JIT_OP_LOAD, JIT_EAX, in->a2);
+        jit_emit8(em, 0x3d); // cmp eax, last word
+        jit_emit32(em, emu_st->mem_sz - sizeof(UWORD));
+        side[*side_ct] = (JitSideExit){.disp = jit_emit_jump(em, JIT_CC_JA), .pc = pc, .left = left};
+        (*side_ct)++;
+        static const BYTE load[] = {0x41, 0x8b, 0x04, 0x04}; // mov eax, [r12 + rax]
+        jit_emit_bytes(em, load, sizeof(load));
+        jit_emit_reg_op(em, JIT_OP_STORE, JIT_EAX, in->a1);
+        break;
+    }
+    case EOP_STW: {
+        jit_emit_reg_op(em, JIT_OP_LOAD, JIT_EAX, in->a1);
+        jit_emit8(em, 0x3d); // cmp eax, last word
+        jit_emit32(em, emu_st->mem_sz - sizeof(UWORD));
+        side[*side_ct] = (JitSideExit){.disp = jit_emit_jump(em, JIT_CC_JA), .pc = pc, .left = left};
+        (*side_ct)++;
+        // stores overlapping code are left to the interpreter so the caches get invalidated
+        jit_emit8(em, 0x8d); // lea ecx, [rax + 3 - code_base]
+        jit_emit8(em, 0x88);
+        jit_emit32(em, (sizeof(UWORD) - 1) - emu_st->code_base);
+        jit_emit8(em, 0x81); // cmp ecx, code_sz + 3
+        jit_emit8(em, 0xf9);
+        jit_emit32(em, emu_st->code_sz + (sizeof(UWORD) - 1));
+        side[*side_ct] = (JitSideExit){.disp = jit_emit_jump(em, JIT_CC_JB), .pc = pc, .left = left};
+        (*side_ct)++;
+        // so are the first stores to clean pages, which have to be marked dirty
+        jit_emit8(em, 0x49); // mov rdx, [r13 + page_flags]
+        jit_emit8(em, 0x8b);
+        jit_emit8(em, 0x95);
+        jit_emit32(em, offsetof(EmulatorState, page_flags));
+        static const BYTE first_page[] = {
+            0x89, 0xc1,                       // mov ecx, eax
+            0xc1, 0xe9, EMU_PAGE_SHIFT,       // shr ecx, EMU_PAGE_SHIFT
+            0xf6, 0x04, 0x0a, EMU_PAGE_DIRTY, // test byte [rdx + rcx], EMU_PAGE_DIRTY
+        };
+        jit_emit_bytes(em, first_page, sizeof(first_page));
+        side[*side_ct] = (JitSideExit){.disp = jit_emit_jump(em, JIT_CC_JZ), .pc = pc, .left = left};
+        (*side_ct)++;
+        static const BYTE last_page[] = {
+            0x8d, 0x48, sizeof(UWORD) - 1,    // lea ecx, [rax + 3]
+            0xc1, 0xe9, EMU_PAGE_SHIFT,       // shr ecx, EMU_PAGE_SHIFT
+            0xf6, 0x04, 0x0a, EMU_PAGE_DIRTY, // test byte [rdx + rcx], EMU_PAGE_DIRTY
+        };
+        jit_emit_bytes(em, last_page, sizeof(last_page));
+        side[*side_ct] = (JitSideExit){.disp = jit_emit_jump(em, JIT_CC_JZ), .pc = pc, .left = left};
+        (*side_ct)++;
+        jit_emit_reg_op(em, JIT_OP_LOAD, JIT_EDX, in->a2);
+        static const BYTE store[] = {0x41, 0x89, 0x14, 0x04}; // mov [r12 + rax], edx
+        jit_emit_bytes(em, store, sizeof(store));
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/**
+ * Translate the basic block starting at the predecoded instruction idx
+ */
+BYTE *jit_translate(JitState *jit, EmulatorState *emu_st, size_t idx) {
+    // find the extent of the block
+    size_t ct = 0;
+    bool ends_with_branch = false;
+    while (idx + ct < jit->block_ct && ct < JIT_MAX_BLOCK) {
+        const DecodedInstruction *in = &emu_st->code[idx + ct];
+        if (!jit_can_translate(in)) {
+            break;
+        }
+        ct++;
+        if (in->op == EOP_BRX || (jit_writes_a1(in) && in->a1 == REG_RPC)) {
+            ends_with_branch = true;
+            break;
+        }
+    }
+    if (ct == 0) {
+        return JIT_NO_BLOCK;
+    }
+
+    // make sure the whole block fits, otherwise start over with an empty cache
+    size_t need = (ct + 2) * JIT_MAX_INSTR_BYTES + ct * JIT_MAX_SIDE_EXITS * 32;
+    if (jit->used + need > JIT_CACHE_SIZE) {
+        return NULL;
+    }
+
+    JitEmitter em = {.buf = jit->buf + jit->used, .pos = 0};
+    JitSideExit side[JIT_MAX_BLOCK * JIT_MAX_SIDE_EXITS];
+    size_t side_ct = 0;
+
+    jit_emit_ticks(&em, true, ct);
+    for (size_t i = 0; i < ct; i++) {
+        const DecodedInstruction *in = &emu_st->code[idx + i];
+        UWORD pc = emu_st->code_base + (idx + i) * INSTR_SIZE;
+        jit_emit_instruction(&em, emu_st, in, pc, ct - i, side, &side_ct);
+    }
+
+    // leave the block
+    const DecodedInstruction *last = &emu_st->code[idx + ct - 1];
+    UWORD next_pc = emu_st->code_base + (idx + ct) * INSTR_SIZE;
+    if (!ends_with_branch) {
+        jit_emit_static_exit(&em, jit, next_pc);
+    } else if (last->op == EOP_BRX) {
+        // brx a1 a2: jump to a1 if a2 > 0
+        jit_emit_reg_op(&em, JIT_OP_LOAD, JIT_EAX, last->a2);
+        jit_emit8(&em, 0x85); // test eax, eax
+        jit_emit8(&em, 0xc0);
+        size_t not_taken = jit_emit_jump(&em, JIT_CC_JZ);
+        jit_emit_reg_op(&em, JIT_OP_LOAD, JIT_EAX, last->a1);
+        jit_emit_reg_op(&em, JIT_OP_STORE, JIT_EAX, REG_RPC);
+        jit_emit_exit(&em, jit, JIT_EXIT_DYNAMIC);
+        jit_patch_jump(em.buf + not_taken, em.buf + em.pos);
+        jit_emit_static_exit(&em, jit, next_pc);
+    } else if (last->op == EOP_SET) {
+        jit_emit_static_exit(&em, jit, last->imm);
+    } else {
+        jit_emit_exit(&em, jit, JIT_EXIT_DYNAMIC);
+    }
+
+    // side exits go out of line
+    for (size_t i = 0; i < side_ct; i++) {
+        jit_patch_jump(em.buf + side[i].disp, em.buf + em.pos);
+        jit_emit_side_exit(&em, jit, side[i].pc, side[i].left);
+    }
+
+    BYTE *entry = em.buf;
+    jit->used += em.pos;
+    jit->translated++;
+    return entry;
+}
+
+/* #endregion */
+
+/* #region Cache */
+
+/**
+ * Drop all translated blocks
+ */
+void jit_flush(JitState *jit, EmulatorState *emu_st) {
+    free(jit->blocks);
+    jit->block_ct = emu_st->code_sz / INSTR_SIZE;
+    jit->blocks = calloc(jit->block_ct ? jit->block_ct : 1, sizeof(BYTE *));
+    jit->code_gen = emu_st->code_gen;
+    if (jit_set_writable(jit, true)) {
+        jit_emit_trampoline(jit); // otherwise the trampoline already in the cache is kept
+    }
+}
+
+/**
+ * Find or translate the block starting at pc. Returns NULL if pc has to be interpreted.
+ */
+BYTE *jit_lookup(JitState *jit, EmulatorState *emu_st, UWORD pc) {
+    UWORD off = pc - emu_st->code_base;
+    if (off >= emu_st->code_sz || (off % INSTR_SIZE) != 0) {
+        return NULL; // only the predecoded code section is translated
+    }
+    size_t idx = off / INSTR_SIZE;
+    BYTE *block = jit->blocks[idx];
+    if (!block) {
+        if (!jit_set_writable(jit, true)) {
+            return NULL;
+        }
+        block = jit_translate(jit, emu_st, idx);
+        if (!block) {
+            // code cache is full
+            jit_flush(jit, emu_st);
+            block = jit_translate(jit, emu_st, idx);
+        }
+        jit->blocks[idx] = block;
+    }
+    return block == JIT_NO_BLOCK ? NULL : block;
+}
+
+/* #endregion */
+
+/* #region Check Mode */
+
+/*
+ * Only pages a state has written since it was reset can be nonzero, so the memory of the two states is copied and
+ * compared over the pages either has touched, never the whole reservation.
+ */
+
+/**
+ * Make the memory of dst identical to src
+ */
+void jit_copy_touched(EmulatorState *dst, EmulatorState *src) {
+    for (size_t i = 0; i < src->touched_ct; i++) {
+        size_t addr = (size_t)src->touched_list[i] << EMU_PAGE_SHIFT;
+        size_t size = emu_page_size(src, src->touched_list[i]);
+        memcpy(dst->mem + addr, src->mem + addr, size);
+        emu_mark_written(dst, addr, size);
+    }
+    // pages src never wrote are zero there; the ones added above are all touched in src
+    for (size_t i = 0; i < dst->touched_ct; i++) {
+        size_t page = dst->touched_list[i];
+        if (!(src->page_flags[page] & EMU_PAGE_TOUCHED)) {
+            memset(dst->mem + (page << EMU_PAGE_SHIFT), 0, emu_page_size(dst, page));
+        }
+    }
+}
+
+/**
+ * Compare the memory of the two states, printing every differing byte if report is set
+ */
+bool jit_same_touched(EmulatorState *emu_st, EmulatorState *shadow, bool report) {
+    bool same = true;
+    EmulatorState *sides[2] = {emu_st, shadow};
+    for (int s = 0; s < 2; s++) {
+        for (size_t i = 0; i < sides[s]->touched_ct; i++) {
+            size_t page = sides[s]->touched_list[i];
+            if (s == 1 && (emu_st->page_flags[page] & EMU_PAGE_TOUCHED)) {
+                continue; // compared with the pages of emu_st
+            }
+            size_t addr = page << EMU_PAGE_SHIFT;
+            size_t size = emu_page_size(emu_st, page);
+            if (memcmp(shadow->mem + addr, emu_st->mem + addr, size) == 0) {
+                continue;
+            }
+            same = false;
+            for (size_t a = addr; report && a < addr + size; a++) {
+                if (shadow->mem[a] != emu_st->mem[a]) {
+                    printf("  mem[$%04lx]: jit $%02x, interpreter $%02x\n", a, emu_st->mem[a], shadow->mem[a]);
+                }
+            }
+        }
+    }
+    return same;
+}
+
+/**
+ * Make the shadow interpreter state identical to the jitted state
+ */
+void jit_shadow_sync(JitState *jit, EmulatorState *emu_st) {
+    EmulatorState *shadow = jit->shadow;
+    memcpy(shadow->reg, emu_st->reg, REGISTER_COUNT * sizeof(UWORD));
+    jit_copy_touched(shadow, emu_st);
+    shadow->ticks = emu_st->ticks;
+    shadow->executing = emu_st->executing;
+    if (shadow->code_base != emu_st->code_base || shadow->code_sz != emu_st->code_sz ||
+        shadow->code_gen != emu_st->code_gen) {
+        emu_predecode(shadow, emu_st->code_base, emu_st->code_sz);
+        shadow->code_gen = emu_st->code_gen;
+    }
+}
+
+/**
+ * Run the shadow interpreter up to the jitted tick count and compare the results
+ */
+bool jit_shadow_check(JitState *jit, EmulatorState *emu_st, UWORD block_pc) {
+    EmulatorState *shadow = jit->shadow;
+    while (shadow->ticks < emu_st->ticks && shadow->executing) {
+        emu_step(shadow);
+    }
+    bool same = shadow->ticks == emu_st->ticks &&
+                memcmp(shadow->reg, emu_st->reg, REGISTER_COUNT * sizeof(UWORD)) == 0 &&
+                jit_same_touched(emu_st, shadow, false);
+    if (!same) {
+        jit->mismatches++;
+        printf("JIT CHECK FAILED: block $%04x, ticks %lu (interpreter %lu)\n", block_pc, emu_st->ticks,
+               shadow->ticks);
+        for (ARG i = 0; i < REGISTER_COUNT; i++) {
+            if (shadow->reg[i] != emu_st->reg[i]) {
+                printf("%5s: jit $%08x, interpreter $%08x\n", get_register_name(i), emu_st->reg[i], shadow->reg[i]);
+            }
+        }
+        jit_same_touched(emu_st, shadow, true);
+        // continue from the interpreter's result
+        memcpy(emu_st->reg, shadow->reg, REGISTER_COUNT * sizeof(UWORD));
+        jit_copy_touched(emu_st, shadow);
+        emu_st->ticks = shadow->ticks;
+    }
+    return same;
+}
+
+/* #endregion */
+
+/* #region Execution */
+
+/**
+ * Run translated blocks until halted or until debugging is requested
+ */
+void jit_run(EmulatorState *emu_st) {
+    JitState *jit = emu_st->jit;
+    BYTE *pending_site = NULL; // static exit waiting to be chained to the next block
+    if (jit->check) {
+        jit_shadow_sync(jit, emu_st);
+    }
+    while (emu_st->executing && !emu_wants_debugger(emu_st)) {
+        if (jit->code_gen != emu_st->code_gen) {
+            jit_flush(jit, emu_st); // stores changed the code
+            pending_site = NULL;
+        }
+        if (emu_st->ticks >= emu_st->tick_limit) {
+            emu_out_of_ticks(emu_st);
+            break;
+        }
+        UWORD pc = emu_st->reg[REG_RPC];
+        size_t used = jit->used;
+        // a block could run past a budget closer than its longest length, so the last ticks are interpreted
+        BYTE *block = NULL;
+        if (emu_st->tick_limit - emu_st->ticks >= JIT_MAX_BLOCK) {
+            block = jit_lookup(jit, emu_st, pc);
+        }
+        if (jit->used < used) {
+            pending_site = NULL; // the cache was flushed to make room
+        }
+        if (block && pending_site && jit_set_writable(jit, true)) {
+            jit_patch_jump(pending_site, block);
+        }
+        pending_site = NULL;
+        if (block && !jit_set_writable(jit, false)) {
+            block = NULL; // the host refused to make the cache executable again
+        }
+        if (!block) {
+            emu_step(emu_st);
+            if (jit->check) {
+                jit_shadow_sync(jit, emu_st);
+            }
+            continue;
+        }
+
+        uintptr_t exit = jit->enter(emu_st, block);
+        if (exit == JIT_EXIT_INTERP) {
+            if (jit->check && !jit_shadow_check(jit, emu_st, pc)) {
+                emu_st->executing = false;
+                break;
+            }
+            emu_step(emu_st);
+            if (jit->check) {
+                jit_shadow_sync(jit, emu_st);
+            }
+            continue;
+        }
+        if (jit->check) {
+            if (!jit_shadow_check(jit, emu_st, pc)) {
+                emu_st->executing = false;
+                break;
+            }
+        } else if (exit != JIT_EXIT_DYNAMIC && jit->chain && emu_st->tick_limit == UINT64_MAX) {
+            // chained blocks never come back here to check a tick budget
+            pending_site = (BYTE *)exit;
+        }
+    }
+}
+
+/* #endregion */
+
+/* #region Attach and Detach */
+
+/**
+ * Attach a JIT to the emulator. Returns false if native code is not available on this host.
+ */
+bool jit_attach(EmulatorState *emu_st, bool check) {
+#if EMU_JIT
+    void *buf = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        return false;
+    }
+    JitState *jit = malloc(sizeof(JitState));
+    jit->buf = buf;
+    jit->writable = true;
+    jit->used = 0;
+    jit->blocks = NULL;
+    jit->block_ct = 0;
+    jit->chain = !check; // check mode compares after every block
+    jit->check = check;
+    jit->shadow = NULL;
+    jit->translated = 0;
+    jit->mismatches = 0;
+    jit_flush(jit, emu_st);
+    if (!jit_set_writable(jit, false)) {
+        // the host does not allow generated code to be executed
+        munmap(buf, JIT_CACHE_SIZE);
+        free(jit->blocks);
+        free(jit);
+        return false;
+    }
+    if (check) {
+        jit->shadow = emu_init(emu_st->mem_sz);
+    }
+    emu_st->jit = jit;
+    emu_st->jit_run = jit_run;
+    return true;
+#else
+    (void)emu_st;
+    (void)check;
+    return false;
+#endif
+}
+
+void jit_detach(EmulatorState *emu_st) {
+#if EMU_JIT
+    JitState *jit = emu_st->jit;
+    if (!jit) {
+        return;
+    }
+    munmap(jit->buf, JIT_CACHE_SIZE);
+    free(jit->blocks);
+    if (jit->shadow) {
+        emu_free(jit->shadow);
+    }
+    free(jit);
+    emu_st->jit = NULL;
+    emu_st->jit_run = NULL;
+#else
+    (void)emu_st;
+#endif
+}
+
+/* #endregion */
@@ -0,0 +1,243 @@
+/*
+emu_prof.h
+per-pc execution counts and a calling context tree built from the cal/ret idioms
+*/
+
+#pragma once
+
+#include "buffie.h"
+#include "emu.h"
+
+#define PROF_HOT_ROWS 20
+#define PROF_ROOT 0
+
+/**
+ * One node of the calling context tree: a function reached through a particular chain of calls
+ */
+typedef struct {
+    UWORD fn;       // entry address of the function
+    size_t parent;  // caller's node
+    size_t child;   // first callee node, PROF_ROOT if none
+    size_t sibling; // next callee of the same caller, PROF_ROOT if none
+    uint64_t self;  // instructions executed in this function, not counting callees
+} ProfNode;
+
+BUFFIE_OF(ProfNode)
+
+typedef struct EmuProfile {
+    uint64_t *counts; // executions of every instruction, indexed by pc / INSTR_SIZE
+    size_t count_ct;
+    size_t lo, hi; // range of counts that are in use
+    Buffie_ProfNode nodes;
+    size_t cur; // node of the function being executed
+} EmuProfile;
+
+/* #region Recording */
+
+/**
+ * Enter fn from the current node, reusing the node if this call chain was seen before
+ */
+void prof_call(EmuProfile *prof, UWORD fn) {
+    size_t parent = prof->cur;
+    for (size_t n = prof->nodes.buf[parent].child; n != PROF_ROOT; n = prof->nodes.buf[n].sibling) {
+        if (prof->nodes.buf[n].fn == fn) {
+            prof->cur = n;
+            return;
+        }
+    }
+    ProfNode node = {.fn = fn, .parent = parent, .child = PROF_ROOT, .sibling = prof->nodes.buf[parent].child};
+    buf_push_ProfNode(&prof->nodes, node);
+    prof->cur = prof->nodes.ct - 1;
+    prof->nodes.buf[parent].child = prof->cur;
+}
+
+void prof_return(EmuProfile *prof) {
+    if (prof->cur != PROF_ROOT) {
+        prof->cur = prof->nodes.buf[prof->cur].parent;
+    }
+}
+
+/**
+ * Run without debugging until halted like emu_run_switch, counting every pc and following calls and returns.
+ * Calls and returns are recognized by the cal and ret superinstructions, which the expansions of the pseudo
+ * instructions always produce.
+ */
+void prof_run(EmulatorState *emu_st) {
+    EmuProfile *prof = emu_st->prof;
+    uint64_t ticks = emu_st->ticks;
+    UWORD *reg = emu_st->reg;
+    uint64_t *counts = prof->counts;
+    const uint64_t tick_limit = emu_st->tick_limit;
+    DecodedInstruction slot;
+    while (emu_st->executing) {
+        if (ticks >= tick_limit) {
+            emu_out_of_ticks(emu_st);
+            break;
+        }
+        UWORD pc = reg[REG_RPC];
+        const DecodedInstruction *in = emu_fetch_decoded(emu_st, pc, &slot);
+        reg[REG_RPC] += INSTR_SIZE;
+        emu_st->ticks = ticks; // current when a load or store faults
+        int ct = emu_exec_within(emu_st, in, tick_limit - ticks);
+        ticks += ct;
+
+        size_t idx = pc / INSTR_SIZE;
+        if (idx + ct <= prof->count_ct) {
+            for (int i = 0; i < ct; i++) {
+                counts[idx + i]++;
+            }
+            prof->lo = idx < prof->lo ? idx : prof->lo;
+            prof->hi = idx + ct > prof->hi ? idx + ct : prof->hi;
+        }
+        prof->nodes.buf[prof->cur].self += ct;
+        if (in->fused == EOP_CAL && ct == in->flen) {
+            prof_call(prof, reg[REG_RPC]);
+        } else if (in->fused == EOP_RET) {
+            prof_return(prof);
+        }
+
+        if (in->op == EOP_INT && emu_wants_debugger(emu_st)) {
+            break;
+        }
+    }
+    emu_st->ticks = ticks;
+}
+
+/* #endregion */
+
+/* #region Attach and Detach */
+
+/**
+ * Profile plain runs of the emulator starting at entry. Returns false if the counters cannot be allocated.
+ */
+bool prof_attach(EmulatorState *emu_st, UWORD entry) {
+    EmuProfile *prof = malloc(sizeof(EmuProfile));
+    prof->count_ct = emu_st->mem_sz / INSTR_SIZE;
+    // reserved like guest memory, so only the pages of counters for code that runs are committed
+    prof->counts = (uint64_t *)emu_mem_map(prof->count_ct * sizeof(uint64_t));
+    if (prof->counts == NULL) {
+        free(prof);
+        return false;
+    }
+    prof->lo = prof->count_ct;
+    prof->hi = 0;
+    buf_alloc_ProfNode(&prof->nodes, 64);
+    ProfNode root = {.fn = entry, .parent = PROF_ROOT, .child = PROF_ROOT, .sibling = PROF_ROOT};
+    buf_push_ProfNode(&prof->nodes, root);
+    prof->cur = PROF_ROOT;
+    emu_st->prof = prof;
+    emu_st->prof_run = prof_run;
+    return true;
+}
+
+void prof_detach(EmulatorState *emu_st) {
+    EmuProfile *prof = emu_st->prof;
+    if (!prof) {
+        return;
+    }
+    emu_mem_unmap((BYTE *)prof->counts, prof->count_ct * sizeof(uint64_t));
+    buf_free_ProfNode(&prof->nodes);
+    free(prof);
+    emu_st->prof = NULL;
+    emu_st->prof_run = NULL;
+}
+
+/* #endregion */
+
+/* #region Reports */
+
+typedef struct {
+    UWORD key;
+    uint64_t count;
+} ProfEntry;
+
+int prof_entry_cmp(const void *a, const void *b) {
+    const ProfEntry *ea = a;
+    const ProfEntry *eb = b;
+    if (ea->count != eb->count) {
+        return ea->count < eb->count ? 1 : -1;
+    }
+    return ea->key < eb->key ? -1 : ea->key > eb->key;
+}
+
+/**
+ * Print the hottest instructions and the functions with the most self time
+ */
+void prof_dump_hot(EmulatorState *emu_st) {
+    EmuProfile *prof = emu_st->prof;
+    uint64_t total = 0;
+    size_t used = 0;
+    for (size_t i = prof->lo; i < prof->hi; i++) {
+        total += prof->counts[i];
+        used += prof->counts[i] > 0;
+    }
+
+    ProfEntry *hot = malloc((used ? used : 1) * sizeof(ProfEntry));
+    size_t hot_ct = 0;
+    for (size_t i = prof->lo; i < prof->hi; i++) {
+        if (prof->counts[i] > 0) {
+            hot[hot_ct++] = (ProfEntry){.key = i * INSTR_SIZE, .count = prof->counts[i]};
+        }
+    }
+    qsort(hot, hot_ct, sizeof(ProfEntry), prof_entry_cmp);
+    printf("-- HOT INSTRUCTIONS --\n");
+    printf("%8s %14s %7s  instruction\n", "pc", "count", "%");
+    for (size_t i = 0; i < hot_ct && i < PROF_HOT_ROWS; i++) {
+        printf("   $%04x %14lu %6.2f%%  ", hot[i].key, hot[i].count, 100.0 * hot[i].count / total);
+        dump_instruction(emu_fetch(emu_st, hot[i].key), false);
+    }
+    free(hot);
+
+    // self time per function, summed over every chain of calls that reached it
+    ProfEntry *fns = malloc(prof->nodes.ct * sizeof(ProfEntry));
+    size_t fn_ct = 0;
+    for (size_t n = 0; n < prof->nodes.ct; n++) {
+        ProfNode *node = &prof->nodes.buf[n];
+        size_t f = 0;
+        while (f < fn_ct && fns[f].key != node->fn) {
+            f++;
+        }
+        if (f == fn_ct) {
+            fns[fn_ct++] = (ProfEntry){.key = node->fn, .count = 0};
+        }
+        fns[f].count += node->self;
+    }
+    qsort(fns, fn_ct, sizeof(ProfEntry), prof_entry_cmp);
+    printf("-- HOT FUNCTIONS --\n");
+    printf("%8s %14s %7s\n", "entry", "self", "%");
+    for (size_t i = 0; i < fn_ct && i < PROF_HOT_ROWS; i++) {
+        printf("   $%04x %14lu %6.2f%%\n", fns[i].key, fns[i].count, total ? 100.0 * fns[i].count / total : 0.0);
+    }
+    free(fns);
+}
+
+/**
+ * Write one line per call chain with its self time, in the folded format flamegraph tools read.
+ * Frames are named by function entry address, outermost first.
+ */
+bool prof_write_folded(EmulatorState *emu_st, const char *path) {
+    EmuProfile *prof = emu_st->prof;
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return false;
+    }
+    size_t *chain = malloc(prof->nodes.ct * sizeof(size_t));
+    for (size_t n = 0; n < prof->nodes.ct; n++) {
+        if (prof->nodes.buf[n].self == 0) {
+            continue;
+        }
+        size_t depth = 0;
+        for (size_t c = n; c != PROF_ROOT; c = prof->nodes.buf[c].parent) {
+            chain[depth++] = c;
+        }
+        fprintf(fp, "$%04x", prof->nodes.buf[PROF_ROOT].fn);
+        while (depth > 0) {
+            fprintf(fp, ";$%04x", prof->nodes.buf[chain[--depth]].fn);
+        }
+        fprintf(fp, " %lu\n", prof->nodes.buf[n].self);
+    }
+    free(chain);
+    return fclose(fp) == 0;
+}
+
+/* #endregion */
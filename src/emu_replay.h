@@ -0,0 +1,186 @@
+/*
+emu_replay.h
+periodic checkpoints of a run, so the debugger can step backwards and seek to any tick
+*/
+
+#pragma once
+
+#include "emu.h"
+
+#define REPLAY_DEFAULT_INTERVAL 100000 // ticks between checkpoints
+#define REPLAY_MAX_CHECKPOINTS 128     // when full, every other checkpoint is dropped and the interval doubles
+
+/*
+ * Nothing the host supplies reaches guest registers or memory: interrupts only print, wait for a line that is thrown
+ * away, or toggle debugging. So a run is determined by its starting state, and re-executing from a checkpoint with
+ * interrupts muted reproduces it exactly.
+ */
+
+typedef struct EmuReplay {
+    EmuSnapshot *checkpoints[REPLAY_MAX_CHECKPOINTS]; // in order of ticks
+    size_t checkpoint_ct;
+    uint64_t interval;
+    uint64_t limit; // tick budget of the run being recorded
+} EmuReplay;
+
+/* #region Checkpoints */
+
+/**
+ * Tick at which the next checkpoint is due
+ */
+uint64_t replay_next(EmuReplay *rp) {
+    return rp->checkpoint_ct ? rp->checkpoints[rp->checkpoint_ct - 1]->ticks + rp->interval : 0;
+}
+
+/**
+ * Tick budget to run the debugger modes with: stop at the next checkpoint or at the end of the run's budget
+ */
+uint64_t replay_stop(EmuReplay *rp) {
+    uint64_t next = replay_next(rp);
+    return next < rp->limit ? next : rp->limit;
+}
+
+void replay_clear(EmuReplay *rp) {
+    for (size_t i = 0; i < rp->checkpoint_ct; i++) {
+        emu_snapshot_free(rp->checkpoints[i]);
+    }
+    rp->checkpoint_ct = 0;
+}
+
+/**
+ * Checkpoint the current state, which must be past the last checkpoint
+ */
+void replay_checkpoint(EmulatorState *emu_st) {
+    EmuReplay *rp = emu_st->replay;
+    if (rp->checkpoint_ct == REPLAY_MAX_CHECKPOINTS) {
+        // keep the first checkpoint and every second one after it
+        size_t kept = 1;
+        for (size_t i = 1; i < rp->checkpoint_ct; i++) {
+            if (i % 2 == 0) {
+                rp->checkpoints[kept++] = rp->checkpoints[i];
+            } else {
+                emu_snapshot_free(rp->checkpoints[i]);
+            }
+        }
+        rp->checkpoint_ct = kept;
+        rp->interval *= 2;
+    }
+    rp->checkpoints[rp->checkpoint_ct++] = emu_snapshot(emu_st);
+}
+
+/**
+ * Latest checkpoint at or before tick
+ */
+EmuSnapshot *replay_find(EmuReplay *rp, uint64_t tick) {
+    size_t lo = 0;
+    size_t hi = rp->checkpoint_ct;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (rp->checkpoints[mid]->ticks <= tick) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return rp->checkpoints[lo];
+}
+
+/* #endregion */
+
+/* #region Recording and Seeking */
+
+/**
+ * Run in the modes the debug flags select, checkpointing every interval ticks
+ */
+void replay_run(EmulatorState *emu_st) {
+    EmuReplay *rp = emu_st->replay;
+    replay_clear(rp);
+    rp->limit = emu_st->tick_limit;
+    replay_checkpoint(emu_st);
+    emu_break_entry(emu_st);
+    while (emu_st->executing) {
+        emu_st->tick_limit = replay_stop(rp);
+        emu_run_modes(emu_st);
+        emu_st->tick_limit = rp->limit;
+        if (emu_st->exit == EMU_EXIT_TICKS && emu_st->ticks < rp->limit) {
+            // stopped for a checkpoint, not for the budget
+            emu_st->executing = true;
+            emu_st->exit = EMU_EXIT_NONE;
+            replay_checkpoint(emu_st);
+        }
+    }
+}
+
+/**
+ * Execute quietly until ticks reaches target or the program halts. Superinstructions are only used when they end
+ * by target, so the run stops exactly on it.
+ */
+void replay_exec_to(EmulatorState *emu_st, uint64_t target) {
+    EmuReplay *rp = emu_st->replay;
+    DecodedInstruction slot;
+    while (emu_st->executing && emu_st->ticks < target) {
+        if (emu_st->ticks >= replay_next(rp)) {
+            replay_checkpoint(emu_st);
+        }
+        const DecodedInstruction *in = emu_fetch_decoded(emu_st, emu_st->reg[REG_RPC], &slot);
+        emu_st->reg[REG_RPC] += INSTR_SIZE;
+        emu_st->ticks += emu_exec_within(emu_st, in, target - emu_st->ticks);
+    }
+}
+
+/**
+ * Bring the emulator to the state it had after target ticks, restoring the nearest checkpoint and re-executing from
+ * there. Debug flags are kept as they are. Returns false if the program halts before target.
+ */
+bool replay_seek(EmulatorState *emu_st, uint64_t target) {
+    EmuReplay *rp = emu_st->replay;
+    if (target > rp->limit) {
+        target = rp->limit;
+    }
+    bool debug = emu_st->debug;
+    bool onestep = emu_st->onestep;
+    bool quiet = emu_st->quiet;
+    EmuSnapshot *from = replay_find(rp, target);
+    // going forward, a checkpoint is only worth restoring if it skips ahead
+    if (target < emu_st->ticks || !emu_st->executing || from->ticks > emu_st->ticks) {
+        emu_restore(emu_st, from);
+    }
+    emu_st->quiet = true;
+    replay_exec_to(emu_st, target);
+    emu_st->quiet = quiet;
+    emu_st->debug = debug;
+    emu_st->onestep = onestep;
+    emu_st->tick_limit = replay_stop(rp);
+    return emu_st->ticks == target;
+}
+
+/* #endregion */
+
+/* #region Attach and Detach */
+
+/**
+ * Checkpoint runs of the emulator every interval ticks, so the debugger can seek within them
+ */
+void replay_attach(EmulatorState *emu_st, uint64_t interval) {
+    EmuReplay *rp = malloc(sizeof(EmuReplay));
+    rp->checkpoint_ct = 0;
+    rp->interval = interval > 0 ? interval : REPLAY_DEFAULT_INTERVAL;
+    rp->limit = UINT64_MAX;
+    emu_st->replay = rp;
+    emu_st->replay_run = replay_run;
+    emu_st->replay_seek = replay_seek;
+}
+
+void replay_detach(EmulatorState *emu_st) {
+    EmuReplay *rp = emu_st->replay;
+    if (!rp) {
+        return;
+    }
+    replay_clear(rp);
+    free(rp);
+    emu_st->replay = NULL;
+    emu_st->replay_run = NULL;
+    emu_st->replay_seek = NULL;
+}
+
+/* #endregion */
@@ -0,0 +1,340 @@
+/*
+emu_trace.h
+compact binary execution traces, and reading them back
+*/
+
+#pragma once
+
+#include "emu.h"
+
+#define TRACE_MAGIC "rgt"
+#define TRACE_VERSION 1
+#define TRACE_BUF_SIZE (1024 * 1024) // bytes collected before each write
+#define TRACE_RECORD_MAX 64          // worst case bytes per record
+#define TRACE_REGISTERS 32           // REGISTER_COUNT, which is not a constant expression
+
+// record tag bits
+#define TRACE_TAG_JUMP 0x01      // pc is not the one after the previous instruction, a zigzag delta follows
+#define TRACE_TAG_STORE 0x02     // a word was stored: address, then value
+#define TRACE_TAG_REG_SHIFT 2    // bits 2-3: number of register changes
+#define TRACE_TAG_END 0xff       // end of trace: final pc and ticks
+#define TRACE_MAX_REG_CHANGES 3
+
+/*
+ * File layout: "rgt", a version byte, the u64 starting tick, and all registers as u32. Then one record per
+ * instruction: a tag byte, the pc delta if TRACE_TAG_JUMP is set, the raw instruction word, the register changes
+ * (register index byte and zigzag varint of the difference), and the store if TRACE_TAG_STORE is set. Unsigned
+ * numbers are LEB128 varints except for the raw word and fixed header fields, which are little endian.
+ */
+
+typedef struct EmuTrace {
+    FILE *fp;
+    BYTE *buf;
+    size_t pos;
+    UWORD next_pc; // pc the next record is relative to
+    UWORD reg[TRACE_REGISTERS];
+    uint64_t records;
+    bool failed;
+} EmuTrace;
+
+/* #region Encoding */
+
+void trace_flush(EmuTrace *tr) {
+    if (tr->pos > 0 && fwrite(tr->buf, tr->pos, 1, tr->fp) != 1) {
+        tr->failed = true;
+    }
+    tr->pos = 0;
+}
+
+void trace_put_varint(EmuTrace *tr, uint64_t val) {
+    while (val >= 0x80) {
+        tr->buf[tr->pos++] = (val & 0x7f) | 0x80;
+        val >>= 7;
+    }
+    tr->buf[tr->pos++] = val;
+}
+
+void trace_put_fixed(EmuTrace *tr, uint64_t val, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        tr->buf[tr->pos++] = (val >> (i * 8)) & 0xff;
+    }
+}
+
+uint64_t trace_zigzag(int64_t val) { return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63); }
+
+/**
+ * Append the record for the instruction in at pc, which has just run. The register file before it is in tr->reg.
+ */
+void trace_record(EmuTrace *tr, EmulatorState *emu_st, const DecodedInstruction *in, UWORD pc, UWORD store_addr,
+                  UWORD store_val) {
+    if (tr->pos + TRACE_RECORD_MAX > TRACE_BUF_SIZE) {
+        trace_flush(tr);
+    }
+    size_t tag_pos = tr->pos++;
+    BYTE tag = 0;
+    if (pc != tr->next_pc) {
+        tag |= TRACE_TAG_JUMP;
+        trace_put_varint(tr, trace_zigzag((int64_t)(int32_t)(pc - tr->next_pc)));
+    }
+    BYTE raw[] = {in->opcode, in->a1, in->a2, in->a3};
+    memcpy(tr->buf + tr->pos, raw, sizeof(raw));
+    tr->pos += sizeof(raw);
+
+    // pc is implied by the next record
+    BYTE changes = 0;
+    for (ARG r = REG_RPC + 1; r < TRACE_REGISTERS && changes < TRACE_MAX_REG_CHANGES; r++) {
+        if (emu_st->reg[r] != tr->reg[r]) {
+            tr->buf[tr->pos++] = r;
+            trace_put_varint(tr, trace_zigzag((int64_t)(int32_t)(emu_st->reg[r] - tr->reg[r])));
+            tr->reg[r] = emu_st->reg[r];
+            changes++;
+        }
+    }
+    tag |= changes << TRACE_TAG_REG_SHIFT;
+    if (in->op == EOP_STW) {
+        tag |= TRACE_TAG_STORE;
+        trace_put_varint(tr, store_addr);
+        trace_put_fixed(tr, store_val, sizeof(UWORD));
+    }
+    tr->buf[tag_pos] = tag;
+    tr->next_pc = pc + INSTR_SIZE;
+    tr->records++;
+}
+
+/**
+ * Run without debugging until halted, one instruction at a time, writing a record for each
+ */
+void trace_run(EmulatorState *emu_st) {
+    EmuTrace *tr = emu_st->trace;
+    UWORD *reg = emu_st->reg;
+    DecodedInstruction slot;
+    while (emu_st->executing) {
+        if (emu_st->ticks >= emu_st->tick_limit) {
+            emu_out_of_ticks(emu_st);
+            break;
+        }
+        UWORD pc = reg[REG_RPC];
+        const DecodedInstruction *in = emu_fetch_decoded(emu_st, pc, &slot);
+        // the store operands are gone once the instruction ran
+        UWORD store_addr = reg[in->a1 % TRACE_REGISTERS];
+        UWORD store_val = reg[in->a2 % TRACE_REGISTERS];
+        BYTE op = in->op;
+        reg[REG_RPC] += INSTR_SIZE;
+        emu_exec(emu_st, in);
+        emu_st->ticks++;
+        trace_record(tr, emu_st, in, pc, store_addr, store_val);
+        if (op == EOP_INT && emu_wants_debugger(emu_st)) {
+            break;
+        }
+    }
+}
+
+/* #endregion */
+
+/* #region Attach and Detach */
+
+/**
+ * Trace plain runs of the emulator starting at entry to a file. The current registers and ticks go in the header.
+ */
+bool trace_attach(EmulatorState *emu_st, const char *path, UWORD entry) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return false;
+    }
+    EmuTrace *tr = malloc(sizeof(EmuTrace));
+    tr->fp = fp;
+    tr->buf = malloc(TRACE_BUF_SIZE);
+    tr->pos = 0;
+    tr->records = 0;
+    tr->failed = false;
+    memcpy(tr->reg, emu_st->reg, sizeof(tr->reg));
+    tr->reg[REG_RPC] = entry;
+    tr->next_pc = entry;
+
+    memcpy(tr->buf, TRACE_MAGIC, 3);
+    tr->buf[3] = TRACE_VERSION;
+    tr->pos = 4;
+    trace_put_fixed(tr, emu_st->ticks, sizeof(uint64_t));
+    for (size_t r = 0; r < TRACE_REGISTERS; r++) {
+        trace_put_fixed(tr, tr->reg[r], sizeof(UWORD));
+    }
+    emu_st->trace = tr;
+    emu_st->trace_run = trace_run;
+    return true;
+}
+
+/**
+ * Finish the trace with the final pc and ticks and close it. Returns false if anything could not be written.
+ */
+bool trace_detach(EmulatorState *emu_st) {
+    EmuTrace *tr = emu_st->trace;
+    if (!tr) {
+        return true;
+    }
+    if (tr->pos + TRACE_RECORD_MAX > TRACE_BUF_SIZE) {
+        trace_flush(tr);
+    }
+    tr->buf[tr->pos++] = TRACE_TAG_END;
+    trace_put_fixed(tr, emu_st->reg[REG_RPC], sizeof(UWORD));
+    trace_put_fixed(tr, emu_st->ticks, sizeof(uint64_t));
+    trace_flush(tr);
+    bool ok = fclose(tr->fp) == 0 && !tr->failed;
+    free(tr->buf);
+    free(tr);
+    emu_st->trace = NULL;
+    emu_st->trace_run = NULL;
+    return ok;
+}
+
+/* #endregion */
+
+/* #region Decoding */
+
+typedef struct {
+    const BYTE *buf;
+    size_t size;
+    size_t pos;
+    UWORD reg[TRACE_REGISTERS];
+    UWORD next_pc;
+    uint64_t start_tick;
+    // the record just read
+    UWORD pc;
+    Instruction raw;
+    bool stored;
+    UWORD store_addr;
+    UWORD store_val;
+    bool done; // the end record was read, reg[REG_RPC] is the final pc
+} TraceReader;
+
+bool trace_get_varint(TraceReader *rd, uint64_t *val) {
+    *val = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (rd->pos >= rd->size) {
+            return false;
+        }
+        BYTE by = rd->buf[rd->pos++];
+        *val |= (uint64_t)(by & 0x7f) << shift;
+        if (!(by & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool trace_get_fixed(TraceReader *rd, uint64_t *val, size_t size) {
+    if (rd->pos + size > rd->size) {
+        return false;
+    }
+    *val = 0;
+    for (size_t i = 0; i < size; i++) {
+        *val |= (uint64_t)rd->buf[rd->pos++] << (i * 8);
+    }
+    return true;
+}
+
+int64_t trace_unzigzag(uint64_t val) { return (int64_t)(val >> 1) ^ -(int64_t)(val & 1); }
+
+/**
+ * Start reading a trace. Returns false if the header is not valid.
+ */
+bool trace_reader_init(TraceReader *rd, const BYTE *buf, size_t size) {
+    rd->buf = buf;
+    rd->size = size;
+    rd->pos = 4;
+    rd->done = false;
+    if (size < 4 || memcmp(buf, TRACE_MAGIC, 3) != 0 || buf[3] != TRACE_VERSION) {
+        return false;
+    }
+    uint64_t val;
+    if (!trace_get_fixed(rd, &rd->start_tick, sizeof(uint64_t))) {
+        return false;
+    }
+    for (size_t r = 0; r < TRACE_REGISTERS; r++) {
+        if (!trace_get_fixed(rd, &val, sizeof(UWORD))) {
+            return false;
+        }
+        rd->reg[r] = val;
+    }
+    rd->next_pc = rd->reg[REG_RPC];
+    return true;
+}
+
+/**
+ * Read the next record and apply it to the register file, except for pc, which is only known once the record after
+ * it is read. Returns false at the end record or if the trace is cut short.
+ */
+bool trace_next(TraceReader *rd) {
+    if (rd->done || rd->pos >= rd->size) {
+        return false;
+    }
+    BYTE tag = rd->buf[rd->pos++];
+    uint64_t val;
+    if (tag == TRACE_TAG_END) {
+        if (!trace_get_fixed(rd, &val, sizeof(UWORD))) {
+            return false;
+        }
+        rd->reg[REG_RPC] = val;
+        rd->done = true;
+        return false;
+    }
+    rd->pc = rd->next_pc;
+    if (tag & TRACE_TAG_JUMP) {
+        if (!trace_get_varint(rd, &val)) {
+            return false;
+        }
+        rd->pc += (UWORD)trace_unzigzag(val);
+    }
+    if (rd->pos + sizeof(UWORD) > rd->size) {
+        return false;
+    }
+    rd->raw = (Instruction){.opcode = rd->buf[rd->pos],
+                            .a1 = rd->buf[rd->pos + 1],
+                            .a2 = rd->buf[rd->pos + 2],
+                            .a3 = rd->buf[rd->pos + 3]};
+    rd->pos += sizeof(UWORD);
+    for (int i = 0; i < (tag >> TRACE_TAG_REG_SHIFT & 0x3); i++) {
+        if (rd->pos >= rd->size) {
+            return false;
+        }
+        ARG r = rd->buf[rd->pos++] % TRACE_REGISTERS;
+        if (!trace_get_varint(rd, &val)) {
+            return false;
+        }
+        rd->reg[r] += (UWORD)trace_unzigzag(val);
+    }
+    rd->stored = tag & TRACE_TAG_STORE;
+    if (rd->stored) {
+        if (!trace_get_varint(rd, &val)) {
+            return false;
+        }
+        rd->store_addr = val;
+        if (!trace_get_fixed(rd, &val, sizeof(UWORD))) {
+            return false;
+        }
+        rd->store_val = val;
+    }
+    rd->next_pc = rd->pc + INSTR_SIZE;
+    return true;
+}
+
+/**
+ * Pc after the record just read: where the next record starts, or the final pc
+ */
+UWORD trace_peek_pc(TraceReader *rd) {
+    if (rd->pos < rd->size && rd->buf[rd->pos] == TRACE_TAG_END) {
+        TraceReader end = *rd;
+        trace_next(&end);
+        return end.reg[REG_RPC];
+    }
+    if (rd->pos < rd->size && (rd->buf[rd->pos] & TRACE_TAG_JUMP)) {
+        TraceReader next = *rd;
+        next.pos++;
+        uint64_t val;
+        if (trace_get_varint(&next, &val)) {
+            return rd->next_pc + (UWORD)trace_unzigzag(val);
+        }
+    }
+    return rd->next_pc;
+}
+
+/* #endregion */
@@ -121,239 +121,194 @@ typedef struct {
 
 /* #endregion */
 
-#define INSTRINFO(WORDS, TYPE, OPCODE)                                                                                 \
-    (InstructionInfo) { .sz = INSTR_SIZE * WORDS, .type = TYPE, .opcode = OPCODE }
-
-InstructionInfo get_instruction_info(const char *mnem) {
-    if (streq(mnem, "nop")) {
-        return INSTRINFO(1, INSTR_OP, OP_NOP);
-    } else if (streq(mnem, "add")) {
-        return INSTRINFO(1, INSTR_OP_R_R_R, OP_ADD);
-    } else if (streq(mnem, "sub")) {
-        return INSTRINFO(1, INSTR_OP_R_R_R, OP_SUB);
-    } else if (streq(mnem, "and")) {
-        return INSTRINFO(1, INSTR_OP_R_R_R, OP_AND);
-    } else if (streq(mnem, "orr")) {
-        return INSTRINFO(1, INSTR_OP_R_R_R, OP_ORR);
-    } else if (streq(mnem, "xor")) {
-        return INSTRINFO(1, INSTR_OP_R_R_R, OP_XOR);
-    } else if (streq(mnem, "not")) {
-        return INSTRINFO(1, INSTR_OP_R_R, OP_NOT);
-    } else if (streq(mnem, "lsh")) {
-        return INSTRINFO(1, INSTR_OP_R_R_R, OP_LSH);
-    } else if (streq(mnem, "ash")) {
-        return INSTRINFO(1, INSTR_OP_R_R_R, OP_ASH);
-    } else if (streq(mnem, "tcu")) {
-        return INSTRINFO(1, INSTR_OP_R_R_R, OP_TCU);
-    } else if (streq(mnem, "tcs")) {
-        return INSTRINFO(1, INSTR_OP_R_R_R, OP_TCS);
-    } else if (streq(mnem, "set")) {
-        return INSTRINFO(1, INSTR_OP_R_I, OP_SET);
-    } else if (streq(mnem, "mov")) {
-        return INSTRINFO(1, INSTR_OP_R_R, OP_MOV);
-    } else if (streq(mnem, "ldw")) {
-        return INSTRINFO(1, INSTR_OP_R_R, OP_LDW);
-    } else if (streq(mnem, "stw")) {
-        return INSTRINFO(1, INSTR_OP_R_R, OP_STW);
-    } else if (streq(mnem, "ldb")) {
-        return INSTRINFO(1, INSTR_OP_R_R, OP_LDB);
-    } else if (streq(mnem, "stb")) {
-        return INSTRINFO(1, INSTR_OP_R_R, OP_STB);
-    } else if (streq(mnem, "hlt")) {
-        return INSTRINFO(1, INSTR_OP, OP_HLT);
-    } else if (streq(mnem, "int")) {
-        return INSTRINFO(1, INSTR_OP_R, OP_INT);
-    } else if (streq(mnem, "brx")) {
-        return INSTRINFO(1, INSTR_OP_R_R, OP_BRX);
-    } else if (streq(mnem, "jmp")) {
-        return INSTRINFO(1, INSTR_OP_R, OP_JMP);
-    } else if (streq(mnem, "jmi")) {
-        return INSTRINFO(1, INSTR_OP_I, OP_JMI);
-    } else if (streq(mnem, "psh")) {
-        return INSTRINFO(3, INSTR_OP_R, OP_PSH);
-    } else if (streq(mnem, "pop")) {
-        return INSTRINFO(3, INSTR_OP_R, OP_POP);
-    } else if (streq(mnem, "cal")) {
-        return INSTRINFO(6, INSTR_OP_R, OP_CAL);
-    } else if (streq(mnem, "ret")) {
-        return INSTRINFO(4, INSTR_OP, OP_RET);
-    } else if (streq(mnem, "swp")) {
-        return INSTRINFO(3, INSTR_OP_R_R, OP_SWP);
-    } else if (streq(mnem, "adi")) {
-        return INSTRINFO(2, INSTR_OP_R_I, OP_ADI);
-    } else if (streq(mnem, "sbi")) {
-        return INSTRINFO(2, INSTR_OP_R_I, OP_SBI);
-    } else {
-        // unrecognized mnem
-        return (InstructionInfo){.type = INSTR_INV, .opcode = OP_NOP};
+/* #region ISA Tables */
+
+/*
+ * The instruction set and register names, from which every lookup below is generated.
+ * Instruction rows: mnemonic, opcode, operand kinds, size in words once pseudo instructions are expanded, and the
+ * mnemonic's slot in the name hash. Register rows: name, register, and slot. A slot is isa_hash of the name; a
+ * row with a wrong slot would not be found by name, so isa_check_slots checks them all, and two rows sharing a slot
+ * trip -Woverride-init.
+ */
+#define ISA_INSTRUCTIONS(X)                                                                                            \
+    X(nop, OP_NOP, INSTR_OP, 1, 1)                                                                                     \
+    X(add, OP_ADD, INSTR_OP_R_R_R, 1, 17)                                                                              \
+    X(sub, OP_SUB, INSTR_OP_R_R_R, 1, 15)                                                                              \
+    X(and, OP_AND, INSTR_OP_R_R_R, 1, 52)                                                                              \
+    X(orr, OP_ORR, INSTR_OP_R_R_R, 1, 56)                                                                              \
+    X(xor, OP_XOR, INSTR_OP_R_R_R, 1, 10)                                                                              \
+    X(not, OP_NOT, INSTR_OP_R_R, 1, 6)                                                                                 \
+    X(lsh, OP_LSH, INSTR_OP_R_R_R, 1, 47)                                                                              \
+    X(ash, OP_ASH, INSTR_OP_R_R_R, 1, 42)                                                                              \
+    X(tcu, OP_TCU, INSTR_OP_R_R_R, 1, 44)                                                                              \
+    X(tcs, OP_TCS, INSTR_OP_R_R_R, 1, 9)                                                                               \
+    X(set, OP_SET, INSTR_OP_R_I, 1, 55)                                                                                \
+    X(mov, OP_MOV, INSTR_OP_R_R, 1, 11)                                                                                \
+    X(ldw, OP_LDW, INSTR_OP_R_R, 1, 31)                                                                                \
+    X(stw, OP_STW, INSTR_OP_R_R, 1, 63)                                                                                \
+    X(ldb, OP_LDB, INSTR_OP_R_R, 1, 50)                                                                                \
+    X(stb, OP_STB, INSTR_OP_R_R, 1, 18)                                                                                \
+    X(hlt, OP_HLT, INSTR_OP, 1, 30)                                                                                    \
+    X(int, OP_INT, INSTR_OP_R, 1, 54)                                                                                  \
+    X(brx, OP_BRX, INSTR_OP_R_R, 1, 33)                                                                                \
+    X(jmp, OP_JMP, INSTR_OP_R, 1, 16)                                                                                  \
+    X(jmi, OP_JMI, INSTR_OP_I, 1, 23)                                                                                  \
+    X(psh, OP_PSH, INSTR_OP_R, 3, 37)                                                                                  \
+    X(pop, OP_POP, INSTR_OP_R, 3, 60)                                                                                  \
+    X(cal, OP_CAL, INSTR_OP_R, 6, 32)                                                                                  \
+    X(ret, OP_RET, INSTR_OP, 4, 25)                                                                                    \
+    X(swp, OP_SWP, INSTR_OP_R_R, 3, 61)                                                                                \
+    X(adi, OP_ADI, INSTR_OP_R_I, 2, 40)                                                                                \
+    X(sbi, OP_SBI, INSTR_OP_R_I, 2, 0)
+
+#define ISA_REGISTERS(X)                                                                                               \
+    X(pc, REG_RPC, 4)                                                                                                  \
+    X(r1, REG_R1, 18)                                                                                                  \
+    X(r2, REG_R2, 15)                                                                                                  \
+    X(r3, REG_R3, 12)                                                                                                  \
+    X(r4, REG_R4, 9)                                                                                                   \
+    X(r5, REG_R5, 6)                                                                                                   \
+    X(r6, REG_R6, 3)                                                                                                   \
+    X(r7, REG_R7, 0)                                                                                                   \
+    X(r8, REG_R8, 61)                                                                                                  \
+    X(r9, REG_R9, 58)                                                                                                  \
+    X(r10, REG_R10, 20)                                                                                                \
+    X(r11, REG_R11, 37)                                                                                                \
+    X(r12, REG_R12, 55)                                                                                                \
+    X(r13, REG_R13, 8)                                                                                                 \
+    X(r14, REG_R14, 25)                                                                                                \
+    X(r15, REG_R15, 43)                                                                                                \
+    X(r16, REG_R16, 60)                                                                                                \
+    X(r17, REG_R17, 14)                                                                                                \
+    X(r18, REG_R18, 31)                                                                                                \
+    X(r19, REG_R19, 48)                                                                                                \
+    X(r20, REG_R20, 17)                                                                                                \
+    X(r21, REG_R21, 34)                                                                                                \
+    X(r22, REG_R22, 52)                                                                                                \
+    X(r23, REG_R23, 5)                                                                                                 \
+    X(r24, REG_R24, 22)                                                                                                \
+    X(r25, REG_R25, 40)                                                                                                \
+    X(r26, REG_R26, 57)                                                                                                \
+    X(r27, REG_R27, 11)                                                                                                \
+    X(r28, REG_R28, 28)                                                                                                \
+    X(ad, REG_RAD, 7)                                                                                                  \
+    X(at, REG_RAT, 24)                                                                                                 \
+    X(sp, REG_RSP, 54)
+
+// names accepted by the assembler but never printed
+#define ISA_REGISTER_ALIASES(X) X(r29, REG_RAD, 45)
+
+#define ISA_HASH_BITS 6
+#define ISA_HASH_MULT 0x75f44587u
+
+typedef struct {
+    const char *name; // NULL for an empty slot
+    BYTE code;        // opcode or register
+} IsaSlot;
+
+#define ISA_INFO_ROW(MNEM, OPCODE, TYPE, WORDS, SLOT)                                                                  \
+    [OPCODE] = {.type = TYPE, .opcode = OPCODE, .sz = INSTR_SIZE * WORDS},
+#define ISA_MNEM_ROW(MNEM, OPCODE, TYPE, WORDS, SLOT) [OPCODE] = #MNEM,
+#define ISA_MNEM_SLOT_ROW(MNEM, OPCODE, TYPE, WORDS, SLOT) [SLOT] = {.name = #MNEM, .code = OPCODE},
+#define ISA_REG_NAME_ROW(NAME, REG, SLOT) [REG] = #NAME,
+#define ISA_REG_SLOT_ROW(NAME, REG, SLOT) [SLOT] = {.name = #NAME, .code = REG},
+
+// indexed by opcode; opcodes without a row are INSTR_INV
+static const InstructionInfo isa_info[256] = {ISA_INSTRUCTIONS(ISA_INFO_ROW)};
+static const char *const isa_mnems[256] = {ISA_INSTRUCTIONS(ISA_MNEM_ROW)};
+static const IsaSlot isa_mnem_slots[1 << ISA_HASH_BITS] = {ISA_INSTRUCTIONS(ISA_MNEM_SLOT_ROW)};
+
+// indexed by register
+static const char *const isa_reg_names[256] = {ISA_REGISTERS(ISA_REG_NAME_ROW)[REG_RX] = "rX"};
+static const IsaSlot isa_reg_slots[1 << ISA_HASH_BITS] = {
+    ISA_REGISTERS(ISA_REG_SLOT_ROW) ISA_REGISTER_ALIASES(ISA_REG_SLOT_ROW)};
+
+#undef ISA_INFO_ROW
+#undef ISA_MNEM_ROW
+#undef ISA_MNEM_SLOT_ROW
+#undef ISA_REG_NAME_ROW
+#undef ISA_REG_SLOT_ROW
+
+/**
+ * Slot of a name of len characters in the hash tables: a multiplicative hash of its first three characters, which is
+ * perfect for the instruction and register names
+ */
+size_t isa_hash(const char *name, size_t len) {
+    UWORD key = 0;
+    for (size_t i = 0; i < 3 && i < len; i++) {
+        key |= (UWORD)(BYTE)name[i] << (8 * i);
     }
+    return (UWORD)(key * ISA_HASH_MULT) >> (32 - ISA_HASH_BITS);
 }
 
-const char *get_instruction_mnem(OPCODE op) {
-    switch (op) {
-    case OP_NOP:
-        return "nop";
-    case OP_ADD:
-        return "add";
-    case OP_SUB:
-        return "sub";
-    case OP_AND:
-        return "and";
-    case OP_ORR:
-        return "orr";
-    case OP_XOR:
-        return "xor";
-    case OP_NOT:
-        return "not";
-    case OP_LSH:
-        return "lsh";
-    case OP_ASH:
-        return "ash";
-    case OP_TCU:
-        return "tcu";
-    case OP_TCS:
-        return "tcs";
-    case OP_SET:
-        return "set";
-    case OP_MOV:
-        return "mov";
-    case OP_LDW:
-        return "ldw";
-    case OP_STW:
-        return "stw";
-    case OP_LDB:
-        return "ldb";
-    case OP_STB:
-        return "stb";
-    case OP_HLT:
-        return "hlt";
-    case OP_INT:
-        return "int";
-    case OP_BRX:
-        return "brx";
-    case OP_JMP:
-        return "jmp";
-    case OP_JMI:
-        return "jmi";
-    case OP_PSH:
-        return "psh";
-    case OP_POP:
-        return "pop";
-    case OP_CAL:
-        return "cal";
-    case OP_RET:
-        return "ret";
-    case OP_SWP:
-        return "swp";
-    case OP_ADI:
-        return "adi";
-    case OP_SBI:
-        return "sbi";
-    default:
-        return NULL; // unrecognized mnemonic
-        break;
+bool isa_check_slot(const char *name, size_t slot) {
+    size_t want = isa_hash(name, strlen(name));
+    if (want != slot) {
+        printf("ERR: ISA table row %s is in slot %zu, but its name hashes to %zu\n", name, slot, want);
     }
+    return want == slot;
 }
 
-InstructionInfo get_instruction_info_op(OPCODE opcode) {
-    const char* mnem = get_instruction_mnem(opcode);
-    return get_instruction_info(mnem);
+#define ISA_CHECK_MNEM_ROW(MNEM, OPCODE, TYPE, WORDS, SLOT) ok = isa_check_slot(#MNEM, SLOT) && ok;
+#define ISA_CHECK_REG_ROW(NAME, REG, SLOT) ok = isa_check_slot(#NAME, SLOT) && ok;
+
+/**
+ * Check that every row of the ISA tables sits in the slot its name hashes to, printing the ones that do not
+ */
+bool isa_check_slots() {
+    bool ok = true;
+    ISA_INSTRUCTIONS(ISA_CHECK_MNEM_ROW)
+    ISA_REGISTERS(ISA_CHECK_REG_ROW)
+    ISA_REGISTER_ALIASES(ISA_CHECK_REG_ROW)
+    return ok;
 }
 
-#define REG(num) REG_R##num
-#define REG_STREQ(num)                                                                                                 \
-    else if (streq(mnem, "r" #num)) {                                                                                  \
-        return REG(num);                                                                                               \
-    }
+#undef ISA_CHECK_MNEM_ROW
+#undef ISA_CHECK_REG_ROW
 
-ARG get_register(const char *mnem) {
-    if (streq(mnem, "pc")) {
-        return REG_RPC;
-    }
-    REG_STREQ(1)
-    REG_STREQ(2)
-    REG_STREQ(3)
-    REG_STREQ(4)
-    REG_STREQ(5)
-    REG_STREQ(6)
-    REG_STREQ(7)
-    REG_STREQ(8)
-    REG_STREQ(9)
-    REG_STREQ(10)
-    REG_STREQ(11)
-    REG_STREQ(12)
-    REG_STREQ(13)
-    REG_STREQ(14)
-    REG_STREQ(15)
-    REG_STREQ(16)
-    REG_STREQ(17)
-    REG_STREQ(18)
-    REG_STREQ(19)
-    REG_STREQ(20)
-    REG_STREQ(21)
-    REG_STREQ(22)
-    REG_STREQ(24)
-    REG_STREQ(25)
-    REG_STREQ(26)
-    REG_STREQ(27)
-    REG_STREQ(28)
-    else if (streq(mnem, "r29") || streq(mnem, "ad")) {
-        return REG_RAD;
-    }
-    else if (streq(mnem, "at")) {
-        return REG_RAT;
+/**
+ * Whether the name in slot is the len characters at name, which need not be null terminated
+ */
+bool isa_slot_is(const IsaSlot *slot, const char *name, size_t len) {
+    return slot->name && strncmp(slot->name, name, len) == 0 && slot->name[len] == '\0';
+}
+
+/* #endregion */
+
+/**
+ * Look up the mnemonic of len characters at mnem
+ */
+InstructionInfo get_instruction_info_n(const char *mnem, size_t len) {
+    const IsaSlot *slot = &isa_mnem_slots[isa_hash(mnem, len)];
+    if (isa_slot_is(slot, mnem, len)) {
+        return isa_info[slot->code];
     }
-    else if (streq(mnem, "sp")) {
-        return REG_RSP;
+    // unrecognized mnem
+    return (InstructionInfo){.type = INSTR_INV, .opcode = OP_NOP};
+}
+
+InstructionInfo get_instruction_info(const char *mnem) { return get_instruction_info_n(mnem, strlen(mnem)); }
+
+const char *get_instruction_mnem(OPCODE op) {
+    return isa_mnems[op]; // NULL if unrecognized
+}
+
+InstructionInfo get_instruction_info_op(OPCODE opcode) { return isa_info[opcode]; }
+
+/**
+ * Look up the register name of len characters at mnem
+ */
+ARG get_register_n(const char *mnem, size_t len) {
+    const IsaSlot *slot = &isa_reg_slots[isa_hash(mnem, len)];
+    if (isa_slot_is(slot, mnem, len)) {
+        return slot->code;
     }
     // unrecognized mnem
     return REG_RX;
 }
 
-#define REG_NAMECASE(num)                                                                                              \
-    case REG(num):                                                                                                     \
-        return "r" #num;
+ARG get_register(const char *mnem) { return get_register_n(mnem, strlen(mnem)); }
 
 const char *get_register_name(ARG reg) {
-    switch (reg) {
-        REG_NAMECASE(X);
-    case REG_RPC:
-        return "pc";
-        REG_NAMECASE(1);
-        REG_NAMECASE(2);
-        REG_NAMECASE(3);
-        REG_NAMECASE(4);
-        REG_NAMECASE(5);
-        REG_NAMECASE(6);
-        REG_NAMECASE(7);
-        REG_NAMECASE(8);
-        REG_NAMECASE(9);
-        REG_NAMECASE(10);
-        REG_NAMECASE(11);
-        REG_NAMECASE(12);
-        REG_NAMECASE(13);
-        REG_NAMECASE(14);
-        REG_NAMECASE(15);
-        REG_NAMECASE(16);
-        REG_NAMECASE(17);
-        REG_NAMECASE(18);
-        REG_NAMECASE(19);
-        REG_NAMECASE(20);
-        REG_NAMECASE(21);
-        REG_NAMECASE(22);
-        REG_NAMECASE(23);
-        REG_NAMECASE(24);
-        REG_NAMECASE(25);
-        REG_NAMECASE(26);
-        REG_NAMECASE(27);
-        REG_NAMECASE(28);
-    case REG_RAD:
-        return "ad";
-    case REG_RAT:
-        return "at";
-    case REG_RSP:
-        return "sp";
-    default:
-        return NULL; // unrecognized mnemonic
-    }
+    return isa_reg_names[reg]; // NULL if unrecognized
 }
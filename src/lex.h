@@ -7,6 +7,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+// runs of whitespace and token characters are scanned a block at a time; the scalar loop handles the rest
+#if defined(__GNUC__) && defined(__AVX2__)
+#define LEX_SCAN_WIDTH 32
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#define LEX_SCAN_WIDTH 16
+#include <immintrin.h>
+#else
+#define LEX_SCAN_WIDTH 1
+#endif
+
 typedef enum {
     UNKNOWN = 0,
     ALPHA = 1 << 0,            // abc
@@ -26,24 +37,37 @@ typedef enum {
     NUMERIC_CONSTANT = NUMERIC | NUMERIC_HEX | NUM_SPECIAL,
 } CharType;
 
+/**
+ * A slice of the source a token was lexed from, which must outlive it. The text is not null terminated.
+ */
 typedef struct {
-    char *cont;
+    const char *str; // start of the token in the source
+    int len;         // 0 for no token
     CharType kind;
+    int line, col; // where the token starts, counting from 1
 } Token;
 
-BUFFIE_OF(Token)
-
+/**
+ * Tokens as parallel arrays of slices into the source
+ */
 typedef struct {
-    Buffie_Token tokens;
+    const char *src;
+    uint32_t *offsets; // start of each token in src
+    uint32_t *lens;
+    uint16_t *kinds; // CharType of each token
+    uint32_t *lines;
+    uint32_t *cols;
     int token_count;
+    size_t cap;
+    Arena *arena; // where the arrays live
 } LexResult;
 
 typedef struct {
-    char *buf;
+    const char *buf;
     size_t size;
     size_t pos;
     int line;
-    int line_start;
+    size_t line_start;
 } LexerState;
 
 CharType classify_char(char c) {
@@ -85,6 +109,123 @@ CharType classify_char(char c) {
     return type;
 }
 
+/* #region Scanning */
+
+// byte classes of the block scanner. Each is a set of high nibbles times a set of low nibbles, so the classes of a byte
+// are the AND of two 16-entry lookups. DEL lands in LEX_B_ALPHA_P that way and is masked out separately.
+#define LEX_B_SPACE_CTL 0x01   // \t \n \r
+#define LEX_B_SPACE 0x02       // ' '
+#define LEX_B_DIRECTIVE 0x04   // '#'
+#define LEX_B_NUM_SPECIAL 0x08 // '$' '.'
+#define LEX_B_DIGIT 0x10       // 0-9
+#define LEX_B_ALPHA_A 0x20     // A-O a-o
+#define LEX_B_ALPHA_P 0x40     // P-Z p-z '_'
+#define LEX_B_HEX 0x80         // a-f
+
+const uint8_t lex_lo_nibbles[16] = {0x52, 0xf0, 0xf0, 0xf4, 0xf8, 0xf0, 0xf0, 0x70,
+                                    0x70, 0x71, 0x61, 0x20, 0x20, 0x21, 0x28, 0x60};
+const uint8_t lex_hi_nibbles[16] = {0x01, 0x00, 0x0e, 0x10, 0x20, 0x40, 0xa0, 0x40,
+                                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+uint8_t lex_byte_class(char c) {
+    uint8_t b = (uint8_t)c;
+    return b == 0x7f ? 0 : lex_lo_nibbles[b & 0xf] & lex_hi_nibbles[b >> 4];
+}
+
+/**
+ * Scanner classes that make up a CharType, or 0 if it has characters the scanner does not classify
+ */
+uint8_t lex_scan_class(CharType type) {
+    if ((type & ~(SPACE | ALPHA | NUMERIC | NUMERIC_HEX | NUM_SPECIAL | DIRECTIVE_PREFIX)) != 0) {
+        return 0;
+    }
+    uint8_t want = 0;
+    want |= (type & SPACE) ? LEX_B_SPACE_CTL | LEX_B_SPACE : 0;
+    want |= (type & ALPHA) ? LEX_B_ALPHA_A | LEX_B_ALPHA_P : 0;
+    want |= (type & NUMERIC) ? LEX_B_DIGIT : 0;
+    want |= (type & NUMERIC_HEX) ? LEX_B_HEX : 0;
+    want |= (type & NUM_SPECIAL) ? LEX_B_NUM_SPECIAL : 0;
+    want |= (type & DIRECTIVE_PREFIX) ? LEX_B_DIRECTIVE : 0;
+    return want;
+}
+
+#if LEX_SCAN_WIDTH == 32
+#define LEX_SCAN_MASK 0xffffffffu
+
+/**
+ * Bit i is set if byte i of the block is in one of the classes want. Newlines are reported in the same way.
+ */
+uint32_t lex_scan_block(const char *p, uint8_t want, uint32_t *newlines) {
+    const __m256i lo_tab = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lex_lo_nibbles));
+    const __m256i hi_tab = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lex_hi_nibbles));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i lo = _mm256_shuffle_epi8(lo_tab, _mm256_and_si256(v, nibble));
+    __m256i hi = _mm256_shuffle_epi8(hi_tab, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    __m256i cls = _mm256_and_si256(_mm256_and_si256(lo, hi), _mm256_set1_epi8((char)want));
+    __m256i out = _mm256_or_si256(_mm256_cmpeq_epi8(cls, _mm256_setzero_si256()),
+                                  _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+    *newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    return ~(uint32_t)_mm256_movemask_epi8(out);
+}
+#elif LEX_SCAN_WIDTH == 16
+#define LEX_SCAN_MASK 0xffffu
+
+#if !defined(__SSSE3__)
+__m128i lex_in_range(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+__m128i lex_is(__m128i v, char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); }
+#endif
+
+/**
+ * Bit i is set if byte i of the block is in one of the classes want. Newlines are reported in the same way.
+ */
+uint32_t lex_scan_block(const char *p, uint8_t want, uint32_t *newlines) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i in;
+#if defined(__SSSE3__)
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)lex_lo_nibbles), _mm_and_si128(v, nibble));
+    __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)lex_hi_nibbles),
+                                  _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    __m128i cls = _mm_and_si128(_mm_and_si128(lo, hi), _mm_set1_epi8((char)want));
+    in = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)),
+                          _mm_xor_si128(_mm_cmpeq_epi8(cls, _mm_setzero_si128()), _mm_set1_epi8(-1)));
+#else
+    // there is no byte shuffle before SSSE3, so the wanted classes are matched with compares
+    in = _mm_setzero_si128();
+    if (want & LEX_B_SPACE_CTL) {
+        in = _mm_or_si128(in, _mm_or_si128(lex_is(v, '\t'), _mm_or_si128(lex_is(v, '\n'), lex_is(v, '\r'))));
+    }
+    if (want & LEX_B_SPACE) {
+        in = _mm_or_si128(in, lex_is(v, ' '));
+    }
+    if (want & LEX_B_DIRECTIVE) {
+        in = _mm_or_si128(in, lex_is(v, '#'));
+    }
+    if (want & LEX_B_NUM_SPECIAL) {
+        in = _mm_or_si128(in, _mm_or_si128(lex_is(v, '$'), lex_is(v, '.')));
+    }
+    if (want & LEX_B_DIGIT) {
+        in = _mm_or_si128(in, lex_in_range(v, '0', '9'));
+    }
+    if (want & (LEX_B_ALPHA_A | LEX_B_ALPHA_P)) {
+        __m128i alpha = _mm_or_si128(lex_in_range(v, 'a', 'z'), lex_in_range(v, 'A', 'Z'));
+        in = _mm_or_si128(in, _mm_or_si128(alpha, lex_is(v, '_')));
+    }
+    if (want & LEX_B_HEX) {
+        in = _mm_or_si128(in, lex_in_range(v, 'a', 'f'));
+    }
+#endif
+    *newlines = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    return (uint32_t)_mm_movemask_epi8(in);
+}
+#endif
+
+/* #endregion */
+
 char peek_char(LexerState *st) { return st->buf[st->pos]; }
 
 CharType peek_chartype(LexerState *st) { return classify_char(peek_char(st)); }
@@ -99,114 +240,169 @@ char take_char(LexerState *st) {
     return c;
 }
 
-void take_chars(LexerState *st, char *working, CharType readType) {
-    while (st->pos < st->size && (((int)peek_chartype(st) & (int)readType) > 0)) {
-        char c = take_char(st);
-        strcat(working, &c);
+/**
+ * Advance past the run of characters in the scanner classes want, counting the lines it spans
+ */
+void scan_run(LexerState *st, uint8_t want) {
+#if LEX_SCAN_WIDTH > 1
+    while (st->pos + LEX_SCAN_WIDTH <= st->size) {
+        uint32_t newlines;
+        uint32_t stop = ~lex_scan_block(st->buf + st->pos, want, &newlines) & LEX_SCAN_MASK;
+        if (stop) {
+            newlines &= ((uint32_t)1 << __builtin_ctz(stop)) - 1;
+        }
+        if (newlines) {
+            st->line += __builtin_popcount(newlines);
+            st->line_start = st->pos + (31 - __builtin_clz(newlines)) + 1;
+        }
+        if (stop) {
+            st->pos += __builtin_ctz(stop);
+            return;
+        }
+        st->pos += LEX_SCAN_WIDTH;
     }
-}
-
-void take_chars_until(LexerState *st, char *working, CharType stopType) {
-    while (st->pos < st->size && (((int)peek_chartype(st) & (int)stopType) == 0)) {
-        char c = take_char(st);
-        strcat(working, &c);
+#endif
+    // the tail that does not fill a block
+    while (st->pos < st->size && (lex_byte_class(peek_char(st)) & want)) {
+        take_char(st);
     }
 }
 
-void skip_chars(LexerState *st, CharType skip) {
-    while (st->pos < st->size && ((int)peek_chartype(st) & (int)skip) > 0) {
+void take_chars(LexerState *st, CharType readType) {
+    uint8_t want = lex_scan_class(readType);
+    if (want) {
+        scan_run(st, want);
+        return;
+    }
+    while (st->pos < st->size && (((int)peek_chartype(st) & (int)readType) > 0)) {
         take_char(st);
     }
 }
 
+void skip_chars(LexerState *st, CharType skip) { take_chars(st, skip); }
+
 void skip_until(LexerState *st, char until) {
+    if (until == '\n') {
+        // no newline is passed on the way, so the line count stays, and memchr is vectorized by the C library
+        const char *found = memchr(st->buf + st->pos, '\n', st->size - st->pos);
+        st->pos = found ? (size_t)(found - st->buf) : st->size;
+        return;
+    }
     while (st->pos < st->size && peek_char(st) != until) {
         take_char(st);
     }
 }
 
-Token make_token_of(LexerState *st, char *working, CharType type) {
-    // copy working to new buffer
-    take_chars(st, working, type);
-    char *cont = util_strdup(working);
-    Token tok = {.kind = type, .cont = cont};
+/* #region Tokens */
+
+/**
+ * Whether the token's text is exactly str
+ */
+bool tok_is(Token tok, const char *str) { return strncmp(str, tok.str, tok.len) == 0 && str[tok.len] == '\0'; }
+
+bool tok_eq(Token a, Token b) { return a.len == b.len && memcmp(a.str, b.str, a.len) == 0; }
+
+Token lex_token(const LexResult *lexed, int i) {
+    Token tok = {.str = lexed->src + lexed->offsets[i],
+                 .len = lexed->lens[i],
+                 .kind = lexed->kinds[i],
+                 .line = lexed->lines[i],
+                 .col = lexed->cols[i]};
     return tok;
 }
 
-void reset_working(char *str) { str[0] = '\0'; }
+/**
+ * Record the token from start to the current position
+ */
+void lex_push(LexResult *res, LexerState *st, size_t start, CharType kind) {
+    if ((size_t)res->token_count == res->cap) {
+        size_t ct = res->cap;
+        res->cap *= 2;
+        res->offsets = arena_grow(res->arena, res->offsets, ct * sizeof(uint32_t), res->cap * sizeof(uint32_t));
+        res->lens = arena_grow(res->arena, res->lens, ct * sizeof(uint32_t), res->cap * sizeof(uint32_t));
+        res->kinds = arena_grow(res->arena, res->kinds, ct * sizeof(uint16_t), res->cap * sizeof(uint16_t));
+        res->lines = arena_grow(res->arena, res->lines, ct * sizeof(uint32_t), res->cap * sizeof(uint32_t));
+        res->cols = arena_grow(res->arena, res->cols, ct * sizeof(uint32_t), res->cap * sizeof(uint32_t));
+    }
+    int i = res->token_count++;
+    res->offsets[i] = start;
+    res->lens[i] = st->pos - start;
+    res->kinds[i] = kind;
+    // tokens never contain a newline, so the line is still the one they started on
+    res->lines[i] = st->line;
+    res->cols[i] = start - st->line_start + 1;
+}
+
+/**
+ * Take the run of characters of a type starting at the current one as a token
+ */
+void make_token_of(LexResult *res, LexerState *st, CharType type) {
+    size_t start = st->pos;
+    take_chars(st, type);
+    lex_push(res, st, start, type);
+}
+
+/* #endregion */
 
-LexResult lex(char *buf, size_t buf_sz) {
+/**
+ * Split buf into tokens. The token arrays are allocated in arena.
+ */
+LexResult lex(Arena *arena, const char *buf, size_t buf_sz) {
     LexerState st = {.buf = buf, .size = buf_sz, .pos = 0, .line = 1, .line_start = 0};
-    Buffie_Token tokens;
-    buf_alloc_Token(&tokens, 256);
-    size_t TOKEN_STR_SIZE = 1024;
-    char *working = util_strmk(TOKEN_STR_SIZE);
+    // sized for a token every 8 bytes or so, which covers most sources without growing
+    LexResult res = {.src = buf, .token_count = 0, .cap = 256 + buf_sz / 8, .arena = arena};
+    res.offsets = arena_alloc(arena, res.cap * sizeof(uint32_t));
+    res.lens = arena_alloc(arena, res.cap * sizeof(uint32_t));
+    res.kinds = arena_alloc(arena, res.cap * sizeof(uint16_t));
+    res.lines = arena_alloc(arena, res.cap * sizeof(uint32_t));
+    res.cols = arena_alloc(arena, res.cap * sizeof(uint32_t));
 
     while (st.pos < st.size) {
-        skip_chars(&st, SPACE);         // skip any leading whitespace
-        while (peek_char(&st) == ';') { // comments
-            skip_until(&st, '\n');      // ignore the rest of the line
-            skip_chars(&st, SPACE);     // skip any remaining space
+        skip_chars(&st, SPACE);                            // skip any leading whitespace
+        while (st.pos < st.size && peek_char(&st) == ';') { // comments
+            skip_until(&st, '\n');                         // ignore the rest of the line
+            skip_chars(&st, SPACE);                        // skip any remaining space
         }
         if (st.pos > st.size - 1) { // check if end
             break;
         }
         // process character
         char c = peek_char(&st);
-        reset_working(working);
 
         CharType c_type = classify_char(c);
         if ((c_type & ALPHA) > 0) { // start of identifier
-            buf_push_Token(&tokens, make_token_of(&st, working, IDENTIFIER));
+            make_token_of(&res, &st, IDENTIFIER);
         } else if ((c_type & NUMERIC) > 0) { // start of num literal
-            buf_push_Token(&tokens, make_token_of(&st, working, NUMERIC));
+            make_token_of(&res, &st, NUMERIC);
         } else if ((c_type & ARGSEP) > 0) {
-            buf_push_Token(&tokens, make_token_of(&st, working, ARGSEP));
+            make_token_of(&res, &st, ARGSEP);
         } else if ((c_type & MARK) > 0) {
-            buf_push_Token(&tokens, make_token_of(&st, working, MARK));
+            make_token_of(&res, &st, MARK);
         } else if ((c_type & QUOT) > 0) {
-            buf_push_Token(&tokens, make_token_of(&st, working, QUOT));
+            make_token_of(&res, &st, QUOT);
         } else if ((c_type & BIND) > 0) {
-            buf_push_Token(&tokens, make_token_of(&st, working, BIND));
+            make_token_of(&res, &st, BIND);
         } else if ((c_type & OFFSET) > 0) {
-            buf_push_Token(&tokens, make_token_of(&st, working, OFFSET));
+            make_token_of(&res, &st, OFFSET);
         } else if ((c_type & NUM_SPECIAL) > 0) {
-            buf_push_Token(&tokens, make_token_of(&st, working, NUMERIC_CONSTANT));
+            make_token_of(&res, &st, NUMERIC_CONSTANT);
         } else if ((c_type & PACK_START) > 0) {
             // start of a pack, read in pack context
-            buf_push_Token(&tokens, make_token_of(&st, working, PACK_START)); // add the packstart
+            make_token_of(&res, &st, PACK_START); // add the packstart
             // get the escape
-            reset_working(working);
-            CharType pack_escape = peek_chartype(&st);
+            CharType pack_escape = st.pos < st.size ? peek_chartype(&st) : UNKNOWN;
             if (pack_escape == QUOT) { // \'
-                buf_push_Token(&tokens, make_token_of(&st, working, QUOT));
+                make_token_of(&res, &st, QUOT);
             } else if (pack_escape == ALPHA) { // \x
-                buf_push_Token(&tokens, make_token_of(&st, working, ALPHA));
+                make_token_of(&res, &st, ALPHA);
             }
         } else if ((c_type & DIRECTIVE_PREFIX) > 0) {
-            buf_push_Token(&tokens, make_token_of(&st, working, DIRECTIVE));
+            make_token_of(&res, &st, DIRECTIVE);
         } else {
             fprintf(stderr, "unrecognized character: %c, [%d:%d]\n", c, st.line, (int)(st.pos - st.line_start) + 1);
             take_char(&st); // eat the character
         }
     }
-    free(working); // clean up working
 
-    LexResult res;
-    res.tokens = tokens;
-    res.token_count = tokens.ct;
     return res;
 }
-
-void free_lex_result(LexResult *lexed) {
-    // free all tokens
-    for (int i = 0; i < lexed->token_count; i++) {
-        Token tok = buf_get_Token(&lexed->tokens, i);
-        if (tok.cont) {
-            free(tok.cont);
-            tok.cont = NULL;
-        }
-    }
-    // free token buffie
-    buf_free_Token(&lexed->tokens);
-}
\ No newline at end of file
@@ -0,0 +1,221 @@
+#include "asm.h"
+#include "asm_ext.h"
+#include "emu.h"
+#include "emu_jit.h"
+#include "util.h"
+#include <inttypes.h>
+#include <stdio.h>
+
+#define RUN_CACHE_VERSION 1 // part of cached image names, bump when the assembler's output changes
+
+typedef struct {
+    bool debug;
+    bool step;
+    EmuDispatch dispatch;
+    bool jit;
+    bool stats;
+    size_t mem_sz;
+    uint64_t max_ticks;
+    char *cache; // directory of cached images, NULL when not caching
+} RunOptions;
+
+/**
+ * Assemble the source into a program image in arena, without the assembler's dumps. Returns false if assembly failed.
+ */
+bool run_assemble(Arena *arena, FileReadResult source, ProgramImage *img) {
+    LexResult lexed = lex(arena, source.content, source.size);
+    CompiledProgram cmp;
+    int status = assemble(arena, lexed, &cmp);
+    if (status != 0) {
+        printf("assembly failed [%d]\n", status);
+        return false;
+    }
+    *img = build_program_image(arena, cmp);
+    return true;
+}
+
+/**
+ * Save the image under path. It is written next to it under a name of its own and renamed, so a run reading the cache
+ * never sees half of it, and runs storing the same image at once never write the same file.
+ */
+bool run_cache_store(const char *path, ProgramImage img) {
+#if EMU_MMAP
+    char tmp_path[FILENAME_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        return false;
+    }
+    FILE *fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        close(fd);
+        remove(tmp_path);
+        return false;
+    }
+    bool ok = write_program_image(fp, img);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+#else
+    (void)path;
+    (void)img;
+    return false; // no mkstemp to make a private temporary file
+#endif
+}
+
+/**
+ * Load the image cached under path, checking it is a whole image first. A file that is not is removed so the next run
+ * replaces it. Returns false if there is no usable image.
+ */
+bool run_cache_load(EmulatorState *emu_st, const char *path, RGHeader *hd) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    // only the header and the size are checked here; the image itself is read once, by emu_load_file
+    char head[HEADER_SIZE];
+    bool whole = fread(head, 1, HEADER_SIZE, fp) == HEADER_SIZE && fseek(fp, 0, SEEK_END) == 0;
+    long size = whole ? ftell(fp) : 0;
+    fclose(fp);
+    if (whole) {
+        RGHeader cached = decode_header(head, size, false);
+        whole = cached.valid_magic && (long)HEADER_SIZE + cached.data_size + cached.code_size == size;
+    }
+    if (!whole) {
+        fprintf(stderr, "discarding invalid cache file %s\n", path);
+        remove(path);
+        return false;
+    }
+    return emu_load_file(emu_st, path, hd);
+}
+
+int main(int argc, char **argv) {
+    printf("[REGULAR_ad] run v1.0\n");
+    if (!isa_check_slots()) {
+        return 1;
+    }
+    if (argc < 2) {
+        printf("usage: run <in> --flags\n");
+        return 1;
+    }
+
+    char *in_file = argv[1];
+
+    RunOptions options = {
+        .debug = false,
+        .step = false,
+        .dispatch = EMU_THREADED ? EMU_DISPATCH_THREADED : EMU_DISPATCH_SWITCH,
+        .jit = false,
+        .stats = false,
+        .mem_sz = MEMORY_SIZE,
+        .max_ticks = UINT64_MAX,
+        .cache = NULL,
+    };
+
+    for (int i = 2; i < argc; i++) {
+        char *flg = argv[i];
+        if (streq(flg, "--step")) {
+            options.step = true;
+        }
+        if (streq(flg, "--debug")) {
+            options.debug = true;
+        }
+        if (streq(flg, "--dispatch=switch")) {
+            options.dispatch = EMU_DISPATCH_SWITCH;
+        }
+        if (streq(flg, "--jit")) {
+            options.jit = true;
+        }
+        if (streq(flg, "--stats")) {
+            options.stats = true;
+        }
+        if (strncmp(flg, "--mem=", 6) == 0) {
+            size_t mem_sz = util_parse_size(flg + 6);
+            if (mem_sz < MEMORY_SIZE || mem_sz > MAX_MEMORY_SIZE || mem_sz % sizeof(UWORD) != 0) {
+                fprintf(stderr, "invalid memory size: %s (64K to 4G, word aligned)\n", flg + 6);
+                return 2;
+            }
+            options.mem_sz = mem_sz;
+        }
+        if (strncmp(flg, "--max-ticks=", 12) == 0) {
+            options.max_ticks = strtoull(flg + 12, NULL, 0);
+        }
+        if (streq(flg, "--cache")) {
+            options.cache = ".";
+        }
+        if (strncmp(flg, "--cache=", 8) == 0) {
+            options.cache = flg + 8;
+        }
+    }
+
+    // read the source
+    FILE *inf_fp = fopen(in_file, "rb");
+    if (inf_fp == NULL) {
+        fprintf(stderr, "cannot open input file\n");
+        return 1;
+    }
+    FileReadResult source = util_read_file_contents(inf_fp);
+    fclose(inf_fp);
+
+    EmulatorState *emu_st = emu_init(options.mem_sz);
+    if (emu_st == NULL) {
+        fprintf(stderr, "cannot reserve %zu bytes of guest memory\n", options.mem_sz);
+        free(source.content);
+        return 1;
+    }
+    emu_st->onestep = options.step;
+    emu_st->debug = options.debug;
+    emu_st->dispatch = options.dispatch;
+    emu_st->tick_limit = options.max_ticks;
+
+    // a cached image is named by the hash of the source it was assembled from
+    char cache_path[FILENAME_MAX];
+    if (options.cache) {
+        snprintf(cache_path, sizeof(cache_path), "%s/%016" PRIx64 ".v%d.rg", options.cache,
+                 hashtable_hash(source.content, source.size), RUN_CACHE_VERSION);
+    }
+
+    double asm_start = seconds_now();
+    RGHeader hd;
+    bool cached = options.cache && run_cache_load(emu_st, cache_path, &hd);
+    if (!cached) {
+        // the image goes straight into guest memory, the cache file is only written for the next run
+        Arena arena;
+        arena_init(&arena);
+        ProgramImage img;
+        if (!run_assemble(&arena, source, &img)) {
+            arena_free(&arena);
+            free(source.content);
+            emu_free(emu_st);
+            return 2;
+        }
+        hd = emu_load(emu_st, 0, img.buf, img.size);
+        if (options.cache && !run_cache_store(cache_path, img)) {
+            fprintf(stderr, "cannot write cache file %s\n", cache_path);
+        }
+        arena_free(&arena);
+    }
+    free(source.content);
+    if (options.stats) {
+        printf("%s: %.3f s\n", cached ? "cached image" : "assembly", seconds_now() - asm_start);
+    }
+
+    if (options.jit && !jit_attach(emu_st, false)) {
+        printf("JIT not available on this host, interpreting\n");
+    }
+    double run_start = seconds_now();
+    emu_run(emu_st, hd.data_size); // jump to the start of code
+    if (options.stats) {
+        double elapsed = seconds_now() - run_start;
+        printf("run: %.3f s, %.2f MIPS\n", elapsed, elapsed > 0 ? emu_st->ticks / elapsed / 1e6 : 0.0);
+    }
+
+    // clean up
+    jit_detach(emu_st);
+    emu_free(emu_st);
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include "emu_trace.h"
+#include "util.h"
+#include <stdio.h>
+
+typedef struct {
+    bool stores;
+} TraceOptions;
+
+int main(int argc, char **argv) {
+    printf("[REGULAR_ad] trace decoder v1.0\n");
+    if (argc < 2) {
+        printf("usage: trace <in> --flags\n");
+        return 1;
+    }
+
+    char *in_file = argv[1];
+
+    TraceOptions options = {
+        .stores = false,
+    };
+
+    for (int i = 2; i < argc; i++) {
+        char *flg = argv[i];
+        if (streq(flg, "--stores")) {
+            options.stores = true;
+        }
+    }
+
+    // map input file
+    FileReadResult inf_read = util_map_file(in_file);
+    if (inf_read.content == NULL) {
+        fprintf(stderr, "cannot open input file\n");
+        return 1;
+    }
+
+    TraceReader rd;
+    if (!trace_reader_init(&rd, (const BYTE *)inf_read.content, inf_read.size)) {
+        printf("not a trace file.\n");
+        util_free_file(inf_read);
+        return 1;
+    }
+
+    // print the records the way debug mode does, using the reconstructed registers
+    EmulatorState view = {.reg = rd.reg};
+    printf("jumping to $%04x\n", rd.reg[REG_RPC]);
+    uint64_t ticks = rd.start_tick;
+    while (trace_next(&rd)) {
+        rd.reg[REG_RPC] = trace_peek_pc(&rd);
+        dump_instruction(rd.raw, true);
+        if (options.stores && rd.stored) {
+            printf("  mem[$%04x] <- $%08x\n", rd.store_addr, rd.store_val);
+        }
+        emu_dump(&view, false);
+        ticks++;
+    }
+    int status = 0;
+    if (rd.done) {
+        printf("stopped executing after %ld ticks.\n", ticks);
+    } else {
+        printf("trace is cut short after %ld ticks.\n", ticks);
+        status = 1;
+    }
+
+    // clean up
+    util_free_file(inf_read);
+
+    return status;
+}
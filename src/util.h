@@ -10,10 +10,22 @@ random utilities
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__unix__)
+#define UTIL_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define UTIL_MMAP 0
+#endif
 
 typedef struct {
     char *content;
     size_t size;
+    bool mapped; // content is a read-only file mapping, not a heap buffer
 } FileReadResult;
 
 /**
@@ -32,12 +44,63 @@ FileReadResult util_read_file_contents(FILE *fp) {
     fread(buffer, size, 1, fp); // read chunk to buffer
     buffer[size] = '\0';        // add null terminator
 
-    FileReadResult res = {.content = buffer, .size = size};
+    FileReadResult res = {.content = buffer, .size = size, .mapped = false};
     return res;
 }
 
+/**
+ * Map a file read-only instead of copying it into a buffer.
+ * Falls back to util_read_file_contents where mapping is not possible; content is NULL if the file cannot be opened.
+ * Unlike util_read_file_contents, mapped content is not null terminated. Release with util_free_file.
+ */
+FileReadResult util_map_file(const char *path) {
+    FileReadResult res = {.content = NULL, .size = 0, .mapped = false};
+#if UTIL_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return res;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+        void *content = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (content != MAP_FAILED) {
+            res.content = content;
+            res.size = sb.st_size;
+            res.mapped = true;
+        }
+    }
+    close(fd);
+    if (res.mapped) {
+        return res;
+    }
+#endif
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return res;
+    }
+    res = util_read_file_contents(fp);
+    fclose(fp);
+    return res;
+}
+
+void util_free_file(FileReadResult file) {
+#if UTIL_MMAP
+    if (file.mapped) {
+        munmap(file.content, file.size);
+        return;
+    }
+#endif
+    free(file.content);
+}
+
 bool streq(const char *s1, const char *s2) { return strcmp(s1, s2) == 0; }
 
+double seconds_now() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 // https://stackoverflow.com/questions/21133701/is-there-any-function-in-the-c-language-which-can-convert_base-base-of-decimal-number/21134322#21134322
 int convert_dec_to(int val, int base) {
     if (val == 0 || base == 10)
@@ -48,19 +111,10 @@ int convert_dec_to(int val, int base) {
 void util_getln(char *buf, int n) { fgets(buf, n, stdin); }
 
 // https://stackoverflow.com/questions/3408706/hexadecimal-string-to-byte-array-in-c/35452093#35452093
-uint8_t *datahex(char *str) {
-
-    if (str == NULL)
-        return NULL;
-
-    size_t slength = strlen(str);
-    if ((slength % 2) != 0) // must be even
-        return NULL;
-
-    size_t dlength = slength / 2;
-
-    uint8_t *data = malloc(dlength);
-    memset(data, 0, dlength);
+// decodes slength / 2 bytes into data; returns false on a character that is not hex
+bool datahex_into(uint8_t *data, const char *str, size_t slength) {
+    slength -= slength % 2; // a trailing odd digit has no byte to go in
+    memset(data, 0, slength / 2);
 
     size_t index = 0;
     while (index < slength) {
@@ -72,16 +126,31 @@ uint8_t *datahex(char *str) {
             value = (10 + (c - 'A'));
         else if (c >= 'a' && c <= 'f')
             value = (10 + (c - 'a'));
-        else {
-            free(data);
-            return NULL;
-        }
+        else
+            return false;
 
         data[(index / 2)] += value << (((index + 1) % 2) * 4);
 
         index++;
     }
 
+    return true;
+}
+
+// takes the length so str can be a slice of a larger buffer
+uint8_t *datahex(const char *str, size_t slength) {
+
+    if (str == NULL)
+        return NULL;
+
+    if ((slength % 2) != 0) // must be even
+        return NULL;
+
+    uint8_t *data = malloc(slength / 2);
+    if (!datahex_into(data, str, slength)) {
+        free(data);
+        return NULL;
+    }
     return data;
 }
 
@@ -108,3 +177,22 @@ char* util_strdup(const char* str) {
     strcpy(dst, str);
     return dst;
 }
+
+/**
+ * Parse a byte count with an optional K, M or G suffix (powers of 1024).
+ * Returns 0 if the string is not a valid size.
+ */
+size_t util_parse_size(const char *str) {
+    char *end;
+    unsigned long long val = strtoull(str, &end, 0);
+    switch (*end) {
+    case 'K': case 'k': val <<= 10; end++; break;
+    case 'M': case 'm': val <<= 20; end++; break;
+    case 'G': case 'g': val <<= 30; end++; break;
+    default: break;
+    }
+    if (end == str || *end != '\0') {
+        return 0;
+    }
+    return (size_t)val;
+}
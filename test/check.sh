@@ -0,0 +1,158 @@
+#!/usr/bin/env bash
+# checks the tools built in the build directory given as $1 against the programs in this directory
+# usage: check.sh <build dir>
+
+here=$(cd "$(dirname "$0")" && pwd)
+bin=$(cd "${1:-$here/../src/build}" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failures=0
+shopt -s nullglob
+
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# the ticks an emulator run reports in its last line
+ticks_of() {
+    grep -o 'after [0-9]* ticks' | grep -o '[0-9]*'
+}
+
+# the single pass assembler must produce the same image as the classic pipeline, and fail on the same sources
+gen="$work/generated.asm"
+{
+    echo '#entry :main'
+    echo 'jeq@ rA v_cmp v_loc :'
+    echo '    set at v_cmp'
+    echo '    tcu ad rA at'
+    echo '    set at $4'
+    echo '    add ad ad ad'
+    echo '    add ad ad ad'
+    echo '    add ad ad at'
+    echo '    add pc pc ad'
+    echo '    add pc pc at'
+    echo '    set pc v_loc'
+    echo '::'
+    echo 'main:'
+    for i in $(seq 1 2000); do
+        echo "l$i:"
+        echo "    adi r1 \$$((i % 200))"
+        echo '    psh r1'
+        echo '    pop r2'
+        echo "    jeq r2 \$$((i % 7)) ::l$((i + 1))"
+        echo "    set r3 ::l$((i + 1))"
+    done
+    echo 'l2001:'
+    echo '    hlt'
+} > "$gen"
+for src in "$here"/*.asm "$here"/check/*.asm "$gen"; do
+    name=$(basename "$src" .asm)
+    "$bin/regular-asm" "$src" "$work/$name.rg" > /dev/null
+    status=$?
+    "$bin/regular-asm" "$src" "$work/$name.src.rg" --dump-src > /dev/null
+    if [ $? -ne $status ]; then
+        fail "$name: assemble and --dump-src exit differently"
+    elif [ $status -eq 0 ] && ! cmp -s "$work/$name.rg" "$work/$name.src.rg"; then
+        fail "$name: assemble and --dump-src images differ"
+    fi
+done
+
+emu() {
+    "$bin/regular-emu" "$@" < /dev/null
+}
+
+# --max-ticks stops exactly, including inside fused pseudo instructions
+for mode in --dispatch=threaded --dispatch=switch --profile="$work/profile.folded" --replay --jit --jit-check; do
+    for max in $(seq 1 40); do
+        got=$(emu "$work/budget.rg" --max-ticks=$max "$mode" | ticks_of)
+        [ "$got" = "$max" ] || fail "budget $mode: --max-ticks=$max stopped after $got"
+    done
+done
+
+# the JIT agrees with the interpreter after every block, up to the tick budget
+if emu "$work/budget.rg" --jit-check --max-ticks=10000 | grep -q 'JIT CHECK FAILED'; then
+    fail "budget: --jit-check found a mismatch"
+fi
+
+# a batch job that cannot be read fails to load without stopping the jobs after it
+printf '%s\n' "$work/missing.rg" "$work/fib.rg" > "$work/jobs.txt"
+emu --batch "$work/jobs.txt" -j 1 --results="$work/jobs.rgb" > /dev/null
+missing=$(od -An -tu1 -j 8 -N 1 "$work/jobs.rgb" | tr -d ' ')
+after=$(od -An -tu1 -j $((8 + 137)) -N 1 "$work/jobs.rgb" | tr -d ' ')
+[ "$missing,$after" = "3,1" ] || fail "batch: exit reasons $missing,$after for a missing and a halting job"
+
+# the guard band turns accesses past the end of memory into faults, exactly at the end
+emu "$work/edge.rg" | grep -q 'accessed $00010000 outside' || fail "edge: no fault at 64K"
+emu "$work/edge.rg" --mem=65540 | grep -q FAULT && fail "edge: fault inside --mem=65540"
+"$bin/regular-run" "$here/check/edge.asm" < /dev/null | grep -q 'accessed $00010000 outside' ||
+    fail "edge: no fault at 64K under regular-run"
+
+# a store straddling the end of memory faults before writing anything, so the next batch job sees clean memory
+printf '%s\n' "$work/straddle.rg" "$work/peek.rg" > "$work/straddle.txt"
+emu --batch "$work/straddle.txt" -j 1 --results="$work/straddle.rgb" > /dev/null
+r5=$(od -An -tx4 -j $((8 + 137 + 29)) -N 4 "$work/straddle.rgb" | tr -d ' ')
+[ "$r5" = "00000000" ] || fail "straddle: the next job loaded \$$r5 from the end of memory"
+
+# a fault inside a fused expansion is reported like the unfused instruction that faulted
+fused=$(emu "$work/pushfault.rg" | grep -E 'FAULT|stopped')
+plain=$(emu "$work/pushfault.rg" --debug | grep -E 'FAULT|stopped')
+[ "$fused" = "$plain" ] || fail "pushfault: fused run reports '$fused', unfused '$plain'"
+
+# the JIT code cache is never writable and executable at the same time
+if [ -r /proc/self/maps ]; then
+    "$bin/regular-emu" "$work/spin.rg" --jit < /dev/null > /dev/null &
+    pid=$!
+    sleep 0.2
+    grep -q ' rwxp ' "/proc/$pid/maps" && fail "jit: the code cache is mapped writable and executable"
+    kill $pid
+    wait $pid 2> /dev/null
+fi
+
+
+# a breakpoint on the entry point fires before it runs, and landing on a breakpoint by seeking reports it
+for mode in --dispatch=threaded --replay; do
+    printf 'cont\n' | "$bin/regular-emu" "$work/budget.rg" --break=0 --max-ticks=100 "$mode" |
+        grep -q -- '-- BREAK: $0000 --' || fail "break $mode: no stop at the entry point"
+done
+hits=$(printf 'goto 0\ngoto 2\ncont\n' | "$bin/regular-emu" "$work/loop.rg" --break=8 --replay |
+    grep -c -- '-- BREAK: $0008 --')
+[ "$hits" = "2" ] || fail "break: seeking onto a breakpoint reported $hits stops instead of 2"
+
+# every fuzz input starts from the state right after loading
+{
+    for i in 1 2 3 4; do
+        printf '\x01\x00\x00\x00x'
+    done
+} > "$work/inputs"
+"$bin/regular-emu" "$work/counter.rg" --fuzz=0x100:4 --fuzz-fds=0,3 --fuzz-map="$work/map" \
+    < "$work/inputs" > /dev/null 2> /dev/null 3> "$work/replies"
+record=137
+first=$(tail -c +10 "$work/replies" | head -c $record | od -An -tx1 -v)
+for i in 2 3 4; do
+    reply=$(tail -c +$((10 + (i - 1) * record)) "$work/replies" | head -c $record | od -An -tx1 -v)
+    [ -n "$first" ] && [ "$reply" = "$first" ] || fail "fuzz: input $i did not start from fresh state"
+done
+
+# coverage counters stop at 255 instead of wrapping around
+printf '\x01\x00\x00\x00x' | "$bin/regular-emu" "$work/saturate.rg" --fuzz=0x100:4 --fuzz-fds=0,3 \
+    --fuzz-map="$work/saturate.map" > /dev/null 2> /dev/null 3> /dev/null
+od -An -tx1 -v "$work/saturate.map" | grep -qw ff || fail "fuzz: a branch taken 300 times did not saturate its counter"
+
+# a cached image runs like the source, and a damaged one is discarded and the source assembled again
+mkdir "$work/cache"
+want=$("$bin/regular-run" "$here/fib.asm" --cache="$work/cache" < /dev/null | ticks_of)
+got=$("$bin/regular-run" "$here/fib.asm" --cache="$work/cache" < /dev/null | ticks_of)
+[ "$got" = "$want" ] || fail "cache: cached image ran for $got ticks instead of $want"
+for image in "$work"/cache/*.rg; do
+    head -c 3 "$image" > "$image.cut" && mv "$image.cut" "$image"
+done
+got=$("$bin/regular-run" "$here/fib.asm" --cache="$work/cache" < /dev/null 2> /dev/null | ticks_of)
+[ "$got" = "$want" ] || fail "cache: damaged image ran for $got ticks instead of $want"
+
+
+if [ $failures -gt 0 ]; then
+    echo "$failures checks failed"
+    exit 1
+fi
+echo "all checks passed"
@@ -0,0 +1,16 @@
+; runs forever through every fused pseudo instruction, for checking that --max-ticks stops exactly
+
+#entry :main
+
+inc:
+    adi r2 $1
+    ret
+
+main:
+    set r4 ::inc
+loop:
+    psh r1
+    pop r3
+    cal r4
+    sbi r1 $1
+    jmi ::loop
@@ -0,0 +1,10 @@
+; increments a word in memory, so a run that does not start from fresh memory returns a higher count
+
+#entry :main
+
+main:
+    set r1 $fff0
+    ldw r6 r1
+    adi r6 $1
+    stw r1 r6
+    hlt
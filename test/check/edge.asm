@@ -0,0 +1,11 @@
+; stores to and loads from the first address past the default 64K of memory
+
+#entry :main
+
+main:
+    set r1 $8000
+    add r1 r1 r1 ; $10000
+    set r2 $1234
+    stw r1 r2
+    ldw r3 r1
+    hlt
@@ -0,0 +1,8 @@
+; loads the last word of the default 64K of memory into r5
+
+#entry :main
+
+main:
+    set r1 $fffc
+    ldw r5 r1
+    hlt
@@ -0,0 +1,9 @@
+; a push below address 0, which faults in the store of the expansion
+
+#entry :main
+
+main:
+    set r1 $beef
+    set sp $0
+    psh r1
+    hlt
@@ -0,0 +1,13 @@
+; takes the same backward branch 300 times, more than a coverage counter can count
+
+#entry :main
+
+main:
+    set r4 $12c ; loop bound
+    set r2 $0   ; loop counter
+loop:
+    tcu r3 r4 r2 ; r3 = SIGN[r4 - r2]
+    adi r2 $1
+    set r1 ::loop
+    brx r1 r3 ; branch to ::loop, if r3
+    hlt
@@ -0,0 +1,6 @@
+; runs until it is killed
+
+#entry :main
+main:
+    adi r1 $1
+    set pc ::main
@@ -0,0 +1,9 @@
+; a store whose last two bytes fall past the default 64K of memory
+
+#entry :main
+
+main:
+    set r1 $fffe
+    set r2 $1234
+    stw r1 r2
+    hlt